@@ -0,0 +1,201 @@
+/*
+ * fill_bench - the RGB run fill behind put_pixels, scalar against SSE2
+ * against AVX2.
+ *
+ * compile:
+ *     make bench
+ * or
+ *     gcc -O2 -o bench/fill_bench bench/fill_bench.c -lm -lpthread -lpng -lz
+ *
+ * usage:
+ *     bench/fill_bench [file.dex ...]
+ *
+ * Every kernel fills the same runs into the same warm bitmap, over and
+ * over for about 200 ms, and the best pass is kept. With a dex, the runs
+ * are its string_data and its code items, at their own offsets in a
+ * full-size image. Without one they are drawn at random, 8 to 64 pixels
+ * like string data and 32 to 512 like insns arrays, packed end to end.
+ * Three fixed lengths show a short run past the 16 pixels put_pixels
+ * sends to the scalar loop, the big tables and long insns. Each kernel's
+ * bitmap is checked against the scalar one.
+ *
+ * The library is included whole, the kernels are static.
+ */
+
+#include "../libdroidcolors.c"
+
+typedef void (*fill_fn) (pixel_t *pix, size_t len, u1 r, u1 g, u1 b);
+
+typedef struct {
+	const char *name;
+	u4 *offsets;
+	u4 *lens;
+	size_t count;
+	size_t cap;
+	u8 pixels;       // painted per pass
+	size_t size;     // of the bitmap
+} run_set_t;
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_run(run_set_t *set, u4 offset, u4 len)
+{
+	if (set->count == set->cap) {
+		set->cap = set->cap ? set->cap * 2 : 4096;
+		set->offsets = realloc(set->offsets, set->cap * sizeof(u4));
+		set->lens = realloc(set->lens, set->cap * sizeof(u4));
+		if (set->offsets == NULL || set->lens == NULL) {
+			fprintf(stderr, "ERROR: %s: out of memory\n", set->name);
+			exit(1);
+		}
+	}
+	set->offsets[set->count] = offset;
+	set->lens[set->count++] = len;
+	set->pixels += len;
+	if (offset + len > set->size) set->size = offset + len;
+}
+
+/* Runs of random length in [lo, hi], end to end, n pixels in all. */
+static void random_runs(run_set_t *set, const char *name, u4 lo, u4 hi, u8 n)
+{
+	u4 pos = 0, len;
+
+	memset(set, 0, sizeof(*set));
+	set->name = name;
+	srand(1);
+	while (pos < n) {
+		len = lo + rand() % (hi - lo + 1);
+		add_run(set, pos, len);
+		pos += len;
+	}
+}
+
+static void fixed_runs(run_set_t *set, const char *name, u4 len, u8 n)
+{
+	u4 pos;
+
+	memset(set, 0, sizeof(*set));
+	set->name = name;
+	for (pos = 0; pos < n; pos += len) add_run(set, pos, len);
+}
+
+/* The runs of one region kind of a parsed dex, at their own offsets. */
+static void dex_runs(run_set_t *set, const char *name, dc_context_t *ctx, u1 type, u1 type2)
+{
+	size_t i;
+
+	memset(set, 0, sizeof(*set));
+	set->name = name;
+	for (i = 0; i < ctx->runs.count; i++)
+		if (ctx->runs.regions[i].type == type || ctx->runs.regions[i].type == type2)
+			add_run(set, ctx->runs.regions[i].offset, ctx->runs.regions[i].len);
+}
+
+static double best_pass(run_set_t *set, pixel_t *pixels, fill_fn fill)
+{
+	double start, took, best = 1e9, until = seconds() + 0.2;
+	size_t i;
+
+	do {
+		start = seconds();
+		for (i = 0; i < set->count; i++)
+			fill(pixels + set->offsets[i], set->lens[i], 0xaa, 0x55, (u1) i);
+		took = seconds() - start;
+		if (took < best) best = took;
+	} while (seconds() < until);
+	return best;
+}
+
+static void run_bench(run_set_t *set)
+{
+	static const struct { const char *name; fill_fn fill; } kernels[] = {
+		{ "scalar", fill_rgb_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+		{ "sse2", fill_rgb_sse2 },
+		{ "avx2", fill_rgb_avx2 },
+#endif
+	};
+	pixel_t *ref, *pixels;
+	double took;
+	size_t k;
+
+	if (set->count == 0) return;
+	ref = calloc(set->size, sizeof(pixel_t));
+	pixels = calloc(set->size, sizeof(pixel_t));
+	if (ref == NULL || pixels == NULL) {
+		fprintf(stderr, "ERROR: %s: out of memory\n", set->name);
+		exit(1);
+	}
+	best_pass(set, ref, fill_rgb_scalar);
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+#if defined(__x86_64__) || defined(__i386__)
+		if (kernels[k].fill == fill_rgb_avx2 && !__builtin_cpu_supports("avx2")) continue;
+#endif
+		memset(pixels, 0, set->size * sizeof(pixel_t));
+		took = best_pass(set, pixels, kernels[k].fill);
+		printf("%-28s %9zu runs %7.1f px/run  %-6s %8.2f GB/s %7.2f ns/run%s\n", set->name, set->count,
+			(double) set->pixels / set->count, kernels[k].name, set->pixels * sizeof(pixel_t) / took / 1e9,
+			took * 1e9 / set->count,
+			memcmp(pixels, ref, set->size * sizeof(pixel_t)) ? "  DIFFERS" : "");
+	}
+	free(ref);
+	free(pixels);
+	free(set->offsets);
+	free(set->lens);
+}
+
+int main(int argc, char *argv[])
+{
+	run_set_t set;
+	dc_context_t ctx;
+	char name[64];
+	u1 *dex;
+	size_t size;
+	FILE *fp;
+	int i;
+
+	__builtin_cpu_init();
+	random_runs(&set, "string_data-sized 8-64", 8, 64, 1 << 22);
+	run_bench(&set);
+	random_runs(&set, "insns-sized 32-512", 32, 512, 1 << 22);
+	run_bench(&set);
+	fixed_runs(&set, "64", 64, 1 << 22);
+	run_bench(&set);
+	fixed_runs(&set, "4096", 4096, 1 << 22);
+	run_bench(&set);
+	fixed_runs(&set, "1M", 1 << 20, 1 << 22);
+	run_bench(&set);
+
+	dc_init(&ctx);
+	for (i = 1; i < argc; i++) {
+		fp = fopen(argv[i], "rb");
+		if (fp == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		rewind(fp);
+		dex = malloc(size);
+		if (dex == NULL || fread(dex, 1, size, fp) != size || dc_parse(&ctx, dex, size) != DC_OK) {
+			fprintf(stderr, "ERROR: %s: not a dex file\n", argv[i]);
+			return 1;
+		}
+		fclose(fp);
+		snprintf(name, sizeof(name), "%.16s string_data", basename(argv[i]));
+		dex_runs(&set, name, &ctx, REGION_STRING_DATA, REGION_STRING_DATA_ORDERED);
+		run_bench(&set);
+		snprintf(name, sizeof(name), "%.16s insns", basename(argv[i]));
+		dex_runs(&set, name, &ctx, REGION_DIRECT_CODE, REGION_VIRTUAL_CODE);
+		run_bench(&set);
+		free(dex);
+	}
+	dc_free(&ctx);
+	return 0;
+}
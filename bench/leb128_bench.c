@@ -0,0 +1,258 @@
+/*
+ * leb128_bench - readUnsignedLeb128 and skipUnsignedLeb128 against the
+ * byte-by-byte decoder they replaced, on the class_data of real dex files.
+ *
+ * compile:
+ *     make bench
+ * or
+ *     gcc -O2 -o bench/leb128_bench bench/leb128_bench.c -lm -lpthread -lpng -lz
+ *
+ * usage:
+ *     bench/leb128_bench <file.dex> ...
+ *
+ * Every class_data item of the files is decoded whole, its four sizes,
+ * the field entries and the method entries, three ways:
+ *     old     the original decoder, kept below, every value
+ *     new     readUnsignedLeb128, every value
+ *     skip    as the walk does it: skipUnsignedLeb128 over the fields,
+ *             readMethodCodeOff over the methods
+ * Each way runs for about 200 ms and the best pass is kept. old and new
+ * must agree on the sum of the values and on where every item ends, skip
+ * on the sum of the code_off values. A 16 MB stream of one and two byte
+ * values follows, the common case in class_data and debug_info.
+ *
+ * The library is included whole, the decoders are static.
+ */
+
+#include "../libdroidcolors.c"
+
+/* The decoder of the original droidcolors, taken from dalvik's
+ * libdex/Leb128.h: no limit, garbage tolerated in the high four bits. */
+static int old_readUnsignedLeb128(u1** pStream)
+{
+    u1* ptr = *pStream;
+    int result = *(ptr++);
+
+    if (result > 0x7f) {
+        int cur = *(ptr++);
+        result = (result & 0x7f) | ((cur & 0x7f) << 7);
+        if (cur > 0x7f) {
+            cur = *(ptr++);
+            result |= (cur & 0x7f) << 14;
+            if (cur > 0x7f) {
+                cur = *(ptr++);
+                result |= (cur & 0x7f) << 21;
+                if (cur > 0x7f) {
+                    cur = *(ptr++);
+                    result |= cur << 28;
+                }
+            }
+        }
+    }
+
+    *pStream = ptr;
+    return result;
+}
+
+typedef struct {
+	u1 **items;      // class_data of every file, in class_defs order
+	size_t count;
+	size_t cap;
+	u8 values;       // LEB128 values in all of them
+	u1 *limit;       // end of the file of each item, for new and skip
+	u1 **limits;
+} blob_list_t;
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One class_data item, every value, with the old decoder. */
+static u8 decode_old(u1 **ptr, u8 *values)
+{
+	u4 sizes[4], k, n;
+	u8 sum = 0;
+
+	for (k = 0; k < 4; k++) sum += sizes[k] = old_readUnsignedLeb128(ptr);
+	n = (sizes[0] + sizes[1]) * 2 + (sizes[2] + sizes[3]) * 3;
+	for (k = 0; k < n; k++) sum += (u4) old_readUnsignedLeb128(ptr);
+	*values += 4 + n;
+	return sum;
+}
+
+static u8 decode_new(u1 **ptr, const u1 *limit, int *okay)
+{
+	u4 sizes[4], k, n;
+	u8 sum = 0;
+
+	for (k = 0; k < 4; k++) sum += sizes[k] = readUnsignedLeb128(ptr, limit, okay);
+	n = (sizes[0] + sizes[1]) * 2 + (sizes[2] + sizes[3]) * 3;
+	for (k = 0; k < n; k++) sum += readUnsignedLeb128(ptr, limit, okay);
+	return sum;
+}
+
+/* The way Analize_class_data reads it: the sizes, then only code_off. */
+static u8 decode_skip(u1 **ptr, const u1 *limit, int *okay)
+{
+	u4 sizes[4], k;
+	u8 sum = 0;
+
+	for (k = 0; k < 4; k++) sizes[k] = readUnsignedLeb128(ptr, limit, okay);
+	skipUnsignedLeb128(ptr, limit, ((u8) sizes[0] + sizes[1]) * 2, okay);
+	for (k = 0; k < sizes[2] + sizes[3]; k++) sum += readMethodCodeOff(ptr, limit, okay);
+	return sum;
+}
+
+static void add_file(blob_list_t *list, u1 *dex, size_t size)
+{
+	dex_header *header = (dex_header *) dex;
+	class_def_struct *class_def;
+	u1 *ptr, *end = dex + size;
+	u4 i, off;
+	int okay = 1;
+
+	if (size < sizeof(dex_header) || (u8) *header->class_defs_off + (u8) *header->class_defs_size *
+	    sizeof(class_def_struct) > size)
+		return;
+	for (i = 0; i < *header->class_defs_size; i++) {
+		class_def = (class_def_struct *) (dex + *header->class_defs_off) + i;
+		off = *class_def->class_data_off;
+		if (off == 0 || off >= size) continue;
+		// the old decoder has no limit, keep the items it can't overrun
+		ptr = dex + off;
+		decode_new(&ptr, end, &okay);
+		if (!okay || end - ptr < 5) break;
+		if (list->count == list->cap) {
+			list->cap = list->cap ? list->cap * 2 : 4096;
+			list->items = realloc(list->items, list->cap * sizeof(u1 *));
+			list->limits = realloc(list->limits, list->cap * sizeof(u1 *));
+			if (list->items == NULL || list->limits == NULL) {
+				fprintf(stderr, "ERROR: out of memory\n");
+				exit(1);
+			}
+		}
+		list->items[list->count] = dex + off;
+		list->limits[list->count++] = end;
+	}
+}
+
+static void run_bench(blob_list_t *list)
+{
+	double start, took, best[3] = { 1e9, 1e9, 1e9 }, until;
+	u8 sums[3] = { 0, 0, 0 }, values = 0;
+	size_t i, mismatched = 0;
+	u1 *p_old, *p_new;
+	int okay = 1, way;
+
+	// old and new end every item at the same byte
+	for (i = 0; i < list->count; i++) {
+		p_old = p_new = list->items[i];
+		if (decode_old(&p_old, &values) != decode_new(&p_new, list->limits[i], &okay) || p_old != p_new)
+			mismatched++;
+	}
+	for (way = 0; way < 3; way++) {
+		until = seconds() + 0.2;
+		do {
+			u8 sum = 0, count = 0;
+			start = seconds();
+			for (i = 0; i < list->count; i++) {
+				u1 *ptr = list->items[i];
+				if (way == 0) sum += decode_old(&ptr, &count);
+				else if (way == 1) sum += decode_new(&ptr, list->limits[i], &okay);
+				else sum += decode_skip(&ptr, list->limits[i], &okay);
+			}
+			took = seconds() - start;
+			if (took < best[way]) best[way] = took;
+			sums[way] = sum;
+		} while (seconds() < until);
+	}
+	printf("class_data: %zu items, %llu values, %zu mismatched\n", list->count,
+		(unsigned long long) values, mismatched);
+	printf("  old   %8.1f M values/s  sum %llu\n", values / best[0] / 1e6, (unsigned long long) sums[0]);
+	printf("  new   %8.1f M values/s  sum %llu%s\n", values / best[1] / 1e6, (unsigned long long) sums[1],
+		sums[1] == sums[0] ? "" : "  DIFFERS");
+	printf("  skip  %8.1f M values/s  (code_off sum %llu)\n", values / best[2] / 1e6, (unsigned long long) sums[2]);
+}
+
+/* n values of one or two bytes, mostly one. */
+static void run_stream(size_t n)
+{
+	u1 *stream = malloc(n * 2 + 8), *ptr, *end;
+	double start, took, best[3] = { 1e9, 1e9, 1e9 }, until;
+	size_t i, bytes = 0;
+	u8 sums[3] = { 0, 0, 0 };
+	int okay = 1, way;
+
+	if (stream == NULL) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		exit(1);
+	}
+	srand(1);
+	for (i = 0; i < n; i++) {
+		if (rand() % 4) stream[bytes++] = rand() & 0x7f;
+		else {
+			stream[bytes++] = 0x80 | (rand() & 0x7f);
+			stream[bytes++] = rand() & 0x7f;
+		}
+	}
+	memset(stream + bytes, 0, 8);
+	end = stream + bytes + 8;
+	for (way = 0; way < 3; way++) {
+		until = seconds() + 0.2;
+		do {
+			u8 sum = 0;
+			ptr = stream;
+			start = seconds();
+			if (way == 0) for (i = 0; i < n; i++) sum += (u4) old_readUnsignedLeb128(&ptr);
+			else if (way == 1) for (i = 0; i < n; i++) sum += readUnsignedLeb128(&ptr, end, &okay);
+			else skipUnsignedLeb128(&ptr, end, n, &okay), sum = ptr - stream;
+			took = seconds() - start;
+			if (took < best[way]) best[way] = took;
+			sums[way] = sum;
+		} while (seconds() < until);
+	}
+	printf("stream: %zu values of 1-2 bytes, %zu bytes\n", n, bytes);
+	printf("  old   %8.1f M values/s\n", n / best[0] / 1e6);
+	printf("  new   %8.1f M values/s%s\n", n / best[1] / 1e6, sums[1] == sums[0] ? "" : "  DIFFERS");
+	printf("  skip  %8.1f M values/s%s\n", n / best[2] / 1e6, sums[2] == bytes ? "" : "  DIFFERS");
+	free(stream);
+}
+
+int main(int argc, char *argv[])
+{
+	blob_list_t list;
+	u1 *dex;
+	size_t size;
+	FILE *fp;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <file.dex> ...\n", argv[0]);
+		return 1;
+	}
+	memset(&list, 0, sizeof(list));
+	for (i = 1; i < argc; i++) {
+		fp = fopen(argv[i], "rb");
+		if (fp == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		rewind(fp);
+		dex = malloc(size);
+		if (dex == NULL || fread(dex, 1, size, fp) != size) {
+			fprintf(stderr, "ERROR: %s: can't read the file\n", argv[i]);
+			return 1;
+		}
+		fclose(fp);
+		add_file(&list, dex, size);   // kept until the end, the items point into it
+	}
+	run_bench(&list);
+	run_stream(16 << 20);
+	return 0;
+}
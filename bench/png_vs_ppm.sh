@@ -0,0 +1,51 @@
+#!/bin/sh
+# png_vs_ppm.sh - output size and speed of -p against the raw .ppn
+#
+# usage:
+#     sh bench/png_vs_ppm.sh [-b droidcolors] [-n runs] <file.dex> ...
+#
+# Renders every file with and without -p, -n times each (default 3), and
+# prints the size of the image and the best render + save time of the -t
+# timing line, with the dex bytes per second that makes. On one core,
+# sh bench/png_vs_ppm.sh -b ./droidcolors -n 5 mid.dex big.dex gave
+#     mid.dex    3 MB   ppn    9332753 B    13.6 ms   png    206235 B    33.2 ms
+#     big.dex   63 MB   ppn  189305874 B   292.8 ms   png   4104021 B   714.8 ms
+
+dc=./droidcolors
+runs=3
+while getopts b:n: c; do
+	case $c in
+	b) dc=$OPTARG ;;
+	n) runs=$OPTARG ;;
+	*) echo "usage: $0 [-b droidcolors] [-n runs] <file.dex> ..." >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || { echo "usage: $0 [-b droidcolors] [-n runs] <file.dex> ..." >&2; exit 1; }
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+printf '%-24s %-4s %12s %10s %10s\n' file fmt bytes ms MB/s
+for f in "$@"; do
+	name=$(basename "$f")
+	for fmt in ppn png; do
+		flag=
+		[ $fmt = png ] && flag=-p
+		best=
+		i=0
+		while [ $i -lt $runs ]; do
+			rm -f "$tmp/t.json"
+			"$dc" -s $flag -o "$tmp" -t "$tmp/t.json" "$f" > /dev/null || exit 1
+			ms=$(sed -n 's/.*"render":{"ms":\([0-9.]*\).*"save":{"ms":\([0-9.]*\).*/\1 \2/p' "$tmp/t.json" |
+				awk '{ print $1 + $2 }')
+			if [ -z "$best" ]; then best=$ms
+			else best=$(echo "$best $ms" | awk '{ print $2 < $1 ? $2 : $1 }'); fi
+			i=$((i + 1))
+		done
+		size=$(wc -c < "$f")
+		bytes=$(wc -c < "$tmp/$name.$fmt")
+		echo "$name $fmt $bytes $best $size" |
+			awk '{ printf "%-24s %-4s %12d %10.1f %10.1f\n", $1, $2, $3, $4, $5 / 1e3 / $4 }'
+	done
+done
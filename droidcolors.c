@@ -2,10 +2,115 @@
  * Ashutosh Jain, Hugo Gonzalez and Natalia Stakhanova
  * 
  * droidcolors - Create an image to represent the .dex file
- * 			the image is a ppn file.
+ * 			the image is a ppn file, or a png file with -p.
  *
  * compile:
- *     gcc -w -g -o droidcolors droidcolors.c -lm
+ *     make
+ * or
+ *     gcc -w -g -o droidcolors droidcolors.c libdroidcolors.c -lm -lpthread -lpng -lz
+ *
+ * The parsing and rendering live in libdroidcolors.c (see droidcolors.h),
+ * this file is the command line around it: options, file loading, output
+ * names, batch mode and reports.
+ *
+ * usage:
+ *     droidcolors <file.dex|file.apk|file.dcr> [-s] [-l] [-m] [-v] [-e] [-i]
+ *     An .apk (any zip) is read in place: every classes*.dex inside is
+ *        rendered to <file.apk>.classesN.dex.ppn without extracting it.
+ *     -m maps the file instead of copying it to the heap, which saves a
+ *        full copy of the .dex on large multidex inputs.
+ *     -v recomputes the adler32 checksum and SHA-1 signature of every dex
+ *        and warns when they don't match the header. The outcome goes to
+ *        the -l log and the -t line, and a batch counts the failures.
+ *        One pass over the bytes, with the SIMD and SHA instructions the
+ *        CPU has. With -c a dex is served from the cache only once it is
+ *        verified, so the whole file is read.
+ *     -e also writes the byte entropy of every dex as
+ *        <file.dex>.entropy.ppn, on the layout of the image: each byte
+ *        gets the entropy of the 256 bytes around it, from black for
+ *        padding through blue and red to yellow and white for packed or
+ *        encrypted data. Follows -p and -r. A .dcr input has no bytes
+ *        left to measure.
+ *     -i also writes the region list (offset, length, region) the image
+ *        is rasterized from, as <file.dex>.regions.csv.
+ *     -p writes <file.dex>.png instead of the raw .ppn. Rows are
+ *        rasterized from the region list straight into the encoder, so
+ *        the full-size bitmap is never allocated.
+ *     -r WxH renders a fixed-size thumbnail instead of the 256 pixel wide
+ *        image, averaging the colours of every cell. The full-size bitmap
+ *        is never allocated.
+ *     -x writes the runs the image is painted from as <file.dex>.dcr, a
+ *        compact indexed file, instead of an image. A .dcr given as input
+ *        is painted like the dex it came from, at any -r resolution and
+ *        as .ppn or .png, without the dex.
+ *     -z writes a Deep Zoom pyramid instead of one image, <file.dex>.dzi
+ *        and 256x256 png tiles in <file.dex>_files/, for viewers that
+ *        load only the tiles on screen. Coarse levels average the runs
+ *        directly, tiles inside a single region are encoded once and
+ *        hard linked.
+ *     -F prints one CSV line of structural features per file (bytes and
+ *        share of every region, structure counts, insns_size and string
+ *        length histograms) and renders nothing.
+ *     -M walks the sections the map_list lists, each front to back in file
+ *        order, instead of chasing offsets from the class definitions.
+ *        Reads sequentially and also paints items nothing points at.
+ *     -O paints the insns of every method instruction by instruction, by
+ *        kind (invoke, field access, branch, const-string, ...), and the
+ *        catch handlers after the tries, each code_item where it really
+ *        lies. The opcodes are decoded from tables, one pass per method,
+ *        and -F then counts the bytes of every kind.
+ *     -P n walks the string, proto and class tables of each dex on n
+ *        threads, for single large files. The image is the same as with
+ *        one. Not combined with -M.
+ *     -A WxH renders no image per file but lays every dex on a WxH grid
+ *        by relative position in the file, each cell sampled the same
+ *        number of times whatever the size, and counts the regions of
+ *        every cell over the whole batch: aggregate.ppn (or .png with -p)
+ *        is the mean layout, a pixel per cell in the region colours mixed
+ *        by their counts, and aggregate.csv the counts, a line per cell.
+ *        Every worker keeps a grid of its own, added up at the end. Not
+ *        combined with -c.
+ *     -t out.json appends one JSON line per file with the wall time, bytes
+ *        and structures of every phase, structure counts and peak RSS.
+ *        Batch runs end with a line summing all files.
+ *
+ *     -c dir keeps every result in dir under the SHA-1 signature from the
+ *        dex header, the tool version and the output options. A dex seen
+ *        before is served from there after reading its header only.
+ *        -C MB bounds the directory (default 1024), the least recently
+ *        used results go first. Ignored with -l, -z and -A.
+ *
+ *     droidcolors -d <dir> | -f <list|-> [-j threads] [-q depth] [-o outdir]
+ *     batch mode, renders a whole corpus in one process on a pool of
+ *     worker threads that reuse their buffers between files. -d skips
+ *     the .ppn, .png, .csv and .dzi files and _files/ directories a run
+ *     without -o leaves in the current directory.
+ *     -q n keeps n files being read ahead of the workers and n .ppn or .png
+ *        images being written behind them, for storage with latency. The
+ *        I/O goes through an io_uring, or n threads on kernels without
+ *        one, and the batch summary tells how much of it the parsing hid.
+ *        Should the io_uring fail midway, the batch goes on on one thread.
+ *        Holds up to 2n files and images in memory. With -c the workers
+ *        write the outputs themselves, and every file is read whole, even
+ *        one the cache serves.
+ *
+ *     droidcolors -D <old.dex> <new.dex> [-p] [-m] [-M] [-o outdir] [-c dir]
+ *     diff mode, matches the items of two versions of a dex (strings,
+ *     code, class data, ...) by kind and content wherever they moved, and
+ *     writes <new.dex>.diff.ppn: the layout of the new one with what it
+ *     shares with the old one dimmed. Prints a CSV line per region with
+ *     item and byte counts of both, unchanged items and the bytes added
+ *     and removed. Both are parsed at once, and with -c a version seen
+ *     before is not parsed again.
+ *
+ *     droidcolors -S <socket|-> [-j threads] [options]
+ *     server mode, keeps running and renders one file per request line
+ *     read from a unix socket (or stdin, answering on stdout). A request
+ *     is options for it alone (-p -i -x -z -F -M -O -v -e -r -o -P) and a path, or
+ *     @name for a descriptor passed along with SCM_RIGHTS. The reply is
+ *     one line: "ok" and the images written or the -F line, or "error".
+ *     "stats" replies with request latency percentiles, "header" with the
+ *     -F CSV header.
  *
  *
  * Related paper:
@@ -16,654 +121,2985 @@
  * 
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-//#include <png.h>  for now we are creating ppn file.
 #include <libgen.h>
 
+/* -q drives an io_uring when the kernel headers have one new enough (5.6),
+ * -DDC_NO_IO_URING builds the thread engine alone. */
+#if defined(__linux__) && !defined(DC_NO_IO_URING)
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING
+#endif
+#endif
 
-#define VERSION "0.9"
+#include "droidcolors.h"
 
+/* The short names the code was written with. */
+typedef dc_u1 u1;
+typedef dc_u2 u2;
+typedef dc_u4 u4;
+typedef dc_u8 u8;
 
-typedef uint8_t             u1;
-typedef uint16_t            u2;
-typedef uint32_t            u4;
-typedef uint64_t            u8;
 
-/* A coloured pixel. */
+u1 *map_dex_file(int fd, size_t filesize)
+{
+	/* Map the whole file read-only. The parser chases offsets all over the
+	 * file, so fault everything in up front instead of page by page. */
+	int flags = MAP_PRIVATE;
+	u1 *file;
+
+	if (filesize == 0) return NULL;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	file = mmap(NULL, filesize, PROT_READ, flags, fd, 0);
+	if (file == MAP_FAILED) return NULL;
+#ifndef MAP_POPULATE
+	madvise(file, filesize, MADV_WILLNEED);
+#endif
+	return file;
+}
 
-typedef struct {
- uint8_t red;
- uint8_t green;
- uint8_t blue;
-} pixel_t;
-
-/* A picture. */
-    
-typedef struct  {
-  pixel_t *pixels;
-  size_t width;
-  size_t height;
-} bitmap_t;
+void release_dex_file(u1 *file, size_t filesize, int mapped)
+{
+	if (mapped) munmap(file, filesize);
+	else free(file);
+}
 
-typedef struct {
-	char dex[3];
-	char newline[1];
-	char ver[3];
-	char zero[1];
-} dex_magic;
 
-typedef struct {
-	dex_magic magic;
-	u4 checksum[1];
-	unsigned char signature[20];
-	u4 file_size[1];
-	u4 header_size[1];
-	u4 endian_tag[1];
-	u4 link_size[1];
-	u4 link_off[1];
-	u4 map_off[1];
-	u4 string_ids_size[1];
-	u4 string_ids_off[1];
-	u4 type_ids_size[1];
-	u4 type_ids_off[1];
-	u4 proto_ids_size[1];
-	u4 proto_ids_off[1];
-	u4 field_ids_size[1];
-	u4 field_ids_off[1];
-	u4 method_ids_size[1];
-	u4 method_ids_off[1];
-	u4 class_defs_size[1];
-	u4 class_defs_off[1];
-	u4 data_size[1];
-	u4 data_off[1];
-} dex_header;
+void help_show_message(char name[])
+{
+	printf ("\n=== Droidcolors %s - (c) 2015 \n", DC_VERSION);
+    printf( "Paper: Enriching Reverse Engineering through Visual Exploration of Android Binaries\n");
+    printf ("5th Program protection and Reverse Engineering Workshop (PPREW-5)\n");
+    printf ("http://dx.doi.org/10.1145/2843859.2843866\n===\n");
+    printf ("Usage: %s  <file.dex|file.apk|file.dcr> [slmveipxzFMO] [-r WxH] [-A WxH] [-t json] [-P threads] [-c cachedir [-C MB]]\n",name);
+    printf ("       %s  -d <dir> | -f <list|-> [slmveipxzFMO] [-r WxH] [-A WxH] [-t json] [-P threads] [-c cachedir [-C MB]] [-j threads] [-q depth] [-o outdir]\n",name);
+    printf ("       %s  -D <old.dex> <new.dex> [pmM] [-o outdir] [-c cachedir [-C MB]]\n",name);
+    printf ("       %s  -S <socket|-> [mveipxzFMO] [-r WxH] [-t json] [-P threads] [-c cachedir [-C MB]] [-j threads] [-o outdir]\n",name);
+    printf( "\t-s\tsilence, no headers\n");
+    printf( "\t-l\tlog, create log file from the image\n");
+    printf( "\t-m\tmmap, map the .dex file instead of reading it into memory\n");
+    printf( "\t-v\tverify, check the adler32 checksum and SHA-1 signature of every dex against its header\n");
+    printf( "\t-e\tentropy, also write the byte entropy of every dex as <file>.entropy.ppn\n");
+    printf( "\t-i\tintervals, also write the region list as <file>.regions.csv\n");
+    printf( "\t-p\tpng, write a compressed .png instead of the raw .ppn\n");
+    printf( "\t-x\truns, write the region runs as a compact <file>.dcr instead of an image, a .dcr input is painted\n");
+    printf( "\t-z\tzoom, write a Deep Zoom tile pyramid, <file>.dzi and <file>_files/\n");
+    printf( "\t-F\tfeatures, print a CSV feature vector instead of an image\n");
+    printf( "\t-M\tmap walk, decode the sections listed in the map_list in file order\n");
+    printf( "\t-O\topcodes, paint every instruction by kind, and the catch handlers\n");
+    printf( "\t-P\tparallel, walk the string, proto and class tables of one dex on this many threads\n");
+    printf( "\t-r\tresolution, render straight to a WxH thumbnail, e.g. -r 224x224\n");
+    printf( "\t-A\taggregate, lay every dex on a WxH grid and write the mean layout and its counts, no images\n");
+    printf( "\t-t\ttiming, append per-phase times and counters as JSON lines to a file (- for stderr)\n");
+    printf( "\t-d\tbatch, render every file in a directory\n");
+    printf( "\t-f\tbatch, render every path listed in a file (- for stdin)\n");
+    printf( "\t-j\tworker threads for batch mode (default: one per core)\n");
+    printf( "\t-q\tqueue depth, batch mode reads this many files ahead and writes this many images behind\n");
+    printf( "\t-o\twrite the images to this directory\n");
+    printf( "\t-D\tdiff, compare the items of an older dex with the one given and write <new>.diff.ppn\n");
+    printf( "\t-S\tserver, answer render requests on a unix socket, or on stdin and stdout with -\n");
+    printf( "\t-c\tcache, keep results in this directory and reuse them for dex files with the same signature\n");
+    printf( "\t-C\tcache size limit in MB (default 1024), least recently used results are evicted\n");
+ 
+}
 
 
+/* -c: rendered outputs kept on disk under the dex SHA-1 signature, so a
+ * classes.dex seen before is served without loading or parsing it. */
 typedef struct {
-	u4 string_data_off[1];
-} string_id_struct;
+	const char *dir;
+	char optkey[64];      // version and the options that change the output
+	u8 limit;             // bytes, least recently used entries go first
+	u8 size;              // bytes in the cache as far as we know
+	u8 hits;
+	u8 misses;
+	u8 stores;
+	u8 evictions;
+	int scanning;         // a scan_cache is running, stores don't start another
+	pthread_mutex_t lock;
+} result_cache_t;
 
 typedef struct {
-	u4 class_idx[1];
-	u4 access_flags[1];
-	u4 superclass_idx[1];
-	u4 interfaces_off[1];
-	u4 source_file_idx[1];
-	u4 annotations_off[1];
-	u4 class_data_off[1];
-	u4 static_values_off[1];
-} class_def_struct;
-
+	int silence;
+	int log;
+	int mmap;
+	int verify;           // -v, check checksum and signature before anything else
+	int entropy;          // -e, also the entropy image of every dex
+	int batch;
+	int regions;
+	int features;         // CSV line on out instead of an image
+	int png;              // -p, .png instead of .ppn
+	int dcr;              // -x, .dcr instead of an image
+	int zoom;             // -z, .dzi tile pyramid instead of an image
+	int map_walk;         // -M, walk the map_list sections in file order
+	int opcodes;          // -O, paint insns instruction by instruction
+	int parse_threads;    // -P, threads walking one dex
+	FILE *timing;         // -t, JSON line per file
+	size_t thumb_width;   // 0: full-size image
+	size_t thumb_height;
+	size_t aggregate_width;   // -A, every dex onto one grid instead of images
+	size_t aggregate_height;
+	const char *outdir;
+	result_cache_t *cache;  // NULL unless -c
+	FILE *out;            // -F lines, stdout but for a -S request
+	FILE *written;        // -S, the name of every image written
+	struct io_pipeline *pipeline;  // -q, batch mode only
+	const char *diff;     // -D, the older dex to compare with
+} options_t;
+
+/* Buffers owned by one worker and reused from file to file, so a batch run
+ * does not go back to the allocator for every sample. */
 typedef struct {
-	u2 class_idx[1];
-	u2 proto_idx[1];
-	u4 name_idx[1];
-} method_id_struct;
+	u1 *input;
+	size_t input_size;
+	pixel_t *pixels;
+	size_t pixels_size;   // in pixels
+	dc_context_t ctx;
+	int cache_hits;       // of the current file
+	int bad_checksums;    // -v, dex files of the current file that failed
+	int bad_signatures;
+	dc_aggregate_t aggregate;  // -A, of the files this worker rendered
+} dex_buffers_t;
+
+void free_dex_buffers(dex_buffers_t *buf)
+{
+	free(buf->input);
+	free(buf->pixels);
+	dc_aggregate_free(&buf->aggregate);
+	dc_free(&buf->ctx);
+	memset(buf, 0, sizeof(*buf));
+}
 
-typedef struct {
-	u4 descriptor_idx[1];
-} type_id_struct;
 
-typedef struct {
-	u4 shorty_idx[1];
-    u4 return_type_idx[1];
-    u4 parameters_off[1];
-} proto_id_struct;
+/* <outdir>/<basename of dexfile><ext> into out. Returns 1 when it
+ * doesn't fit. */
+int output_name(char *out, size_t size, const char *dexfile, const char *outdir, const char *ext)
+{
+	char *path = strdup(dexfile);
+	int len;
+
+	if (path == NULL) return 1;
+	if (outdir != NULL) len = snprintf(out, size, "%s/%s%s", outdir, basename(path), ext);
+	else len = snprintf(out, size, "%s%s", basename(path), ext);
+	free(path);
+	return len < 0 || len >= size;
+}
 
-typedef struct {
-    u2 class_idx[1];
-    u2 type_idx[1];
-    u4 name_idx[1];
-} field_id_struct;
 
-typedef struct {
-    u2 type[1];
-    u2 unused[1];
-    u4 size[1];
-    u4 offset[1];
-} map_item_struct;
+pixel_t *reserve_pixels(dex_buffers_t *buf, size_t count)
+{
+	if (buf->pixels_size < count) {
+		free(buf->pixels);
+		buf->pixels = malloc(sizeof (pixel_t) * count);
+		buf->pixels_size = buf->pixels ? count : 0;
+	}
+	return buf->pixels;
+}
 
-typedef struct {
-	u4 class_annotations_off[1];
-	u4 fields_size[1];
-	u4 annotated_methods_size[1];
-	u4 annotated_parameters_size[1];
-	// -- the rest are calculated, they are lists based on the previous sizes
-	// field_annotations
-	// method_annotations
-	// parameter_annotations
-	} annotations_directory_item_struct;
 
-typedef struct {
-    u2 registers_size[1];
-    u2 ins_size[1];
-    u2 outs_size[1];
-    u2 tries_size[1];
-    u4 debug_info_off[1];
-    u4 insns_size[1];
-    // insns u2[insns_size]  array of bytecode -- dynamic
-    // pading u2 -- optional
-    // tries try_itme -- optional
-    // handlers encoded_catch_handler_list -- optional
-} code_item_struct;
+static const char *image_ext(options_t *opt)
+{
+	return opt->zoom ? ".dzi" : opt->dcr ? ".dcr" : opt->png ? ".png" : ".ppn";
+}
+
+static const char *entropy_ext(options_t *opt)
+{
+	return opt->png ? ".entropy.png" : ".entropy.ppn";
+}
+
 
+/* -- read-ahead pipeline --
+ * -q depth, batch mode on storage with latency (NFS and the like). Up to
+ * depth input files are opened and read ahead of the workers, in list
+ * order, and up to depth finished .ppn and .png images are written behind
+ * them, so the workers parse while the I/O waits. A slot holds one input
+ * file and keeps its buffer for the next one; a write takes the pixels of
+ * the worker and hands it a spare buffer back. The I/O goes through one
+ * io_uring on a thread of its own when the kernel has openat, read,
+ * writev and close on it (5.6), the close included since that is where
+ * NFS flushes, and otherwise through depth threads making the same calls
+ * blocking, which is also what the ring thread turns into when the ring
+ * fails (ring_drain). The .regions.csv, .dcr and .dzi outputs, and
+ * every output with -c (the cache copies the file just written), are
+ * still written by the worker. */
+
+typedef struct io_slot {
+	size_t index;         // in the path list
+	u1 *data;
+	size_t capacity;
+	size_t size;          // of the file
+	size_t filled;
+	int fd;               // -1 until it is open
+	int err;              // errno of the open or read that failed
+	double start;
+	double seconds;       // open to last byte
+	int pending;          // io_uring: a request is under way, see ring_drain
+	struct io_slot *next;
+} io_slot_t;
+
+#define WRITE_OPEN  0
+#define WRITE_DATA  1
+#define WRITE_CLOSE 2
+
+typedef struct io_write {
+	char path[PATH_MAX];
+	char head[64];        // the .ppn header
+	size_t head_len;
+	u1 *data;             // after the header
+	size_t len;
+	size_t done;          // header and data
+	int owned;            // data is an encoded png to free
+	pixel_t *pixels;      // spare, swapped with the next worker's
+	size_t pixels_size;
+	struct iovec iov[2];
+	int fd;
+	int err;
+	int step;             // io_uring: WRITE_OPEN, WRITE_DATA, WRITE_CLOSE
+	int pending;          // io_uring: a request is under way, see ring_drain
+	struct io_write *next;
+} io_write_t;
+
+#ifdef HAVE_IO_URING
 typedef struct {
-	u4 start_add[1];
-	u2 insn_count[1];
-	u2 handler_off[1];
-} try_item_struct;
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned tail;        // ours, published on submit
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	int wake_fd;          // eventfd, poked by the workers
+	u8 wake_count;
+} io_ring_t;
+#endif
+
+typedef struct io_pipeline {
+	char **paths;
+	size_t count;
+	size_t next;          // next path to read
+	int depth;
+	io_slot_t *slots;
+	io_write_t *writes;
+	io_slot_t *free_slots, *ready, *ready_tail;
+	io_write_t *free_writes, *queued, *queued_tail;
+	int loading;          // slots being read
+	int stop;             // the workers are done, finish the writes
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;   // workers: a file is read, or all are
+	pthread_cond_t write_cond;   // workers: a write slot is free
+	pthread_cond_t io_cond;      // I/O threads: something to read or write
+	pthread_t *threads;
+	int nthreads;
+	int uring;            // 0: threads
+	int ring_error;       // errno of the io_uring_enter that failed, threads since
+#ifdef HAVE_IO_URING
+	io_ring_t ring;
+#endif
+	// all under lock
+	int inflight;         // reads and writes under way
+	int busy;             // workers on a file
+	double last;
+	double io_only;       // seconds with I/O and no worker busy
+	double parse_only;
+	double overlap;       // seconds with both
+	double input_wait;    // summed over the workers
+	double write_wait;
+	u8 read_bytes;
+	u8 written_bytes;
+	u8 writes_done;
+	u8 write_failed;
+} io_pipeline_t;
+
+static double monotonic_seconds(void)
+{
+	struct timespec now;
 
-const u4 NO_INDEX = 0xffffffff; 
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-void put_pixel_at (bitmap_t * bitmap, u4 d, u1 r, u1 g, u1 b)
+/* Add the time since the last change of inflight or busy to the interval
+ * it belongs to. Lock held, before the change. */
+static void pipeline_account(io_pipeline_t *p)
 {
-	pixel_t *pix = bitmap->pixels + d;
-	pix->red = r;
-	pix->green = g;
-	pix->blue = b;
+	double now = monotonic_seconds(), dt = now - p->last;
+
+	p->last = now;
+	if (p->inflight && p->busy) p->overlap += dt;
+	else if (p->inflight) p->io_only += dt;
+	else if (p->busy) p->parse_only += dt;
 }
 
-void put_pixels (bitmap_t * bitmap, u4 offset, u4 len, u1 r, u1 g, u1 b)
+static void pipeline_wake(io_pipeline_t *p)
 {
-	int x;
-	pixel_t * pix = bitmap->pixels + offset;
-	for (x=0; x<len; x++) {
-		pix->red = r;
-		pix->green = g;
-		pix->blue = b;
-		pix++;
+#ifdef HAVE_IO_URING
+	if (p->uring && !p->ring_error) {
+		u8 one = 1;
+		if (write(p->ring.wake_fd, &one, sizeof(one)) != sizeof(one)) perror("eventfd");
+		return;
 	}
+#endif
+	pthread_cond_broadcast(&p->io_cond);
 }
 
-static int save_ppm_to_file (bitmap_t *bitmap, const char *path)
+/* The next file in a free slot, or NULL. Lock held. */
+static io_slot_t *take_read(io_pipeline_t *p)
 {
-	FILE * fp;
-	fp = fopen (path, "wb");
-   if (! fp) {
-        fprintf(stderr, "ERROR: Can't create .ppn file!\n");
-   }
-    
-  (void) fprintf(fp, "P6\n%d %d\n255\n", bitmap->width,bitmap->height);
-  (void) fwrite(bitmap->pixels, sizeof(pixel_t), bitmap->width*bitmap->height, fp);
- 
-  fclose (fp);
- 
-  return 0;
-	}
-
-int readUnsignedLeb128(u1** pStream)
-{
-/* taken from dalvik's libdex/Leb128.h */
-    u1* ptr = *pStream;
-    int result = *(ptr++);
-
-    if (result > 0x7f) {
-        int cur = *(ptr++);
-        result = (result & 0x7f) | ((cur & 0x7f) << 7);
-        if (cur > 0x7f) {
-            cur = *(ptr++);
-            result |= (cur & 0x7f) << 14;
-            if (cur > 0x7f) {
-                cur = *(ptr++);
-                result |= (cur & 0x7f) << 21;
-                if (cur > 0x7f) {
-                    /*
-                     * Note: We don't check to see if cur is out of
-                     * range here, meaning we tolerate garbage in the
-                     * high four-order bits.
-                     */
-                    cur = *(ptr++);
-                    result |= cur << 28;
-                }
-            }
-        }
+	io_slot_t *slot = p->free_slots;
+
+	if (slot == NULL || p->next >= p->count) return NULL;
+	p->free_slots = slot->next;
+	slot->index = p->next++;
+	slot->fd = -1;
+	slot->err = 0;
+	slot->size = slot->filled = 0;
+	slot->start = monotonic_seconds();
+	pipeline_account(p);
+	p->inflight++;
+	p->loading++;
+	return slot;
+}
 
-    }
+/* The oldest write queued, or NULL. Lock held. */
+static io_write_t *take_write(io_pipeline_t *p)
+{
+	io_write_t *w = p->queued;
+
+	if (w == NULL) return NULL;
+	p->queued = w->next;
+	if (p->queued == NULL) p->queued_tail = NULL;
+	w->fd = -1;
+	w->err = 0;
+	w->done = 0;
+	w->step = WRITE_OPEN;
+	pipeline_account(p);
+	p->inflight++;
+	return w;
+}
 
-    *pStream = ptr;
-    return result;
-}
-
-
-void ColorStrings(bitmap_t **bitmap, u1 *file, u4 offset, u1 order)
-{
-    /* Replace the uleb128_value function to put it inline */
-    
-	u1 size = 0;
-    u1 *ptr = file +offset;
-    int result = *(ptr++);
-    size++;
-    if (result > 0x7f) {
-        int cur = *(ptr++);
-        size++;
-        result = (result & 0x7f) | ((cur & 0x7f) << 7);
-        if (cur > 0x7f) {
-            cur = *(ptr++);
-            size++;
-            result |= (cur & 0x7f) << 14;
-            if (cur > 0x7f) {
-                cur = *(ptr++);
-                size++;
-                result |= (cur & 0x7f) << 21;
-                if (cur > 0x7f) {
-                    cur = *(ptr++);
-                    size++;
-                    result |= cur << 28;
-                }
-            }
-        }
-    } 
-    
-    put_pixels ( bitmap,offset, size , 240,0,0);  // string_ids  -- red
-    put_pixels ( bitmap,offset + size, result , order*100,109,44);  // string_ids  -- darkgreen
-    
-}
-
-
-int Analize_class_data(bitmap_t **bitmap, u1 *file, u4 offset)
-{
-	u4 static_fields_size;
-	u4 instance_fields_size;
-	u4 direct_methods_size;
-	u4 virtual_methods_size;
-	u4 discard;
-	u4 i,j;
-	u4 code_off;
-	code_item_struct* code_item;
-	int padding = 0;
-
-	u1 *ptr = file + offset;
-	
-	static_fields_size = readUnsignedLeb128( &ptr);
-	instance_fields_size = readUnsignedLeb128( &ptr);
-	direct_methods_size = readUnsignedLeb128( &ptr);
-	virtual_methods_size = readUnsignedLeb128( &ptr);
-
-	for (i=0; i<static_fields_size; i++)
-	{
-		discard = readUnsignedLeb128( &ptr);  	// field_idx_diff
-		discard = readUnsignedLeb128( &ptr);	// access_flags
-	}
-    
-    for (i=0; i<instance_fields_size; i++)
-	{
-		discard = readUnsignedLeb128( &ptr);  	// field_idx_diff
-		discard = readUnsignedLeb128( &ptr);	// access_flags
-	}
-	
-	for (i=0; i<direct_methods_size; i++)
-	{
-		discard = readUnsignedLeb128( &ptr);  	// method_idx_diff
-		discard = readUnsignedLeb128( &ptr);	// access_flags
-		code_off = readUnsignedLeb128( &ptr);	// code_off  if 0 means abstract or native. Follow the code item.
-		if (code_off !=0 ) {
-				code_item = (code_item_struct *) (file + code_off);
-				put_pixels( bitmap,code_off, sizeof(code_item), 84,39,136);  // head of Direct Methods   -- purple
-				put_pixels( bitmap,code_off+sizeof(code_item), *code_item->insns_size * sizeof(u2) , 153,142,195);  // Code Direct Methods  lightpurple
-				if (*code_item->tries_size > 0) {  //There are tries, more space
-					if (*code_item->insns_size % 2 == 1)  padding = 2;
-					  put_pixels( bitmap,code_off+sizeof(code_item)+*code_item->insns_size * sizeof(u2)+padding, *code_item->tries_size * sizeof(try_item_struct) , 153,142,0);  // Try on Direct Methods  lightpurple
-					}
-				//TODO deal with the handlers and encoded_catch_handler_list, which is a dynamic structure.	
-
-				if (*code_item->debug_info_off !=0) {
-					u1 *ptr2 = file + *code_item->debug_info_off;
-					discard = readUnsignedLeb128( &ptr2); // line_start
-					u4 parameter_size = readUnsignedLeb128( &ptr2); // parameter_size
-					for (j=0; j<parameter_size; j++) discard = readUnsignedLeb128( &ptr2);  // parameter_names array uleb128p1[parameters_size]
-					put_pixels(bitmap, *code_item->debug_info_off, ptr2 - (file + *code_item->debug_info_off) , 255,10,235);  // debug info 
-				}
+/* Lock held. */
+static void read_done(io_pipeline_t *p, io_slot_t *slot)
+{
+	pipeline_account(p);
+	p->inflight--;
+	p->loading--;
+	p->read_bytes += slot->filled;
+	slot->seconds = monotonic_seconds() - slot->start;
+	slot->next = NULL;
+	if (p->ready_tail != NULL) p->ready_tail->next = slot;
+	else p->ready = slot;
+	p->ready_tail = slot;
+	// the last one also wakes the workers waiting for nothing
+	if (p->next >= p->count && p->loading == 0) pthread_cond_broadcast(&p->ready_cond);
+	else pthread_cond_signal(&p->ready_cond);
+}
 
-		}
+/* Lock held. */
+static void write_done(io_pipeline_t *p, io_write_t *w)
+{
+	pipeline_account(p);
+	p->inflight--;
+	if (w->err != 0) {
+		fprintf(stderr, "ERROR: %s: %s\n", w->path, strerror(w->err));
+		p->write_failed++;
+	} else p->written_bytes += w->done;
+	p->writes_done++;
+	if (w->owned) free(w->data);
+	w->data = NULL;
+	w->next = p->free_writes;
+	p->free_writes = w;
+	pthread_cond_signal(&p->write_cond);
+}
+
+/* Size slot's buffer for the file just opened. Returns 0 or an errno. */
+static int size_slot(io_slot_t *slot)
+{
+	struct stat st;
+
+	if (fstat(slot->fd, &st) != 0) return errno;
+	slot->size = st.st_size;
+	if (slot->capacity < slot->size) {
+		free(slot->data);
+		slot->data = malloc(slot->size);
+		slot->capacity = slot->data ? slot->size : 0;
+		if (slot->data == NULL) return ENOMEM;
 	}
-	
-	for (i=0; i<virtual_methods_size; i++)
-	{
-		discard = readUnsignedLeb128( &ptr);  	// method_idx_diff
-		discard = readUnsignedLeb128( &ptr);	// access_flags
-		code_off = readUnsignedLeb128( &ptr);	// code_off  if 0 means abstract or native. Follow the code item.
-		if (code_off !=0 ) {
-				code_item = (code_item_struct *) (file + code_off);
-				put_pixels( bitmap,code_off, sizeof(code_item), 179,88,6);  // head of Direct Methods   -- purple
-				put_pixels( bitmap,code_off+sizeof(code_item), *code_item->insns_size * sizeof(u2) , 241,163,64);  // Code Direct Methods  lightpurple
-				if (*code_item->tries_size > 0) {  //There are tries, more space
-					if (*code_item->insns_size % 2 == 1)  padding = 2;
-					  put_pixels( bitmap,code_off+sizeof(code_item)+*code_item->insns_size * sizeof(u2)+padding, *code_item->tries_size * sizeof(try_item_struct) , 153,142,0);  // Try on Direct Methods  lightpurple
-					}
-				//TODO deal with the handlers and encoded_catch_handler_list, which is a dynamic structure.	
-				if (*code_item->debug_info_off !=0) {
-					u1 *ptr2 = file + *code_item->debug_info_off;
-					discard = readUnsignedLeb128( &ptr2); // line_start
-					u4 parameter_size = readUnsignedLeb128( &ptr2); // parameter_size
-					for (j=0; j<parameter_size; j++) discard = readUnsignedLeb128( &ptr2);  // parameter_names array uleb128p1[parameters_size]
-					put_pixels(bitmap, *code_item->debug_info_off, ptr2 - (file + *code_item->debug_info_off) , 235,0,255);  // debug info 
-				}
+	return 0;
+}
 
-		}
+/* What is left of w, from the header on. Returns the iovec count, 0 once
+ * it is all written. */
+static int write_iov(io_write_t *w)
+{
+	size_t skip = w->done > w->head_len ? w->done - w->head_len : 0;
+	int n = 0;
+
+	if (w->done < w->head_len) {
+		w->iov[n].iov_base = w->head + w->done;
+		w->iov[n++].iov_len = w->head_len - w->done;
 	}
-    
-     
-    u4 diff = ptr - (file + offset);
-    put_pixels (bitmap, offset , diff , 0,150,0);  // Encoded values
-	
+	if (skip < w->len) {
+		w->iov[n].iov_base = w->data + skip;
+		w->iov[n++].iov_len = w->len - skip;
 	}
+	return n;
+}
 
-int Analyze_encoded_value(bitmap_t **bitmap, u1 *file, u4 offset)
+/* The thread engine, one blocking call after the other. */
+static void read_slot(io_slot_t *slot, const char *path)
 {
-	//encoded_array format  size=uleb128 + encoded_values[size]
-	//Analyze_encoded_value(&dexpng, fileinmemory, *class_def_list->static_values_off); // This is a dynamic structure
-	//printf("Analyzing encoded values\n");
-	int i;
-	u1 VaVt = 0;
-    u1 *ptr = file +offset;
-    
-    int result = readUnsignedLeb128( &ptr);
-    for (i=0; i<result; i++)
-    {
-		VaVt = *(ptr++);  // (Value_arg << 5) | value_type
-		ptr+=(VaVt & 00000111)+1;  // extracting the size of the encoded value and move the pointer, do not care about value.
+	ssize_t n;
+
+	slot->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (slot->fd < 0) {
+		slot->err = errno;
+		return;
 	}
-    
-    u4 diff = ptr - (file + offset);
-    put_pixels (bitmap, offset , diff , 155,150,0);  // Encoded values
+	slot->err = size_slot(slot);
+	while (slot->err == 0 && slot->filled < slot->size) {
+		n = pread(slot->fd, slot->data + slot->filled, slot->size - slot->filled, slot->filled);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) slot->err = errno;
+		else if (n == 0) slot->size = slot->filled;   // it shrank
+		else slot->filled += n;
 	}
+	close(slot->fd);
+}
 
+static void write_out(io_write_t *w)
+{
+	ssize_t n;
+	int count;
 
-void help_show_message(char name[])
+	w->fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (w->fd < 0) {
+		w->err = errno;
+		return;
+	}
+	while (w->err == 0 && (count = write_iov(w)) > 0) {
+		n = writev(w->fd, w->iov, count);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) w->err = n < 0 ? errno : EIO;
+		else w->done += n;
+	}
+	if (close(w->fd) != 0 && w->err == 0) w->err = errno;
+}
+
+/* Writes go first, they give the pixels back. */
+static void *pipeline_thread(void *arg)
 {
-	printf ("\n=== Droidcolors %s - (c) 2015 \n", VERSION);
-    printf( "Paper: Enriching Reverse Engineering through Visual Exploration of Android Binaries\n");
-    printf ("5th Program protection and Reverse Engineering Workshop (PPREW-5)\n");
-    printf ("http://dx.doi.org/10.1145/2843859.2843866\n===\n");
-    printf ("Usage: %s  <file.dex> [sl]\n",name);
-    printf( "\t-s\tsilence, no headers\n");
-    printf( "\t-l\tlog, create log file from the image\n");
- 
+	io_pipeline_t *p = arg;
+	io_slot_t *slot;
+	io_write_t *w;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		if ((w = take_write(p)) != NULL) {
+			pthread_mutex_unlock(&p->lock);
+			write_out(w);
+			pthread_mutex_lock(&p->lock);
+			write_done(p, w);
+		} else if ((slot = take_read(p)) != NULL) {
+			pthread_mutex_unlock(&p->lock);
+			read_slot(slot, p->paths[slot->index]);
+			pthread_mutex_lock(&p->lock);
+			read_done(p, slot);
+		} else if (p->stop) break;
+		else pthread_cond_wait(&p->io_cond, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
 }
 
+#ifdef HAVE_IO_URING
+/* The io_uring engine. Every slot and write has at most one request in
+ * flight, tagged in the low bits of its address, and an eventfd read is
+ * always posted so a worker can wake the thread out of io_uring_enter. */
+#define RING_SLOT  0
+#define RING_WRITE 1
+#define RING_WAKE  2
 
-int main(int argc, char *argv[])
+static int ring_setup(io_ring_t *ring, unsigned entries)
 {
-	char *dexfile;
-	char *outputname;
-	char *outputnamedat;
-	
-	FILE *output;
-	FILE *input;
-    u1 *fileinmemory;
-	int i;
-    int SILENCE=0;
-    int LOG=0;
-    char c;
+	static const int needed[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_CLOSE };
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	u1 *sq, *cq;
+	size_t k;
+	int ok;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) return 1;
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	ok = probe != NULL && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (k = 0; ok && k < sizeof(needed) / sizeof(needed[0]); k++)
+		ok = needed[k] <= probe->last_op && (probe->ops[needed[k]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	ring->wake_fd = ok ? eventfd(0, EFD_CLOEXEC) : -1;
+	if (ring->wake_fd < 0) {
+		close(ring->fd);
+		return 1;
+	}
 
-	bitmap_t dexpng;
-   	u4 x;
-   	int y;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = ring->cq_ring_size == 0 ? ring->sq_ring : mmap(NULL, ring->cq_ring_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+		if (ring->cq_ring_size && ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+		if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+		close(ring->wake_fd);
+		close(ring->fd);
+		return 1;
+	}
+	sq = ring->sq_ring;
+	cq = ring->cq_ring;
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+	return 0;
+}
 
-	u4 static_fields_size;
-	u4 instance_fields_size;
-	u4 direct_methods_size;
-	u4 virtual_methods_size; 
+static void ring_free(io_ring_t *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size) munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->wake_fd);
+	close(ring->fd);
+}
 
-	int field_idx_diff;
-	int field_access_flags;
+static struct io_uring_sqe *ring_sqe(io_ring_t *ring, int opcode, int fd, void *owner, int tag)
+{
+	unsigned index = ring->tail++ & *ring->sq_mask;
+	struct io_uring_sqe *sqe = ring->sqes + index;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t) owner | tag;
+	ring->sq_array[index] = index;
+	return sqe;
+}
 
-	int method_idx_diff;
-	int method_access_flags;
-	int method_code_off;
+static void ring_open(io_ring_t *ring, void *owner, int tag, const char *path, int flags)
+{
+	struct io_uring_sqe *sqe = ring_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, owner, tag);
 
-    int are_sorted=1;
+	sqe->addr = (uintptr_t) path;
+	sqe->open_flags = flags | O_CLOEXEC;
+	sqe->len = 0666;
+}
 
-	dex_header* header;
+static void ring_read(io_ring_t *ring, io_slot_t *slot)
+{
+	size_t left = slot->size - slot->filled;
+	struct io_uring_sqe *sqe = ring_sqe(ring, IORING_OP_READ, slot->fd, slot, RING_SLOT);
 
-	string_id_struct* string_id_list;
-	
-	method_id_struct* method_id_list;
-	type_id_struct* type_id_list;
-	proto_id_struct* proto_id_list;
-    field_id_struct* field_id_list;
-	class_def_struct* class_def_list;
-	map_item_struct* map_item;
-	
-	annotations_directory_item_struct* annotations_directory_list;
-	
+	sqe->addr = (uintptr_t) (slot->data + slot->filled);
+	sqe->len = left < (1u << 30) ? left : (1u << 30);
+	sqe->off = slot->filled;
+}
 
-	if (argc < 2) {
-		help_show_message(argv[0]);
-		return 1;
-	}
+static void ring_wait_wake(io_ring_t *ring)
+{
+	struct io_uring_sqe *sqe = ring_sqe(ring, IORING_OP_READ, ring->wake_fd, ring, RING_WAKE);
 
-	dexfile=argv[1];
-	
-	outputname = malloc(255*sizeof(u1));
-	
-	char *path = strdup(dexfile);	
-	char *path2 = basename(path);
-	//printf("%s\n",path2);
-	strcat(outputname,path2);
-	strcat(outputname,".ppn\0");
-	//printf("%s\n",outputname);
-	
-	
-	
-	input = fopen(dexfile, "rb");
-	if (input == NULL) {
-		fprintf(stderr, "ERROR: Can't open dex file!\n");
-		perror(dexfile);
-		exit(1);
-	}
+	sqe->addr = (uintptr_t) &ring->wake_count;
+	sqe->len = sizeof(ring->wake_count);
+	sqe->off = (u8) -1;
+}
 
-	//printf("value of c is :%c",getopt(argc, argv, "sl")));
-    
-    while ((c = getopt(argc, argv, "sl")) != -1) {
-                switch(c) {
-            case 's':
-                SILENCE =1 ;
-                break;
-            case 'l':
-            	LOG=1;
-            	break;
+/* Submit what is queued and wait for at least one completion. Returns 0
+ * or the errno of a failure retrying won't mend. */
+static int ring_enter(io_ring_t *ring)
+{
+	unsigned submit;
 
-            default:
-                     help_show_message(argv[0]);
-                     return 1;
-                }
-    }
-   
- if (SILENCE>0)
-    {  
-    printf( "\n=== %s %s - (c) 2015 \n", argv[0],VERSION);
-    printf( "Paper: Enriching Reverse Engineering through Visual Exploration of Android Binaries\n");
-    printf( "5th Program protection and Reverse Engineering Workshop (PPREW-5)\n");
-    printf( "http://dx.doi.org/10.1145/2843859.2843866\n===\n");
-    printf( "Usage: %s  <file.dex> [sl]\n",argv[0]);
-    printf( "\t-s\tsilence, no headers\n");
-    printf( "\t-l\tlog, create log file from the image\n");
-   }
-   
-	
-    
-    // Obtain the size of the file
-    int fd = fileno(input);
-    struct stat buffs;
-    fstat(fd,&buffs);
-    int filesize = buffs.st_size;
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	for (;;) {
+		submit = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0) return 0;
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return errno;
+	}
+}
 
-    // allocate memory, load all the file in memory
-    fileinmemory = malloc(filesize*sizeof(u1));
-    if (fileinmemory == NULL) {
-        fprintf(stderr, "ERROR: Can't allocate memory for .dex file!\n");
-    }
-	fread(fileinmemory,1,filesize,input); // file in memory contains the binary
-    fclose(input);
+/* Carry slot on after one of its requests completed with res. Returns 1
+ * when it is read, or failed. */
+static int ring_read_step(io_ring_t *ring, io_slot_t *slot, int res)
+{
+	if (slot->fd < 0) {
+		if (res < 0) {
+			slot->err = -res;
+			return 1;
+		}
+		slot->fd = res;
+		slot->err = size_slot(slot);
+	} else if (res < 0) slot->err = -res;
+	else if (res == 0) slot->size = slot->filled;   // it shrank
+	else slot->filled += res;
+	if (slot->err == 0 && slot->filled < slot->size) {
+		ring_read(ring, slot);
+		return 0;
+	}
+	// a read-only close has nothing to flush
+	close(slot->fd);
+	return 1;
+}
 
-	header = (struct dex_header *)fileinmemory;
-	
-	if (filesize != *header->file_size) {
-		printf("Size of the file and reported filesize are different, it will cause errors!\n");
-		free(fileinmemory);
-		exit(-1);
+/* The same for a write: open, writev until it is all out, close. */
+static int ring_write_step(io_ring_t *ring, io_write_t *w, int res)
+{
+	struct io_uring_sqe *sqe;
+	int count;
+
+	switch (w->step) {
+	case WRITE_OPEN:
+		if (res < 0) {
+			w->err = -res;
+			return 1;
 		}
+		w->fd = res;
+		break;
+	case WRITE_DATA:
+		if (res <= 0) w->err = res < 0 ? -res : EIO;
+		else w->done += res;
+		break;
+	case WRITE_CLOSE:
+		if (res < 0 && w->err == 0) w->err = -res;
+		return 1;
+	}
+	if (w->err == 0 && (count = write_iov(w)) > 0) {
+		w->step = WRITE_DATA;
+		sqe = ring_sqe(ring, IORING_OP_WRITEV, w->fd, w, RING_WRITE);
+		sqe->addr = (uintptr_t) w->iov;
+		sqe->len = count;
+		sqe->off = w->done;
+	} else {
+		w->step = WRITE_CLOSE;
+		ring_sqe(ring, IORING_OP_CLOSE, w->fd, w, RING_WRITE);
+	}
+	return 0;
+}
 
-	dexpng.width = 256;
-   	//dexpng.height = round(filesize/256)+1;
-	//printf ("PPN file %d x and %d y\n", dexpng.width, dexpng.height);
+/* io_uring_enter failed for good, take back what the ring holds. A
+ * request still queued is dropped and one the kernel took is waited for,
+ * then its slot or write is done again with blocking calls. If the ring
+ * can't be waited on either, the requests left are given up and their
+ * files fail: the kernel may still be at them. The ring thread then
+ * carries on as the thread engine. pending is 1 for a request in the
+ * kernel, 2 once it has none. */
+static void ring_drain(io_pipeline_t *p, int err)
+{
+	io_ring_t *ring = &p->ring;
+	struct io_uring_cqe *cqe;
+	io_slot_t *slot;
+	io_write_t *w;
+	uintptr_t data;
+	unsigned head;
+	int k, res, waiting = 0, wake = 1;
+	u8 one = 1;
+
+	fprintf(stderr, "Warning: io_uring_enter: %s, -q goes on with threads\n", strerror(err));
+	pthread_mutex_lock(&p->lock);
+	p->ring_error = err;
+	pthread_mutex_unlock(&p->lock);
+
+	// what the kernel hasn't taken is dropped
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	for (; head != ring->tail; head++) {
+		data = ring->sqes[head & *ring->sq_mask].user_data;
+		if ((data & 3) == RING_WAKE) wake = 0;
+		else if ((data & 3) == RING_SLOT) ((io_slot_t *) (data & ~(uintptr_t) 3))->pending = 2;
+		else ((io_write_t *) (data & ~(uintptr_t) 3))->pending = 2;
+	}
+	ring->tail = head;
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	for (k = 0; k < p->depth; k++) waiting += (p->slots[k].pending == 1) + (p->writes[k].pending == 1);
+
+	// and the rest waited for, the eventfd read ended with a poke
+	if (wake && write(ring->wake_fd, &one, sizeof(one)) != sizeof(one)) perror("eventfd");
+	while (waiting + wake > 0) {
+		head = *ring->cq_head;
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+			continue;
+		}
+		cqe = ring->cqes + (head & *ring->cq_mask);
+		data = cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		if ((data & 3) == RING_WAKE) {
+			wake = 0;
+			continue;
+		}
+		waiting--;
+		if ((data & 3) == RING_SLOT) {
+			slot = (io_slot_t *) (data & ~(uintptr_t) 3);
+			if (slot->fd < 0 && res >= 0) slot->fd = res;
+			slot->pending = 2;
+		} else {
+			w = (io_write_t *) (data & ~(uintptr_t) 3);
+			if (w->step == WRITE_OPEN && res >= 0) w->fd = res;
+			else if (w->step == WRITE_CLOSE) w->fd = -1;
+			w->pending = 2;
+		}
+	}
 
-	dexpng.height = round(*header->file_size/256)+1;
-	printf ("PPN file %d x and %d y\n", dexpng.width, dexpng.height);
+	for (k = 0; k < p->depth; k++) {
+		w = &p->writes[k];
+		if (w->pending == 2) {
+			if (w->fd >= 0) close(w->fd);
+			w->fd = -1;
+			w->err = 0;
+			w->done = 0;
+			write_out(w);
+		} else if (w->pending == 1) {
+			w->err = err;
+			w->owned = 0;   // left to the kernel
+		} else continue;
+		w->pending = 0;
+		pthread_mutex_lock(&p->lock);
+		write_done(p, w);
+		pthread_mutex_unlock(&p->lock);
+	}
+	for (k = 0; k < p->depth; k++) {
+		slot = &p->slots[k];
+		if (slot->pending == 2) {
+			if (slot->fd >= 0) close(slot->fd);
+			slot->fd = -1;
+			slot->size = slot->filled = 0;
+			read_slot(slot, p->paths[slot->index]);
+		} else if (slot->pending == 1) {
+			slot->err = err;
+			slot->data = NULL;   // left to the kernel
+			slot->capacity = 0;
+		} else continue;
+		slot->pending = 0;
+		pthread_mutex_lock(&p->lock);
+		read_done(p, slot);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
 
-   	dexpng.pixels = calloc(sizeof (pixel_t), dexpng.width * dexpng.height);
-	//dexpng.pixels = malloc(filesize*sizeof (pixel_t));
-	
-	if (dexpng.pixels == NULL) {
-        fprintf(stderr, "ERROR: Can't allocate memory for .png file!\n");
-    }
+static void *pipeline_ring(void *arg)
+{
+	io_pipeline_t *p = arg;
+	io_ring_t *ring = &p->ring;
+	struct io_uring_cqe *cqe;
+	io_slot_t *slot;
+	io_write_t *w;
+	uintptr_t data;
+	unsigned head;
+	int res, requests = 0, stop, err;
+
+	ring_wait_wake(ring);
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while ((w = take_write(p)) != NULL) {
+			ring_open(ring, w, RING_WRITE, w->path, O_WRONLY | O_CREAT | O_TRUNC);
+			w->pending = 1;
+			requests++;
+		}
+		while ((slot = take_read(p)) != NULL) {
+			ring_open(ring, slot, RING_SLOT, p->paths[slot->index], O_RDONLY);
+			slot->pending = 1;
+			requests++;
+		}
+		stop = p->stop && requests == 0;
+		pthread_mutex_unlock(&p->lock);
+		if (stop) break;
 
-    /* Creating Log */
-    if(LOG){
-
-
-	    printf("%-25s%6s\n","Dex file:",dexfile);   
-	    printf("%-25s%6d\n","File size",*header->file_size);
-	    printf("%-25s%6d\n","Header Size(bytes)",*header->header_size);
-	    printf("%-33s0x%x\n","Header Size",*header->header_size);
-
-	    printf("\n\n");
-	    printf("%-25s%6d\n","Link_size",*header->link_size);
-	    printf("%-35s%6x hex\n","Link_offset", *header->link_off);
-	    printf("%-35s%6x hex\n","Map_offset", *header->map_off);
-	    printf("%-25s%6d\n","String_size", *header->string_ids_size);
-	    printf("%-35s%6x hex\n","String_Offset", *header->string_ids_off);
-	    printf("%-25s%6d\n","Type_size", *header->type_ids_size);
-	    printf("%-35s%6x hex\n","Type_offset", *header->type_ids_off);
-	    printf("%-25s%6d\n","Prototype_size", *header->proto_ids_size);
-	    printf("%-35s%6x hex\n","Prototype_offset", *header->proto_ids_off);
-	    printf("%-25s%6d\n","Field_size", *header->field_ids_size);
-	    printf("%-35s%6x hex\n","Field_offset", *header->field_ids_off);
-	    printf("%-25s%6d\n","Method_size", *header->method_ids_size);
-	    printf("%-35s%6x hex\n","Method_offset", *header->method_ids_off);
-	    printf("%-25s%6d\n","Class_size", *header->class_defs_size);
-	    printf("%-35s%6x hex\n","Class_offset", *header->class_defs_off);
-	    printf("%-25s%6d\n","Data_size", *header->data_size);
-	    printf("%-35s%6x hex\n","Data_offset", *header->data_off);
-	    printf("\n\n");
-
-	  	printf("%-30s%6d\n","Width",dexpng.width);
-	  	printf("%-30s%6d\n","Height",dexpng.height);
-
-	  	
-		
-
-	}
-
-
-	/* print dex header information */   
-	 if ((strncmp(header->magic.dex,"dex",3) != 0) || 
-	     (strncmp(header->magic.newline,"\n",1) != 0) || 
-	     (strncmp(header->magic.zero,"\0",1) != 0 ) ) {
-		fprintf (stderr, "ERROR: not a dex file\n");
-		fclose(input);
-		exit(1);
-	    }
+		if ((err = ring_enter(ring)) != 0) {
+			ring_drain(p, err);
+			return pipeline_thread(p);
+		}
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = ring->cqes + (head & *ring->cq_mask);
+			data = cqe->user_data;
+			res = cqe->res;
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+			switch (data & 3) {
+			case RING_WAKE:
+				ring_wait_wake(ring);
+				break;
+			case RING_SLOT:
+				slot = (io_slot_t *) (data & ~(uintptr_t) 3);
+				if (!ring_read_step(ring, slot, res)) break;
+				slot->pending = 0;
+				pthread_mutex_lock(&p->lock);
+				read_done(p, slot);
+				pthread_mutex_unlock(&p->lock);
+				requests--;
+				break;
+			case RING_WRITE:
+				w = (io_write_t *) (data & ~(uintptr_t) 3);
+				if (!ring_write_step(ring, w, res)) break;
+				w->pending = 0;
+				pthread_mutex_lock(&p->lock);
+				write_done(p, w);
+				pthread_mutex_unlock(&p->lock);
+				requests--;
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+#endif
 
-	//put_pixels( &dexpng, *header->data_off, *header->data_size*sizeof(u1), 100,100,100); // data grey
+/* Start reading paths, depth files ahead. */
+static io_pipeline_t *open_pipeline(char **paths, size_t count, int depth)
+{
+	io_pipeline_t *p = calloc(1, sizeof(io_pipeline_t));
+	int k;
+
+	if (p == NULL) return NULL;
+	p->paths = paths;
+	p->count = count;
+	p->depth = depth;
+	p->slots = calloc(depth, sizeof(io_slot_t));
+	p->writes = calloc(depth, sizeof(io_write_t));
+	p->threads = calloc(depth, sizeof(pthread_t));
+	if (p->slots == NULL || p->writes == NULL || p->threads == NULL) {
+		free(p->slots);
+		free(p->writes);
+		free(p->threads);
+		free(p);
+		return NULL;
+	}
+	for (k = depth - 1; k >= 0; k--) {
+		p->slots[k].next = p->free_slots;
+		p->free_slots = &p->slots[k];
+		p->writes[k].next = p->free_writes;
+		p->free_writes = &p->writes[k];
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->ready_cond, NULL);
+	pthread_cond_init(&p->write_cond, NULL);
+	pthread_cond_init(&p->io_cond, NULL);
+	p->last = monotonic_seconds();
+
+#ifdef HAVE_IO_URING
+	// a slot and a write per depth, and the wake read
+	if (ring_setup(&p->ring, 2 * depth + 1) == 0) {
+		p->uring = 1;
+		p->nthreads = 1;
+		pthread_create(&p->threads[0], NULL, pipeline_ring, p);
+		return p;
+	}
+#endif
+	p->nthreads = depth;
+	for (k = 0; k < depth; k++) pthread_create(&p->threads[k], NULL, pipeline_thread, p);
+	return p;
+}
 
+/* Once the workers are done: finish the writes and stop the I/O. */
+static void finish_pipeline(io_pipeline_t *p)
+{
+	int k;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pipeline_wake(p);
+	pthread_mutex_unlock(&p->lock);
+	for (k = 0; k < p->nthreads; k++) pthread_join(p->threads[k], NULL);
+	pthread_mutex_lock(&p->lock);
+	pipeline_account(p);
+	pthread_mutex_unlock(&p->lock);
+}
 
-	if (strncmp(header->magic.ver,"035",3) != 0) {
-		fprintf (stderr,"Warning: Dex file version != 035\n");
+static void free_pipeline(io_pipeline_t *p)
+{
+	int k;
+
+#ifdef HAVE_IO_URING
+	if (p->uring) ring_free(&p->ring);
+#endif
+	for (k = 0; k < p->depth; k++) {
+		free(p->slots[k].data);
+		free(p->writes[k].pixels);
 	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->ready_cond);
+	pthread_cond_destroy(&p->write_cond);
+	pthread_cond_destroy(&p->io_cond);
+	free(p->slots);
+	free(p->writes);
+	free(p->threads);
+	free(p);
+}
 
-	if (*header->header_size != 0x70) {
-		fprintf (stderr,"Warning: Header size != 0x70\n");
+/* The next file read ahead, or NULL once every file was handed out. */
+static io_slot_t *pipeline_next(io_pipeline_t *p)
+{
+	double start = monotonic_seconds();
+	io_slot_t *slot;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->ready == NULL && (p->next < p->count || p->loading > 0))
+		pthread_cond_wait(&p->ready_cond, &p->lock);
+	slot = p->ready;
+	if (slot != NULL) {
+		p->ready = slot->next;
+		if (p->ready == NULL) p->ready_tail = NULL;
+		pipeline_account(p);
+		p->busy++;
 	}
-	put_pixels (&dexpng, 0 ,*header->header_size, 255,0,0);  // header -- red
+	p->input_wait += monotonic_seconds() - start;
+	pthread_mutex_unlock(&p->lock);
+	return slot;
+}
+
+/* Done with the file in slot, read the next one into it. */
+static void pipeline_release(io_pipeline_t *p, io_slot_t *slot)
+{
+	pthread_mutex_lock(&p->lock);
+	pipeline_account(p);
+	p->busy--;
+	slot->next = p->free_slots;
+	p->free_slots = slot;
+	pipeline_wake(p);
+	pthread_mutex_unlock(&p->lock);
+}
 
-	if (*header->endian_tag != 0x12345678) {
-		fprintf (stderr,"Warning: Endian tag != 0x12345678\n");
+static io_write_t *reserve_write(io_pipeline_t *p, const char *path)
+{
+	double start = monotonic_seconds();
+	io_write_t *w;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->free_writes == NULL) pthread_cond_wait(&p->write_cond, &p->lock);
+	w = p->free_writes;
+	p->free_writes = w->next;
+	p->write_wait += monotonic_seconds() - start;
+	pthread_mutex_unlock(&p->lock);
+	snprintf(w->path, sizeof(w->path), "%s", path);
+	return w;
+}
+
+static void queue_write(io_pipeline_t *p, io_write_t *w)
+{
+	pthread_mutex_lock(&p->lock);
+	w->next = NULL;
+	if (p->queued_tail != NULL) p->queued_tail->next = w;
+	else p->queued = w;
+	p->queued_tail = w;
+	pipeline_wake(p);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static const char *pipeline_engine(io_pipeline_t *p)
+{
+	if (p->ring_error) return "io_uring, then threads";
+	return p->uring ? "io_uring" : "threads";
+}
+
+/* The -q summary, a line for stderr or the "pipeline" member of the -t
+ * batch line. I/O is the time a read or write was under way, parsing the
+ * time a worker had a file. */
+static void report_pipeline(io_pipeline_t *p, FILE *fp, int json)
+{
+	double io = p->io_only + p->overlap, parse = p->parse_only + p->overlap;
+
+	if (json) {
+		fprintf(fp, "\"pipeline\":{\"engine\":\"%s\",\"depth\":%d,\"io_s\":%.3f,\"parse_s\":%.3f,"
+			"\"overlap_s\":%.3f,\"input_wait_s\":%.3f,\"write_wait_s\":%.3f,\"read_bytes\":%llu,"
+			"\"written_bytes\":%llu,\"writes\":%llu,\"write_failed\":%llu},",
+			pipeline_engine(p), p->depth, io, parse, p->overlap, p->input_wait, p->write_wait,
+			(unsigned long long) p->read_bytes, (unsigned long long) p->written_bytes,
+			(unsigned long long) p->writes_done, (unsigned long long) p->write_failed);
+		return;
 	}
+	fprintf(fp, "Pipeline: %s, depth %d: I/O %.3f s, parsing %.3f s, both %.3f s (%.0f%% of the I/O hidden), "
+		"workers waited %.3f s for input and %.3f s for writes, %.1f MB read, %.1f MB in %llu writes (%llu failed)\n",
+		pipeline_engine(p), p->depth, io, parse, p->overlap, io > 0 ? 100 * p->overlap / io : 0.0,
+		p->input_wait, p->write_wait, p->read_bytes / 1e6, p->written_bytes / 1e6,
+		(unsigned long long) p->writes_done, (unsigned long long) p->write_failed);
+}
+
+/* dc_save_ppm_to_file behind the worker. bitmap has buf's pixels, they go
+ * with the write and buf gets the spare of the write slot. */
+static int pipeline_save_ppm(io_pipeline_t *p, dex_buffers_t *buf, bitmap_t *bitmap, const char *path)
+{
+	io_write_t *w;
+	pixel_t *spare;
+	size_t spare_size;
+
+	if (bitmap->pixels != buf->pixels) return dc_save_ppm_to_file(bitmap, path);
+	w = reserve_write(p, path);
+	w->head_len = snprintf(w->head, sizeof(w->head), "P6\n%zu %zu\n255\n", bitmap->width, bitmap->height);
+	w->data = (u1 *) bitmap->pixels;
+	w->len = bitmap->width * bitmap->height * sizeof(pixel_t);
+	w->owned = 0;
+	spare = w->pixels;
+	spare_size = w->pixels_size;
+	w->pixels = buf->pixels;
+	w->pixels_size = buf->pixels_size;
+	buf->pixels = spare;
+	buf->pixels_size = spare_size;
+	queue_write(p, w);
+	return DC_OK;
+}
 
-	/* check the link stuff */
-	if (*header->link_size != 0 && *header->link_off !=0 ){
-		put_pixels (&dexpng, *header->data_off + *header->data_size+*header->link_off ,*header->link_size, 255,255,0);  // link -- orange
+/* dc_save_png_to_file behind the worker: encoded here, written there. */
+static int pipeline_save_png(io_pipeline_t *p, bitmap_t *bitmap, region_list_t *runs, const char *path)
+{
+	io_write_t *w;
+	char *data = NULL;
+	size_t len = 0;
+	FILE *mem;
+	int err;
+
+	mem = open_memstream(&data, &len);
+	if (mem == NULL) return DC_ERR_NOMEM;
+	err = dc_save_png_to_stream(bitmap, runs, mem);
+	if (fclose(mem) != 0 && err == DC_OK) err = DC_ERR_NOMEM;
+	if (err != DC_OK) {
+		free(data);
+		return err;
 	}
-	
-	/* check the map stuff the offset should be in the data section*/
-	if (*header->map_off != 0){
-		if (*header->map_off < *header->data_off) fprintf(stderr, "Warning: Map offset not in the Data section\n");
-		
-		u4 mapsize = (u4 *)*(fileinmemory + *header->map_off);
-		put_pixels (&dexpng, *header->map_off ,mapsize*sizeof(map_item_struct)+sizeof(u4), 0,0,255);  // map -- blue
+	w = reserve_write(p, path);
+	w->head_len = 0;
+	w->data = (u1 *) data;
+	w->len = len;
+	w->owned = 1;
+	queue_write(p, w);
+	return DC_OK;
+}
+
+/* -- result cache --
+ * An entry is one file per output, named after the signature, the size
+ * and the options: <sig>_<size>_<optkey>.png, .ppn, .dcr, .items (-D),
+ * .csv (the -F line
+ * without the file name), .regions.csv and .entropy.png or .ppn (-e).
+ * Entries are written to a temporary name and renamed in, so concurrent
+ * runs sharing a directory never see half an entry. A hit touches its
+ * files and eviction removes the oldest mtimes first, which makes it an
+ * LRU. */
+
+static int scan_cache(result_cache_t *cache, u8 keep);
+
+int open_cache(result_cache_t *cache, const char *dir, u8 limit, options_t *opt)
+{
+	memset(cache, 0, sizeof(*cache));
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		perror(dir);
+		return 1;
 	}
+	cache->dir = dir;
+	cache->limit = limit;
+	snprintf(cache->optkey, sizeof(cache->optkey), "%s%s%s%s%s%s%zux%zu", DC_VERSION,
+		opt->diff ? "d" : opt->features ? "f" : opt->dcr ? "x" : opt->png ? "p" : "r", opt->regions ? "i" : "", opt->entropy ? "e" : "", opt->map_walk ? "M" : "",
+		opt->opcodes ? "O" : "", opt->thumb_width, opt->thumb_height);
+	pthread_mutex_init(&cache->lock, NULL);
+	return scan_cache(cache, limit);
+}
+
+void report_cache(result_cache_t *cache)
+{
+	u8 lookups = cache->hits + cache->misses;
 
+	fprintf(stderr, "Cache: %llu hits, %llu misses (%.1f%% hit rate), %llu stored, %llu evicted, %.1f MB in %s\n",
+		(unsigned long long) cache->hits, (unsigned long long) cache->misses,
+		lookups ? 100.0 * cache->hits / lookups : 0.0, (unsigned long long) cache->stores,
+		(unsigned long long) cache->evictions, cache->size / 1e6, cache->dir);
+}
 
-    u2 strptr = sizeof(string_id_struct);
+static void cache_path(result_cache_t *cache, const u1 *signature, u4 file_size, const char *ext,
+	char *out, size_t size)
+{
+	char hex[41];
+	int k;
 
-	/* Print the string part of the header */
-	put_pixels ( &dexpng,*header->string_ids_off,*header->string_ids_size*strptr , 0,109,44);  // string_ids  -- darkgreen
-	put_pixels( &dexpng, *header->type_ids_off, *header->type_ids_size*sizeof(type_id_struct), 44,162,95); // type_ids -- green
-	put_pixels( &dexpng, *header->proto_ids_off, *header->proto_ids_size*sizeof(proto_id_struct), 102,194,164); // proto ids -- greenblue
-	put_pixels( &dexpng, *header->field_ids_off, *header->field_ids_size*sizeof(field_id_struct), 153,216,201); // fields -- aquamarine  
-    put_pixels( &dexpng, *header->method_ids_off, *header->method_ids_size*sizeof(method_id_struct), 204,236,230); // Method ids  -- bluegreen 
-    put_pixels( &dexpng, *header->class_defs_off, *header->class_defs_size*sizeof(class_def_struct), 237,248,251); // class defs  
+	for (k = 0; k < 20; k++) sprintf(hex + k * 2, "%02x", signature[k]);
+	snprintf(out, size, "%s/%s_%u_%s%s", cache->dir, hex, file_size, cache->optkey, ext);
+}
 
-    // Color the strings
-    int old = 0;
-    int order;
-    for (i= 0; i < *header->string_ids_size; i++) {
-        string_id_list = (struct string_id_struct *) (fileinmemory + *header->string_ids_off + strptr * i); 
-        if (*header->string_ids_off > old) order=1; else order =0;
-        old = *header->string_ids_off;
-		ColorStrings(&dexpng, fileinmemory, *string_id_list->string_data_off, order);
-	}
+typedef struct {
+	time_t mtime;
+	off_t size;
+	char *path;
+} cache_file_t;
 
-    //Color the prototypes parameters
-    for (i= 0; i < *header->proto_ids_size; i++) {
-        proto_id_list = (struct proto_id_struct *) (fileinmemory + *header->proto_ids_off + sizeof(proto_id_struct) *i);
-        if (*proto_id_list->parameters_off != 0) {  // It contains parameters ...
-				u4 listsize = (u4 *)*(fileinmemory + *proto_id_list->parameters_off);
-				put_pixels (&dexpng, *proto_id_list->parameters_off ,listsize*sizeof(type_id_struct)+sizeof(u4), 0,100,255);  // prototype parameters
-			}
+static int compare_cache_files(const void *a, const void *b)
+{
+	const cache_file_t *x = a, *y = b;
+	return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* Recount the directory and, when it holds more than keep bytes, remove
+ * the least recently used files until it doesn't. Runs outside the lock,
+ * one scan at a time (cache->scanning): what stores add meanwhile is
+ * kept on top of the recount, and a file of theirs the scan also saw
+ * counts twice until the next scan. */
+static int scan_cache(result_cache_t *cache, u8 keep)
+{
+	DIR *d = opendir(cache->dir);
+	struct dirent *entry;
+	struct stat st;
+	cache_file_t *files = NULL, *grown;
+	size_t count = 0, capacity = 0, k;
+	u8 size = 0, before, evicted = 0;
+	char path[PATH_MAX];
+	int err = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	before = cache->size;
+	pthread_mutex_unlock(&cache->lock);
+	if (d == NULL) {
+		perror(cache->dir);
+		err = 1;
+		goto done;
 	}
-	
-	// Working with the classes
-	
-    for (i= 0; i < *header->class_defs_size; i++) {
-        class_def_list = (struct class_def_struct *) (fileinmemory + *header->class_defs_off + sizeof(class_def_struct) *i);
-		// -- interfaces
-        if (*class_def_list->interfaces_off != 0) {  // It contains interfaces ...
-				u4 listsize = (u4 *)*(fileinmemory + *class_def_list->interfaces_off);
-				put_pixels (&dexpng, *class_def_list->interfaces_off ,listsize*sizeof(type_id_struct)+sizeof(u4), 0,150,255);  // class interfaces
-		}
-		// -- annotations
-        if (*class_def_list->annotations_off != 0) {  // It contains interfaces ...
-				annotations_directory_list = (annotations_directory_item_struct *) (fileinmemory + *class_def_list->annotations_off);
-				u4 listsize = sizeof(annotations_directory_item_struct) + *annotations_directory_list->fields_size * sizeof(u4)*2;
-				listsize += (*annotations_directory_list->annotated_methods_size * sizeof(u4))*2;
-				listsize += (*annotations_directory_list->annotated_parameters_size * sizeof(u4))*2;
-				put_pixels (&dexpng, *class_def_list->annotations_off ,listsize+sizeof(u4), 155,0,175);  // annotations
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, entry->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			grown = realloc(files, capacity * sizeof(cache_file_t));
+			if (grown == NULL) {
+				err = 1;
+				break;
 			}
-		// TODO : work with the offsets inside the annotations 
-		// -- class_data
-		if (*class_def_list->class_data_off != 0) {  // It contains data, that means not interface.
-				Analize_class_data(&dexpng, fileinmemory, *class_def_list->class_data_off); // This is a dynamic structure
-			}
-		// -- static_values
-		if (*class_def_list->static_values_off != 0) {  // Offset to the list of initial values for static fields
-				//encoded_array format  size=uleb128 + encoded_values[size]
-				Analyze_encoded_value(&dexpng, fileinmemory, *class_def_list->static_values_off); // This is a dynamic structure
+			files = grown;
+		}
+		files[count].mtime = st.st_mtime;
+		files[count].size = st.st_size;
+		files[count].path = strdup(path);
+		if (files[count].path == NULL) {
+			err = 1;
+			break;
 		}
+		size += st.st_size;
+		count++;
 	}
+	closedir(d);
+	if (err) fprintf(stderr, "ERROR: %s: %s\n", cache->dir, dc_strerror(DC_ERR_NOMEM));
+
+	// a short list leaves the count as it was and evicts nothing
+	if (!err && size > keep) {
+		qsort(files, count, sizeof(cache_file_t), compare_cache_files);
+		for (k = 0; k < count && size > keep; k++) {
+			if (unlink(files[k].path) != 0) continue;
+			size -= files[k].size;
+			evicted++;
+		}
+	}
+	for (k = 0; k < count; k++) free(files[k].path);
+	free(files);
+
+done:
+	pthread_mutex_lock(&cache->lock);
+	if (!err) cache->size = size + (cache->size - before);
+	cache->evictions += evicted;
+	cache->scanning = 0;
+	pthread_mutex_unlock(&cache->lock);
+	return err;
+}
 
-	save_ppm_to_file (&dexpng, outputname);
-	
-	free(fileinmemory);
-	free(dexpng.pixels);
-	free(outputname);
-	return 0;
+static int copy_file(const char *from, const char *to)
+{
+	char chunk[65536];
+	int in, out, ret = 0;
+	ssize_t n;
+
+	in = open(from, O_RDONLY);
+	if (in < 0) return 1;
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		close(in);
+		return 1;
+	}
+	while ((n = read(in, chunk, sizeof(chunk))) > 0)
+		if (write(out, chunk, n) != n) {
+			ret = 1;
+			break;
+		}
+	if (n < 0) ret = 1;
+	close(in);
+	if (close(out) != 0) ret = 1;
+	return ret;
+}
+
+static char *read_small_file(const char *path, long *length)
+{
+	FILE *fp = fopen(path, "rb");
+	char *data;
+	long size;
+
+	if (fp == NULL) return NULL;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	data = malloc(size + 1);
+	if (data != NULL && fread(data, 1, size, fp) != size) {
+		free(data);
+		data = NULL;
+	}
+	if (data != NULL) data[size] = '\0';
+	if (length != NULL) *length = size;
+	fclose(fp);
+	return data;
+}
+
+/* Serve a dex from the cache. Returns 1 on a hit, with every output of
+ * the options in place, and 0 when anything is missing. */
+int cache_fetch(options_t *opt, const char *dexfile, const char *outbase, const u1 *signature, u4 file_size)
+{
+	result_cache_t *cache = opt->cache;
+	char entry[PATH_MAX], regions_entry[PATH_MAX], entropy_entry[PATH_MAX], out[PATH_MAX];
+	char *line;
+
+	if (opt->features) {
+		cache_path(cache, signature, file_size, ".csv", entry, sizeof(entry));
+		line = read_small_file(entry, NULL);
+		if (line == NULL) return 0;
+		// one write per line, as dc_print_features does
+		char *full = malloc(strlen(dexfile) + strlen(line) + 2);
+		if (full == NULL) {
+			free(line);
+			return 0;
+		}
+		sprintf(full, "%s,%s", dexfile, line);
+		fputs(full, opt->out);
+		free(full);
+		free(line);
+	} else {
+		cache_path(cache, signature, file_size, image_ext(opt), entry, sizeof(entry));
+		if (access(entry, R_OK) != 0) return 0;
+		if (opt->regions) {
+			cache_path(cache, signature, file_size, ".regions.csv", regions_entry, sizeof(regions_entry));
+			if (access(regions_entry, R_OK) != 0) return 0;
+			if (output_name(out, sizeof(out), outbase, opt->outdir, ".regions.csv") ||
+			    copy_file(regions_entry, out) != 0) return 0;
+			utimensat(AT_FDCWD, regions_entry, NULL, 0);
+		}
+		if (output_name(out, sizeof(out), outbase, opt->outdir, image_ext(opt)) ||
+		    copy_file(entry, out) != 0) return 0;
+		if (opt->written) fprintf(opt->written, "%s\n", out);
+		if (opt->entropy) {
+			cache_path(cache, signature, file_size, entropy_ext(opt), entropy_entry, sizeof(entropy_entry));
+			if (access(entropy_entry, R_OK) != 0) return 0;
+			if (output_name(out, sizeof(out), outbase, opt->outdir, entropy_ext(opt)) ||
+			    copy_file(entropy_entry, out) != 0) return 0;
+			utimensat(AT_FDCWD, entropy_entry, NULL, 0);
+			if (opt->written) fprintf(opt->written, "%s\n", out);
+		}
+	}
+	utimensat(AT_FDCWD, entry, NULL, 0);
+	pthread_mutex_lock(&cache->lock);
+	cache->hits++;
+	pthread_mutex_unlock(&cache->lock);
+	return 1;
+}
+
+/* Add one output to the cache, from a file (from != NULL) or from len bytes
+ * of memory. */
+static void cache_put(result_cache_t *cache, const u1 *signature, u4 file_size, const char *ext,
+	const char *from, const char *data, size_t len)
+{
+	static _Atomic unsigned serial;
+	char entry[PATH_MAX], tmp[PATH_MAX];
+	struct stat st;
+	FILE *fp;
+	int scan;
+
+	cache_path(cache, signature, file_size, ext, entry, sizeof(entry));
+	snprintf(tmp, sizeof(tmp), "%s/.tmp.%d.%u", cache->dir, (int) getpid(), atomic_fetch_add(&serial, 1));
+	if (from != NULL) {
+		if (copy_file(from, tmp) != 0) {
+			unlink(tmp);
+			return;
+		}
+	} else {
+		fp = fopen(tmp, "wb");
+		if (fp == NULL) return;
+		if (fwrite(data, 1, len, fp) != len) {
+			fclose(fp);
+			unlink(tmp);
+			return;
+		}
+		if (fclose(fp) != 0) {
+			unlink(tmp);
+			return;
+		}
+	}
+	if (stat(tmp, &st) != 0 || rename(tmp, entry) != 0) {
+		unlink(tmp);
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	cache->stores++;
+	cache->size += st.st_size;
+	scan = cache->size > cache->limit && !cache->scanning;
+	if (scan) cache->scanning = 1;
+	pthread_mutex_unlock(&cache->lock);
+	// evict down to 90% so the next few stores don't rescan again
+	if (scan) scan_cache(cache, cache->limit / 10 * 9);
+}
+
+void cache_miss(result_cache_t *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+static void print_warnings(u4 warnings)
+{
+	if (warnings & DC_WARN_VERSION) fprintf (stderr,"Warning: Dex file version != 035\n");
+	if (warnings & DC_WARN_HEADER_SIZE) fprintf (stderr,"Warning: Header size != 0x70\n");
+	if (warnings & DC_WARN_ENDIAN) fprintf (stderr,"Warning: Endian tag != 0x12345678\n");
+	if (warnings & DC_WARN_MAP_OFFSET) fprintf(stderr, "Warning: Map offset not in the Data section\n");
+	if (warnings & DC_WARN_NO_MAP) fprintf(stderr, "Warning: No usable map_list, following the class definitions instead\n");
+	if (warnings & DC_WARN_CHECKSUM) fprintf(stderr, "Warning: Checksum does not match the file\n");
+	if (warnings & DC_WARN_SIGNATURE) fprintf(stderr, "Warning: Signature does not match the file\n");
+}
+
+/* -e: the byte entropy of dex, on the layout of its image or averaged into
+ * the -r thumbnail. Stored in the cache under signature unless it is NULL. */
+static int write_entropy(const char *outbase, const u1 *dex, options_t *opt, dex_buffers_t *buf,
+	const u1 *signature)
+{
+	char outputname[PATH_MAX];
+	dc_context_t *ctx = &buf->ctx;
+	bitmap_t image;
+	phase_t phase;
+	int err;
+
+	if (output_name(outputname, sizeof(outputname), outbase, opt->outdir, entropy_ext(opt))) {
+		fprintf(stderr, "ERROR: %s: output name too long\n", outbase);
+		return 1;
+	}
+	image.width = opt->thumb_width ? opt->thumb_width : ctx->width;
+	image.height = opt->thumb_width ? opt->thumb_height : ctx->height;
+	image.pixels = reserve_pixels(buf, image.width * image.height);
+	if (dc_render_entropy(ctx, dex, ctx->file_size, &image) != DC_OK) {
+		fprintf(stderr, "ERROR: Can't allocate memory for the entropy image!\n");
+		return 1;
+	}
+
+	dc_phase_begin(opt->timing ? &ctx->timing : NULL, NULL, &phase);
+	if (opt->pipeline && signature == NULL) {
+		if (opt->png) err = pipeline_save_png (opt->pipeline, &image, NULL, outputname);
+		else err = pipeline_save_ppm (opt->pipeline, buf, &image, outputname);
+	} else if (opt->png) err = dc_save_png_to_file (&image, NULL, outputname);
+	else err = dc_save_ppm_to_file (&image, outputname);
+	dc_phase_end(opt->timing ? &ctx->timing : NULL, NULL, &phase, PHASE_SAVE);
+	ctx->timing.items[PHASE_SAVE]++;
+	ctx->timing.bytes[PHASE_SAVE] += image.width * image.height * sizeof(pixel_t);
+	if (err != DC_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", outputname, dc_strerror(err));
+		return 1;
+	}
+	if (opt->written) fprintf(opt->written, "%s\n", outputname);
+	if (signature) cache_put(opt->cache, signature, ctx->file_size, entropy_ext(opt), outputname, NULL, 0);
+	return 0;
+}
+
+/* Paint ctx->runs into the image the options ask for, or save them as a
+ * .dcr with the header of dex, and write the region list with -i and the
+ * entropy of dex with -e. Stored in the cache under signature unless it is
+ * NULL. */
+static int write_image(const char *outbase, const u1 *dex, options_t *opt, dex_buffers_t *buf,
+	const u1 *signature)
+{
+	char outputname[PATH_MAX], regionsname[PATH_MAX];
+	dc_context_t *ctx = &buf->ctx;
+	bitmap_t dexpng;
+	phase_t phase;
+	int err;
+
+	if (output_name(outputname, sizeof(outputname), outbase, opt->outdir, image_ext(opt)) ||
+	    output_name(regionsname, sizeof(regionsname), outbase, opt->outdir, ".regions.csv")) {
+		fprintf(stderr, "ERROR: %s: output name too long\n", outbase);
+		return 1;
+	}
+	dexpng.width = ctx->width;
+	dexpng.height = ctx->height;
+
+	if (opt->dcr || opt->zoom) {
+		// the runs alone, or tiles painted one at a time while saving
+		dexpng.pixels = NULL;
+		err = DC_OK;
+	} else if (opt->thumb_width) {
+		// the thumbnail is built from the runs, no full-size bitmap
+		dexpng.width = opt->thumb_width;
+		dexpng.height = opt->thumb_height;
+		dexpng.pixels = reserve_pixels(buf, dexpng.width * dexpng.height);
+		err = dc_render_thumbnail(ctx, &dexpng);
+	} else if (opt->png) {
+		// rows are rasterized while the png is written
+		dexpng.pixels = NULL;
+		err = DC_OK;
+	} else {
+		dexpng.pixels = reserve_pixels(buf, dexpng.width * dexpng.height);
+		err = dc_render(ctx, &dexpng);
+	}
+	if (err != DC_OK) {
+        fprintf(stderr, "ERROR: Can't allocate memory for .png file!\n");
+		return 1;
+    }
+
+	if (opt->regions) {
+		if (dc_save_regions_to_file(&ctx->runs, regionsname) != DC_OK) {
+			fprintf(stderr, "ERROR: Can't create regions file!\n");
+			signature = NULL;
+		} else if (signature) cache_put(opt->cache, signature, ctx->file_size, ".regions.csv", regionsname, NULL, 0);
+	}
+
+	dc_phase_begin(opt->timing ? &ctx->timing : NULL, NULL, &phase);
+	// a streamed png also rasterizes here, the render phase stays empty
+	if (opt->zoom) err = dc_save_dzi_to_file (ctx, outputname);
+	else if (opt->dcr) err = dc_save_dcr_to_file (&ctx->runs, dex, outputname);
+	else if (opt->pipeline && signature == NULL) {
+		// -q, written behind; the cache would copy the file right away
+		if (opt->png) err = pipeline_save_png (opt->pipeline, &dexpng, &ctx->runs, outputname);
+		else err = pipeline_save_ppm (opt->pipeline, buf, &dexpng, outputname);
+	} else if (opt->png) err = dc_save_png_to_file (&dexpng, &ctx->runs, outputname);
+	else err = dc_save_ppm_to_file (&dexpng, outputname);
+	dc_phase_end(opt->timing ? &ctx->timing : NULL, NULL, &phase, PHASE_SAVE);
+	ctx->timing.items[PHASE_SAVE]++;
+	if (!opt->dcr && !opt->zoom) ctx->timing.bytes[PHASE_SAVE] += dexpng.width * dexpng.height * sizeof(pixel_t);
+	if (err != DC_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", outputname, dc_strerror(err));
+		return 1;
+	}
+	if (opt->written) fprintf(opt->written, "%s\n", outputname);
+	if (signature) cache_put(opt->cache, signature, ctx->file_size, image_ext(opt), outputname, NULL, 0);
+	if (opt->entropy && dex != NULL) return write_entropy(outbase, dex, opt, buf, signature);
+	return 0;
+}
+
+/* -A: the runs of the last dex onto the grid of the worker, nothing is
+ * written for the file itself. */
+static int aggregate_runs(const char *dexfile, options_t *opt, dex_buffers_t *buf)
+{
+	dc_context_t *ctx = &buf->ctx;
+	phase_t phase;
+	int err;
+
+	if (buf->aggregate.counts == NULL) {
+		err = dc_aggregate_init(&buf->aggregate, opt->aggregate_width, opt->aggregate_height);
+		if (err != DC_OK) {
+			fprintf(stderr, "ERROR: %s: %s\n", dexfile, dc_strerror(err));
+			return 1;
+		}
+	}
+	dc_phase_begin(opt->timing ? &ctx->timing : NULL, NULL, &phase);
+	dc_aggregate_add(&buf->aggregate, &ctx->runs, ctx->file_size);
+	dc_phase_end(opt->timing ? &ctx->timing : NULL, NULL, &phase, PHASE_RENDER);
+	ctx->timing.items[PHASE_RENDER]++;
+	return 0;
+}
+
+/* -A, once every file is in: the mean layout as aggregate.ppn (or .png)
+ * and the counts behind it as aggregate.csv, in the output directory. */
+int write_aggregate(const dc_aggregate_t *agg, options_t *opt)
+{
+	char outputname[PATH_MAX], countsname[PATH_MAX];
+	bitmap_t image;
+	int err;
+
+	if (output_name(outputname, sizeof(outputname), "aggregate", opt->outdir, opt->png ? ".png" : ".ppn") ||
+	    output_name(countsname, sizeof(countsname), "aggregate", opt->outdir, ".csv")) {
+		fprintf(stderr, "ERROR: aggregate: output name too long\n");
+		return 1;
+	}
+	image.width = agg->width;
+	image.height = agg->height;
+	image.pixels = malloc(image.width * image.height * sizeof(pixel_t));
+	if (image.pixels == NULL) {
+		fprintf(stderr, "ERROR: Can't allocate memory for the aggregate image!\n");
+		return 1;
+	}
+	dc_render_aggregate(agg, &image);
+	if (opt->png) err = dc_save_png_to_file (&image, NULL, outputname);
+	else err = dc_save_ppm_to_file (&image, outputname);
+	free(image.pixels);
+	if (err == DC_OK) {
+		strcpy(outputname, countsname);
+		err = dc_save_aggregate_to_file(agg, countsname);
+	}
+	if (err != DC_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", outputname, dc_strerror(err));
+		return 1;
+	}
+	fprintf(stderr, "Aggregate: %llu dex on a %zux%zu grid, %s\n", (unsigned long long) agg->files,
+		agg->width, agg->height, countsname);
+	return 0;
+}
+
+/* Render one dex already in memory. dexfile names it in messages and
+ * outbase is what the output names are made from. */
+int render_dex_image(const char *dexfile, const char *outbase, const u1 *fileinmemory, size_t filesize,
+	options_t *opt, dex_buffers_t *buf)
+{
+	dc_context_t *ctx = &buf->ctx;
+	phase_t phase;
+	u1 signature[20];
+	int cached = opt->cache != NULL && !opt->log;
+	u4 mismatch = 0;
+	int err;
+
+	if (opt->verify && dc_verify(ctx, fileinmemory, filesize, &mismatch) == DC_OK && mismatch) {
+		print_warnings(mismatch);
+		if (mismatch & DC_WARN_CHECKSUM) buf->bad_checksums++;
+		if (mismatch & DC_WARN_SIGNATURE) buf->bad_signatures++;
+		// altered after signing, the signature names what it was before
+		cached = 0;
+	}
+	if (cached && dc_dex_signature(fileinmemory, filesize, signature, NULL) == DC_OK) {
+		if (cache_fetch(opt, dexfile, outbase, signature, filesize)) {
+			buf->cache_hits++;
+			return 0;
+		}
+	} else cached = 0;
+
+	err = dc_parse(ctx, fileinmemory, filesize);
+	if (err == DC_ERR_SIZE) {
+		fprintf(stderr, "%s: Size of the file and reported filesize are different, it will cause errors!\n", dexfile);
+		return -1;
+	}
+	if (err != DC_OK) {
+		fprintf (stderr, "ERROR: %s: %s\n", dexfile, dc_strerror(err));
+		return 1;
+	}
+	print_warnings(ctx->warnings);
+	if (cached) cache_miss(opt->cache);
+
+	if (!opt->batch && !opt->features && !opt->aggregate_width) {
+		if (opt->thumb_width) printf ("PPN file %zu x and %zu y\n", opt->thumb_width, opt->thumb_height);
+		else printf ("PPN file %zu x and %zu y\n", ctx->width, ctx->height);
+	}
+
+    /* Creating Log */
+    if(opt->log){
+	    dc_print_header(stdout, dexfile, fileinmemory);
+	  	printf("%-30s%6zu\n","Width",ctx->width);
+	  	printf("%-30s%6zu\n","Height",ctx->height);
+	  	if (opt->verify) {
+	  		printf("%-30s%6s\n","Checksum",mismatch & DC_WARN_CHECKSUM ? "BAD" : "ok");
+	  		printf("%-30s%6s\n","Signature",mismatch & DC_WARN_SIGNATURE ? "BAD" : "ok");
+	  	}
+	}
+
+	if (opt->aggregate_width) return aggregate_runs(dexfile, opt, buf);
+
+	if (opt->features) {
+		// numbers only, no pixels at all
+		char *line;
+		size_t len;
+		FILE *mem;
+
+		dc_phase_begin(opt->timing ? &ctx->timing : NULL, NULL, &phase);
+		mem = open_memstream(&line, &len);
+		dc_print_features(mem, dexfile, ctx->file_size, &ctx->runs, &ctx->stats);
+		fclose(mem);
+		fputs(line, opt->out);
+		dc_phase_end(opt->timing ? &ctx->timing : NULL, NULL, &phase, PHASE_RENDER);
+		ctx->timing.items[PHASE_RENDER]++;
+		// the cached line starts after the file name
+		if (cached) cache_put(opt->cache, signature, filesize, ".csv", NULL, line + strlen(dexfile) + 1,
+			strlen(line + strlen(dexfile) + 1));
+		free(line);
+		return 0;
+	}
+
+	if (write_image(outbase, fileinmemory, opt, buf, cached ? signature : NULL) != 0) return 1;
+	return 0;
+}
+
+/* Paint the runs of a .dcr, written by -x, to the image of the dex they
+ * came from: <file.dex>.dcr gives <file.dex>.ppn. */
+int render_dcr(const char *dcrfile, const u1 *data, size_t size, options_t *opt, dex_buffers_t *buf)
+{
+	dc_context_t *ctx = &buf->ctx;
+	char outbase[PATH_MAX];
+	size_t len = strlen(dcrfile);
+	int err;
+
+	if (opt->features || opt->dcr) {
+		fprintf(stderr, "ERROR: %s: a .dcr has no structures to count or runs to extract, only an image\n", dcrfile);
+		return 1;
+	}
+	err = dc_load_dcr(ctx, data, size);
+	if (err != DC_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", dcrfile, dc_strerror(err));
+		return 1;
+	}
+	if (opt->aggregate_width) return aggregate_runs(dcrfile, opt, buf);
+	if (opt->entropy) fprintf(stderr, "Warning: %s: a .dcr keeps no bytes, no entropy image\n", dcrfile);
+	if (len > 4 && strcmp(dcrfile + len - 4, ".dcr") == 0) len -= 4;
+	if (len >= sizeof(outbase)) len = sizeof(outbase) - 1;
+	memcpy(outbase, dcrfile, len);
+	outbase[len] = '\0';
+
+	if (!opt->batch) {
+		if (opt->thumb_width) printf ("PPN file %zu x and %zu y\n", opt->thumb_width, opt->thumb_height);
+		else printf ("PPN file %zu x and %zu y\n", ctx->width, ctx->height);
+	}
+	return write_image(outbase, NULL, opt, buf, NULL);
+}
+
+/* Render every dex of an .apk, classes.dex to <outdir>/<basename>.classes.dex.ppn
+ * and so on. The first failure is returned, the other entries are still
+ * rendered. */
+int render_apk(const char *apkfile, u1 *zip, size_t size, options_t *opt, dex_buffers_t *buf)
+{
+	dex_timing_t *timing = opt->timing ? &buf->ctx.timing : NULL;
+	zip_entry_t *entries;
+	phase_t phase;
+	char name[PATH_MAX], outbase[PATH_MAX];
+	const u1 *dexdata;
+	int count, k, ret, err, status = 0;
+
+	count = dc_zip_find_dex_entries(zip, size, &entries);
+	if (count <= 0) {
+		fprintf(stderr, "ERROR: %s: no classes.dex in the archive\n", apkfile);
+		free(entries);
+		return 1;
+	}
+
+	for (k = 0; k < count; k++) {
+		snprintf(name, sizeof(name), "%s!%s", apkfile, entries[k].name);
+		snprintf(outbase, sizeof(outbase), "%s.%s", apkfile, entries[k].name);
+
+		dc_phase_begin(timing, NULL, &phase);
+		err = dc_zip_entry_data(&buf->ctx, zip, size, &entries[k], &dexdata);
+		dc_phase_end(timing, NULL, &phase, PHASE_LOAD);
+		buf->ctx.timing.bytes[PHASE_LOAD] += entries[k].size;
+		buf->ctx.timing.items[PHASE_LOAD]++;
+
+		if (err != DC_OK) {
+			fprintf(stderr, "ERROR: %s: %s\n", name, dc_strerror(err));
+			ret = 1;
+		} else ret = render_dex_image(name, outbase, dexdata, entries[k].size, opt, buf);
+		if (status == 0) status = ret;
+	}
+	free(entries);
+	return status;
+}
+
+/* Clear what the last file left in buf. */
+static void start_dex_buffers(options_t *opt, dex_buffers_t *buf)
+{
+	memset(&buf->ctx.timing, 0, sizeof(buf->ctx.timing));
+	memset(&buf->ctx.stats, 0, sizeof(buf->ctx.stats));
+	buf->ctx.regions.count = 0;
+	buf->ctx.runs.count = 0;
+	buf->ctx.timed = opt->timing != NULL;
+	buf->ctx.map_walk = opt->map_walk;
+	buf->ctx.opcodes = opt->opcodes;
+	buf->ctx.parse_threads = opt->parse_threads;
+	buf->cache_hits = 0;
+	buf->bad_checksums = buf->bad_signatures = 0;
+}
+
+/* A whole file in memory: an .apk, a .dcr or a dex. */
+static int render_loaded_file(const char *dexfile, u1 *fileinmemory, size_t filesize, options_t *opt,
+	dex_buffers_t *buf)
+{
+	if (dc_is_zip_file(fileinmemory, filesize))
+		return render_apk(dexfile, fileinmemory, filesize, opt, buf);
+	if (dc_is_dcr_file(fileinmemory, filesize))
+		return render_dcr(dexfile, fileinmemory, filesize, opt, buf);
+	return render_dex_image(dexfile, dexfile, fileinmemory, filesize, opt, buf);
+}
+
+/* render_dex_file, on input if it is already open (it gets closed) or
+ * else on dexfile. */
+int render_dex_stream(const char *dexfile, FILE *input, options_t *opt, dex_buffers_t *buf, u8 *bytes)
+{
+    u1 *fileinmemory;
+	int mapped = 0;
+	int ret;
+
+	dex_timing_t *timing = opt->timing ? &buf->ctx.timing : NULL;
+	phase_t phase;
+
+	start_dex_buffers(opt, buf);
+	dc_phase_begin(timing, NULL, &phase);
+	if (input == NULL) input = fopen(dexfile, "rb");
+	if (input == NULL) {
+		fprintf(stderr, "ERROR: Can't open dex file!\n");
+		perror(dexfile);
+		return 1;
+	}
+
+    // Obtain the size of the file
+    int fd = fileno(input);
+    struct stat buffs;
+    fstat(fd,&buffs);
+    int filesize = buffs.st_size;
+    *bytes = filesize;
+
+    // not even an empty zip, let alone a dex header
+    if (filesize < 22) {
+		fprintf (stderr, "ERROR: %s: not a dex file\n", dexfile);
+		fclose(input);
+		return 1;
+    }
+
+	// a cached dex is identified by its header alone, the rest is never
+	// read, unless -v has to read it all anyway
+	if (opt->cache != NULL && !opt->log && !opt->verify && filesize >= DC_HEADER_SIZE) {
+		u1 head[DC_HEADER_SIZE], signature[20];
+		u4 size;
+		if (pread(fd, head, sizeof(head), 0) == sizeof(head) &&
+		    dc_dex_signature(head, sizeof(head), signature, &size) == DC_OK && size == filesize &&
+		    cache_fetch(opt, dexfile, dexfile, signature, size)) {
+			fclose(input);
+			dc_phase_end(timing, NULL, &phase, PHASE_LOAD);
+			buf->ctx.timing.bytes[PHASE_LOAD] = sizeof(head);
+			buf->ctx.timing.items[PHASE_LOAD] = 1;
+			buf->cache_hits = 1;
+			return 0;
+		}
+	}
+
+    if (opt->mmap) {
+        // map the file, the parser reads straight from the page cache
+        fileinmemory = map_dex_file(fd, filesize);
+        if (fileinmemory == NULL) {
+            fprintf(stderr, "ERROR: Can't map .dex file!\n");
+            perror(dexfile);
+            fclose(input);
+            return 1;
+        }
+        mapped = 1;
+    } else {
+    // load all the file in memory, growing the worker's buffer when needed
+    if (buf->input_size < filesize) {
+        free(buf->input);
+        buf->input = malloc(filesize*sizeof(u1));
+        buf->input_size = buf->input ? filesize : 0;
+    }
+    fileinmemory = buf->input;
+    if (fileinmemory == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate memory for .dex file!\n");
+        fclose(input);
+        return 1;
+    }
+	fread(fileinmemory,1,filesize,input); // file in memory contains the binary
+    }
+    fclose(input);
+	dc_phase_end(timing, NULL, &phase, PHASE_LOAD);
+	buf->ctx.timing.bytes[PHASE_LOAD] = filesize;
+	buf->ctx.timing.items[PHASE_LOAD] = 1;
+
+	ret = render_loaded_file(dexfile, fileinmemory, filesize, opt, buf);
+	if (mapped) release_dex_file(fileinmemory, filesize, 1);
+	return ret;
+}
+
+/* render_dex_file on a file the -q pipeline read ahead into slot. The load
+ * phase is the time the read took, overlapped with other files. */
+int render_dex_slot(const char *dexfile, io_slot_t *slot, options_t *opt, dex_buffers_t *buf, u8 *bytes)
+{
+	start_dex_buffers(opt, buf);
+	buf->ctx.timing.seconds[PHASE_LOAD] = slot->seconds;
+	buf->ctx.timing.bytes[PHASE_LOAD] = slot->filled;
+	buf->ctx.timing.items[PHASE_LOAD] = 1;
+	*bytes = slot->size;
+	if (slot->err != 0) {
+		fprintf(stderr, "ERROR: Can't open dex file!\n");
+		fprintf(stderr, "%s: %s\n", dexfile, strerror(slot->err));
+		return 1;
+	}
+	if (slot->size < 22) {
+		fprintf (stderr, "ERROR: %s: not a dex file\n", dexfile);
+		return 1;
+	}
+	return render_loaded_file(dexfile, slot->data, slot->size, opt, buf);
+}
+
+
+/* Render one .dex file to <outdir>/<basename>.ppn, or each dex inside an
+ * .apk. Returns 0 on success, 1 when the file can't be read or is not a
+ * dex and -1 when the header size doesn't match the file. *bytes gets the
+ * size. */
+int render_dex_file(const char *dexfile, options_t *opt, dex_buffers_t *buf, u8 *bytes)
+{
+	return render_dex_stream(dexfile, NULL, opt, buf, bytes);
+}
+
+void print_phases_json(FILE *fp, const dex_timing_t *timing)
+{
+	int p;
+
+	fprintf(fp, "\"phases\":{");
+	for (p = 0; p < PHASE_COUNT; p++)
+		fprintf(fp, "%s\"%s\":{\"ms\":%.3f,\"bytes\":%llu,\"items\":%llu}", p ? "," : "",
+			dc_phase_names[p], timing->seconds[p] * 1e3,
+			(unsigned long long) timing->bytes[p], (unsigned long long) timing->items[p]);
+	fprintf(fp, "}");
+}
+
+void print_counts_json(FILE *fp, const dex_stats_t *stats)
+{
+	fprintf(fp, "\"counts\":{\"strings\":%u,\"classes\":%u,\"methods\":%u,\"code_items\":%u,"
+		"\"methods_with_tries\":%u,\"try_items\":%u,\"debug_infos\":%u,\"truncated\":%u,"
+		"\"dup_code_items\":%u,\"dup_debug_infos\":%u,\"dup_class_data\":%u,\"dup_interfaces\":%u,"
+		"\"dup_annotations\":%u,\"dup_static_values\":%u,\"instructions\":%llu,\"catch_handlers\":%u}",
+		stats->strings, stats->classes, stats->direct_methods + stats->virtual_methods,
+		stats->code_items, stats->methods_with_tries, stats->try_items, stats->debug_infos,
+		stats->truncated, stats->dup_code_items, stats->dup_debug_infos, stats->dup_class_data,
+		stats->dup_interfaces, stats->dup_annotations, stats->dup_static_values,
+		(unsigned long long) stats->instructions, stats->catch_handlers);
+}
+
+static long peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/* One JSON object per line on the -t stream. The line is built in memory
+ * and written at once so batch workers don't interleave. */
+void report_timing(options_t *opt, const char *dexfile, int status, u8 bytes, dex_buffers_t *buf)
+{
+	char *line;
+	size_t len;
+	FILE *mem;
+
+	if (opt->timing == NULL) return;
+	mem = open_memstream(&line, &len);
+	fprintf(mem, "{\"file\":\"");
+	for (; *dexfile; dexfile++) {
+		if (*dexfile == '"' || *dexfile == '\\') fputc('\\', mem);
+		fputc(*dexfile, mem);
+	}
+	fprintf(mem, "\",\"status\":%d,\"size\":%llu,\"regions\":%zu,\"runs\":%zu,",
+		status, (unsigned long long) bytes, buf->ctx.regions.count, buf->ctx.runs.count);
+	if (opt->cache != NULL) fprintf(mem, "\"cache_hits\":%d,", buf->cache_hits);
+	if (opt->verify) fprintf(mem, "\"verify\":{\"dex\":%llu,\"bad_checksum\":%d,\"bad_signature\":%d},",
+		(unsigned long long) buf->ctx.timing.items[PHASE_VERIFY], buf->bad_checksums, buf->bad_signatures);
+	print_phases_json(mem, &buf->ctx.timing);
+	fprintf(mem, ",");
+	print_counts_json(mem, &buf->ctx.stats);
+	fprintf(mem, ",\"peak_rss_kb\":%ld}\n", peak_rss_kb());
+	fclose(mem);
+	fputs(line, opt->timing);
+	free(line);
+}
+
+
+/* -- diff mode --
+ * -D old.dex new.dex: both files are loaded and parsed at once, the old
+ * one on a thread of its own, and their items matched by dc_diff. With -c
+ * the hashed items of each side are kept under its signature, so a
+ * version seen before, such as the old side of the next update, is
+ * matched without being read past its header. */
+
+typedef struct {
+	const char *path;
+	options_t *opt;
+	dex_buffers_t buf;
+	dc_item_list_t items;
+	u8 bytes;
+	int status;
+} diff_side_t;
+
+/* A .items entry is ITEMS_MAGIC and then the hash, offset, len and type
+ * of every item, packed field by field in host byte order: the padding of
+ * dc_item_t never reaches the disk, and an entry in any other layout is
+ * not taken. */
+#define ITEMS_MAGIC "DCI1"
+#define ITEM_RECORD (sizeof(u8) + 2 * sizeof(u4) + sizeof(u1))
+
+static char *pack_items(const dc_item_list_t *items, size_t *size)
+{
+	const dc_item_t *item;
+	char *data, *p;
+	size_t i;
+
+	*size = 4 + items->count * ITEM_RECORD;
+	data = malloc(*size);
+	if (data == NULL) return NULL;
+	memcpy(data, ITEMS_MAGIC, 4);
+	for (p = data + 4, i = 0; i < items->count; i++) {
+		item = items->items + i;
+		memcpy(p, &item->hash, sizeof(u8));
+		memcpy(p + 8, &item->offset, sizeof(u4));
+		memcpy(p + 12, &item->len, sizeof(u4));
+		p[16] = item->type;
+		p += ITEM_RECORD;
+	}
+	return data;
+}
+
+static int fetch_items(result_cache_t *cache, const u1 *signature, u4 file_size, dc_item_list_t *items)
+{
+	char entry[PATH_MAX];
+	char *data, *p;
+	dc_item_t *list;
+	long size;
+	size_t i, count;
+
+	cache_path(cache, signature, file_size, ".items", entry, sizeof(entry));
+	data = read_small_file(entry, &size);
+	if (data == NULL) return 0;
+	count = size >= 4 ? (size - 4) / ITEM_RECORD : 0;
+	list = size >= 4 && memcmp(data, ITEMS_MAGIC, 4) == 0 && (size - 4) % ITEM_RECORD == 0 ?
+		malloc((count ? count : 1) * sizeof(dc_item_t)) : NULL;
+	for (p = data + 4, i = 0; list != NULL && i < count; i++, p += ITEM_RECORD) {
+		memcpy(&list[i].hash, p, sizeof(u8));
+		memcpy(&list[i].offset, p + 8, sizeof(u4));
+		memcpy(&list[i].len, p + 12, sizeof(u4));
+		list[i].type = p[16];
+		// a damaged entry is parsed again, not trusted
+		if (list[i].type >= REGION_COUNT || (u8) list[i].offset + list[i].len > file_size) {
+			free(list);
+			list = NULL;
+		}
+	}
+	free(data);
+	if (list == NULL) return 0;
+	free(items->items);
+	items->items = list;
+	items->count = items->size = count;
+	items->file_size = file_size;
+	utimensat(AT_FDCWD, entry, NULL, 0);
+	pthread_mutex_lock(&cache->lock);
+	cache->hits++;
+	pthread_mutex_unlock(&cache->lock);
+	return 1;
+}
+
+static void *load_diff_side(void *arg)
+{
+	diff_side_t *side = arg;
+	options_t *opt = side->opt;
+	dc_context_t *ctx = &side->buf.ctx;
+	dex_timing_t *timing = opt->timing ? &ctx->timing : NULL;
+	phase_t phase;
+	u1 head[DC_HEADER_SIZE], signature[20], *dex;
+	struct stat st;
+	FILE *input;
+	int fd, cached, err;
+	u4 size;
+
+	side->status = 1;
+	ctx->timed = timing != NULL;
+	ctx->map_walk = opt->map_walk;
+	ctx->parse_threads = opt->parse_threads;
+	dc_phase_begin(timing, NULL, &phase);
+	input = fopen(side->path, "rb");
+	if (input == NULL || fstat(fd = fileno(input), &st) != 0) {
+		perror(side->path);
+		if (input != NULL) fclose(input);
+		return NULL;
+	}
+	side->bytes = st.st_size;
+
+	cached = opt->cache != NULL && pread(fd, head, sizeof(head), 0) == sizeof(head) &&
+		dc_dex_signature(head, sizeof(head), signature, &size) == DC_OK && size == st.st_size;
+	if (cached && fetch_items(opt->cache, signature, size, &side->items)) {
+		fclose(input);
+		dc_phase_end(timing, NULL, &phase, PHASE_LOAD);
+		ctx->timing.bytes[PHASE_LOAD] = sizeof(head);
+		ctx->timing.items[PHASE_LOAD] = 1;
+		side->buf.cache_hits = 1;
+		side->status = 0;
+		return NULL;
+	}
+
+	if (opt->mmap) dex = map_dex_file(fd, st.st_size);
+	else {
+		dex = side->buf.input = malloc(st.st_size);
+		if (dex != NULL && fread(dex, 1, st.st_size, input) != st.st_size) dex = NULL;
+	}
+	fclose(input);
+	if (dex == NULL) {
+		fprintf(stderr, "ERROR: %s: can't read the file\n", side->path);
+		return NULL;
+	}
+	dc_phase_end(timing, NULL, &phase, PHASE_LOAD);
+	ctx->timing.bytes[PHASE_LOAD] = st.st_size;
+	ctx->timing.items[PHASE_LOAD] = 1;
+
+	if (dc_is_zip_file(dex, st.st_size)) err = DC_ERR_NOT_DEX;
+	else err = dc_parse(ctx, dex, st.st_size);
+	if (err == DC_OK) err = dc_hash_items(ctx, dex, &side->items);
+	if (opt->mmap) release_dex_file(dex, st.st_size, 1);
+	if (err != DC_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", side->path, dc_strerror(err));
+		return NULL;
+	}
+	print_warnings(ctx->warnings);
+	if (cached) {
+		char *packed;
+		size_t packed_size;
+		cache_miss(opt->cache);
+		packed = pack_items(&side->items, &packed_size);
+		if (packed != NULL) cache_put(opt->cache, signature, size, ".items", NULL, packed, packed_size);
+		free(packed);
+	}
+	side->status = 0;
+	return NULL;
+}
+
+/* Write <new>.diff.ppn (or .png) and print the delta of every region.
+ * Returns 0 on success. */
+int run_diff(const char *oldfile, const char *newfile, options_t *opt)
+{
+	diff_side_t side[2];
+	pthread_t thread;
+	dc_diff_t diff;
+	bitmap_t image;
+	char outputname[PATH_MAX];
+	int threaded, k, err, ret = 1;
+
+	memset(side, 0, sizeof(side));
+	memset(&diff, 0, sizeof(diff));
+	side[0].path = oldfile;
+	side[1].path = newfile;
+	side[0].opt = side[1].opt = opt;
+
+	threaded = pthread_create(&thread, NULL, load_diff_side, &side[0]) == 0;
+	if (!threaded) load_diff_side(&side[0]);
+	load_diff_side(&side[1]);
+	if (threaded) pthread_join(thread, NULL);
+	for (k = 0; k < 2; k++)
+		report_timing(opt, side[k].path, side[k].status, side[k].bytes, &side[k].buf);
+	if (side[0].status != 0 || side[1].status != 0) goto done;
+
+	if (output_name(outputname, sizeof(outputname), newfile, opt->outdir, opt->png ? ".diff.png" : ".diff.ppn")) {
+		fprintf(stderr, "ERROR: %s: output name too long\n", newfile);
+		goto done;
+	}
+	err = dc_diff(&side[0].items, &side[1].items, &diff);
+	if (err == DC_OK) {
+		image.width = diff.width;
+		image.height = diff.height;
+		image.pixels = reserve_pixels(&side[1].buf, image.width * image.height);
+		err = dc_render_diff(&diff, &image);
+	}
+	if (err == DC_OK) {
+		if (opt->png) err = dc_save_png_to_file(&image, NULL, outputname);
+		else err = dc_save_ppm_to_file(&image, outputname);
+	}
+	if (err != DC_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", outputname, dc_strerror(err));
+		goto done;
+	}
+	dc_print_diff(opt->out, &diff);
+	ret = 0;
+done:
+	for (k = 0; k < 2; k++) {
+		free(side[k].items.items);
+		free_dex_buffers(&side[k].buf);
+	}
+	dc_diff_free(&diff);
+	return ret;
+}
+
+
+/* -- batch mode -- */
+
+typedef struct {
+	char **paths;
+	size_t count;
+	size_t size;
+} path_list_t;
+
+void add_path(path_list_t *list, const char *path)
+{
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 1024;
+		list->paths = realloc(list->paths, list->size * sizeof(char *));
+	}
+	list->paths[list->count++] = strdup(path);
+}
+
+/* What an earlier run left next to its inputs: images, region lists,
+ * pyramids and aggregate counts. A .dcr stays, it is an input too. */
+static int is_output_name(const char *name)
+{
+	static const char *exts[] = { ".ppn", ".png", ".csv", ".dzi", "_files" };
+	size_t len = strlen(name), n, k;
+
+	for (k = 0; k < sizeof(exts) / sizeof(exts[0]); k++) {
+		n = strlen(exts[k]);
+		if (len > n && strcmp(name + len - n, exts[k]) == 0) return 1;
+	}
+	return 0;
+}
+
+int add_paths_from_dir(path_list_t *list, const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *entry;
+	struct stat st;
+	char path[PATH_MAX];
+
+	if (d == NULL) {
+		perror(dir);
+		return 1;
+	}
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] == '.' || is_output_name(entry->d_name)) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (stat(path, &st) != 0) continue;
+		if (S_ISDIR(st.st_mode)) add_paths_from_dir(list, path);
+		else if (S_ISREG(st.st_mode)) add_path(list, path);
+	}
+	closedir(d);
+	return 0;
+}
+
+int add_paths_from_file(path_list_t *list, const char *listfile)
+{
+	FILE *fp = strcmp(listfile, "-") == 0 ? stdin : fopen(listfile, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+
+	if (fp == NULL) {
+		perror(listfile);
+		return 1;
+	}
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+		if (len > 0) add_path(list, line);
+	}
+	free(line);
+	if (fp != stdin) fclose(fp);
+	return 0;
+}
+
+/* The path list is split in one contiguous range per worker. A worker
+ * claims files from its own range and, once that is empty, steals from the
+ * range with the most work left. Owner and thieves claim with the same
+ * atomic increment, so no file is rendered twice. */
+typedef struct {
+	_Atomic size_t next;
+	size_t end;
+} work_range_t;
+
+typedef struct {
+	path_list_t *list;
+	options_t *opt;
+	work_range_t *ranges;
+	int nworkers;
+	int id;
+	u8 files;
+	u8 failed;
+	u8 bytes;
+	u8 bad_checksums;     // -v
+	u8 bad_signatures;
+	dex_timing_t timing;
+	dex_stats_t stats;
+	dc_aggregate_t aggregate;  // -A, handed over from the buffers
+} batch_worker_t;
+
+static int claim_work(work_range_t *range, size_t *index)
+{
+	size_t i;
+
+	if (atomic_load(&range->next) >= range->end) return 0;
+	i = atomic_fetch_add(&range->next, 1);
+	if (i >= range->end) return 0;
+	*index = i;
+	return 1;
+}
+
+/* The next file for w, from its own range or stolen. Returns 0 when
+ * there is none left. */
+static int next_work(batch_worker_t *w, size_t *index)
+{
+	int victim, k;
+
+	while (!claim_work(&w->ranges[w->id], index)) {
+		// own range is empty, steal from the fullest one
+		size_t most = 0;
+		victim = -1;
+		for (k = 0; k < w->nworkers; k++) {
+			size_t next = atomic_load(&w->ranges[k].next);
+			if (next < w->ranges[k].end && w->ranges[k].end - next > most) {
+				most = w->ranges[k].end - next;
+				victim = k;
+			}
+		}
+		if (victim < 0) return 0;
+		if (claim_work(&w->ranges[victim], index)) return 1;
+	}
+	return 1;
+}
+
+void *batch_worker(void *arg)
+{
+	batch_worker_t *w = arg;
+	io_pipeline_t *pipeline = w->opt->pipeline;
+	io_slot_t *slot;
+	dex_buffers_t buf;
+	size_t index;
+	u8 bytes;
+	int ret;
+
+	memset(&buf, 0, sizeof(buf));
+	for (;;) {
+		bytes = 0;
+		if (pipeline != NULL) {
+			// -q, files come in read order, not from the ranges
+			if ((slot = pipeline_next(pipeline)) == NULL) break;
+			index = slot->index;
+			ret = render_dex_slot(w->list->paths[index], slot, w->opt, &buf, &bytes);
+			pipeline_release(pipeline, slot);
+		} else {
+			if (!next_work(w, &index)) break;
+			ret = render_dex_file(w->list->paths[index], w->opt, &buf, &bytes);
+		}
+		report_timing(w->opt, w->list->paths[index], ret, bytes, &buf);
+		if (ret != 0) w->failed++;
+		w->files++;
+		w->bytes += bytes;
+		w->bad_checksums += buf.bad_checksums;
+		w->bad_signatures += buf.bad_signatures;
+		dc_add_timing(&w->timing, &buf.ctx.timing);
+		dc_add_stats(&w->stats, &buf.ctx.stats);
+	}
+	// the buffers go, the grid stays for run_batch to add up
+	w->aggregate = buf.aggregate;
+	memset(&buf.aggregate, 0, sizeof(buf.aggregate));
+	free_dex_buffers(&buf);
+	return NULL;
+}
+
+int run_batch(path_list_t *list, options_t *opt, int nworkers, int depth)
+{
+	pthread_t *threads;
+	batch_worker_t *workers;
+	work_range_t *ranges;
+	struct timespec start, end;
+	u8 files = 0, failed = 0, bytes = 0, bad_checksums = 0, bad_signatures = 0, write_failed = 0;
+	dex_timing_t timing;
+	dex_stats_t stats;
+	dc_aggregate_t aggregate;
+	double seconds;
+	int k;
+
+	memset(&timing, 0, sizeof(timing));
+	memset(&stats, 0, sizeof(stats));
+	memset(&aggregate, 0, sizeof(aggregate));
+
+	if (nworkers < 1) nworkers = 1;
+	if (nworkers > list->count && list->count > 0) nworkers = list->count;
+
+	threads = calloc(nworkers, sizeof(pthread_t));
+	workers = calloc(nworkers, sizeof(batch_worker_t));
+	ranges = calloc(nworkers, sizeof(work_range_t));
+
+	for (k = 0; k < nworkers; k++) {
+		atomic_init(&ranges[k].next, list->count * k / nworkers);
+		ranges[k].end = list->count * (k + 1) / nworkers;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (depth > 0) {
+		opt->pipeline = open_pipeline(list->paths, list->count, depth);
+		if (opt->pipeline == NULL) fprintf(stderr, "Warning: no memory for -q, reading in the workers\n");
+	}
+	for (k = 0; k < nworkers; k++) {
+		workers[k].list = list;
+		workers[k].opt = opt;
+		workers[k].ranges = ranges;
+		workers[k].nworkers = nworkers;
+		workers[k].id = k;
+		pthread_create(&threads[k], NULL, batch_worker, &workers[k]);
+	}
+	for (k = 0; k < nworkers; k++) {
+		pthread_join(threads[k], NULL);
+		files += workers[k].files;
+		failed += workers[k].failed;
+		bytes += workers[k].bytes;
+		bad_checksums += workers[k].bad_checksums;
+		bad_signatures += workers[k].bad_signatures;
+		dc_add_timing(&timing, &workers[k].timing);
+		dc_add_stats(&stats, &workers[k].stats);
+		// -A, the first grid takes the others in
+		if (workers[k].aggregate.counts == NULL) continue;
+		if (aggregate.counts == NULL) aggregate = workers[k].aggregate;
+		else {
+			dc_aggregate_merge(&aggregate, &workers[k].aggregate);
+			dc_aggregate_free(&workers[k].aggregate);
+		}
+	}
+	if (opt->pipeline != NULL) finish_pipeline(opt->pipeline);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (seconds <= 0) seconds = 1e-9;
+	fprintf(stderr, "Batch: %llu files (%llu failed), %.1f MB in %.3f s with %d thread%s: %.1f files/s, %.1f MB/s\n",
+		(unsigned long long) files, (unsigned long long) failed, bytes / 1e6, seconds, nworkers,
+		nworkers == 1 ? "" : "s",
+		files / seconds, bytes / 1e6 / seconds);
+	if (opt->verify)
+		fprintf(stderr, "Verify: %llu dex, %llu bad checksums, %llu bad signatures\n",
+			(unsigned long long) timing.items[PHASE_VERIFY], (unsigned long long) bad_checksums,
+			(unsigned long long) bad_signatures);
+	if (opt->pipeline != NULL) report_pipeline(opt->pipeline, stderr, 0);
+	if (aggregate.counts != NULL) {
+		write_failed += write_aggregate(&aggregate, opt);
+		dc_aggregate_free(&aggregate);
+	}
+	if (opt->timing != NULL) {
+		// phase times are summed over all workers, so they can exceed wall_s
+		fprintf(opt->timing, "{\"batch\":true,\"files\":%llu,\"failed\":%llu,\"bytes\":%llu,\"threads\":%d,\"wall_s\":%.3f,",
+			(unsigned long long) files, (unsigned long long) failed, (unsigned long long) bytes,
+			nworkers, seconds);
+		if (opt->verify) fprintf(opt->timing, "\"verify\":{\"dex\":%llu,\"bad_checksum\":%llu,\"bad_signature\":%llu},",
+			(unsigned long long) timing.items[PHASE_VERIFY], (unsigned long long) bad_checksums,
+			(unsigned long long) bad_signatures);
+		if (opt->pipeline != NULL) report_pipeline(opt->pipeline, opt->timing, 1);
+		print_phases_json(opt->timing, &timing);
+		fprintf(opt->timing, ",");
+		print_counts_json(opt->timing, &stats);
+		fprintf(opt->timing, ",\"peak_rss_kb\":%ld}\n", peak_rss_kb());
+	}
+
+	if (opt->pipeline != NULL) {
+		write_failed += opt->pipeline->write_failed;
+		free_pipeline(opt->pipeline);
+		opt->pipeline = NULL;
+	}
+	free(threads);
+	free(workers);
+	free(ranges);
+	return failed || write_failed ? 1 : 0;
+}
+
+
+/* -- server mode --
+ * droidcolors -S <socket> listens on a unix socket, -S - reads stdin and
+ * answers on stdout. Each request is one line: options for this request
+ * only, then the file to render:
+ *
+ *     -p -o /out /data/sample.apk
+ *     -F /data/classes.dex
+ *     -F @classes.dex        the descriptor sent along (SCM_RIGHTS), named
+ *
+ * Each gets one line back: "ok" and the images written, tab separated, or
+ * "ok" and the -F line, or "error" and why. "header" answers the -F CSV
+ * header and "stats" the request count and latency percentiles. Workers
+ * keep their buffers from request to request, so a warm server pays
+ * neither process startup nor first-touch page faults per sample. */
+
+#define MAX_REQUEST 8192
+#define MAX_PASSED_FDS 16
+
+/* Latency of the requests served, as a histogram of microseconds: exact
+ * below 32, then 16 buckets per power of two, within 1/16 of the value.
+ * It stays this size however long the server runs. */
+#define LATENCY_SUB 16
+#define LATENCY_BUCKETS (37 * LATENCY_SUB)   // up to 2^40 us, 12 days
+
+typedef struct {
+	u8 buckets[LATENCY_BUCKETS];
+	u8 count;
+	u8 failed;
+	double max;                // ms, exact
+	pthread_mutex_t lock;
+} latency_log_t;
+
+/* One client: a socket, or stdin and stdout. */
+typedef struct {
+	int in;
+	int out;
+	char data[MAX_REQUEST];
+	size_t len;
+	size_t line_len;          // of the request being served, with its newline
+	int fds[MAX_PASSED_FDS];  // received with SCM_RIGHTS, not yet used
+	int nfds;
+} connection_t;
+
+typedef struct {
+	options_t *opt;           // the server's, each request starts from them
+	latency_log_t *latency;
+	int listen_fd;
+	dex_buffers_t buf;
+} server_worker_t;
+
+static size_t latency_bucket(double ms)
+{
+	u8 us = ms > 0 ? (u8) (ms * 1e3) : 0;
+	size_t e, bucket;
+
+	if (us < 2 * LATENCY_SUB) return us;
+	// the top five bits of us, after the power of two
+	e = 63 - __builtin_clzll(us) - 4;
+	bucket = e * LATENCY_SUB + (us >> e);
+	return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/* The middle of a bucket, in ms. */
+static double latency_value(size_t bucket)
+{
+	size_t e;
+
+	if (bucket < 2 * LATENCY_SUB) return bucket / 1e3;
+	e = bucket / LATENCY_SUB - 1;
+	return ((double) ((LATENCY_SUB + bucket % LATENCY_SUB) << e) + ((1ULL << e) - 1) / 2.0) / 1e3;
+}
+
+static void log_latency(latency_log_t *log, double ms, int failed)
+{
+	pthread_mutex_lock(&log->lock);
+	log->buckets[latency_bucket(ms)]++;
+	log->count++;
+	if (ms > log->max) log->max = ms;
+	if (failed) log->failed++;
+	pthread_mutex_unlock(&log->lock);
+}
+
+/* "requests=N failed=N p50=... p90=... p99=... max=..." into out. The
+ * percentiles are nearest rank, to the middle of their bucket. */
+static void latency_summary(latency_log_t *log, char *out, size_t size)
+{
+	static const int percent[3] = { 50, 90, 99 };
+	double p[3] = { 0, 0, 0 }, max;
+	u8 n, failed, seen = 0;
+	size_t bucket = 0;
+	int k;
+
+	pthread_mutex_lock(&log->lock);
+	n = log->count;
+	failed = log->failed;
+	max = log->max;
+	for (k = 0; k < 3 && n > 0; k++) {
+		while (seen + log->buckets[bucket] < (n * percent[k] + 99) / 100) seen += log->buckets[bucket++];
+		p[k] = latency_value(bucket);
+		if (p[k] > max) p[k] = max;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	snprintf(out, size, "requests=%llu failed=%llu p50_ms=%.3f p90_ms=%.3f p99_ms=%.3f max_ms=%.3f",
+		(unsigned long long) n, (unsigned long long) failed, p[0], p[1], p[2], max);
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Next request line, without its newline, or NULL at the end. Descriptors
+ * that come along are queued for the @ requests. */
+static char *read_request(connection_t *conn)
+{
+	char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *newline;
+	ssize_t n;
+	int k, count;
+
+	for (;;) {
+		newline = memchr(conn->data, '\n', conn->len);
+		if (newline != NULL) {
+			*newline = '\0';
+			conn->line_len = newline - conn->data + 1;
+			return conn->data;
+		}
+		if (conn->len == sizeof(conn->data)) return NULL;  // no line fits
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = conn->data + conn->len;
+		iov.iov_len = sizeof(conn->data) - conn->len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		n = recvmsg(conn->in, &msg, 0);
+		if (n < 0 && errno == ENOTSOCK) n = read(conn->in, iov.iov_base, iov.iov_len);
+		else if (n > 0) {
+			for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+				count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				for (k = 0; k < count; k++) {
+					int fd;
+					memcpy(&fd, CMSG_DATA(cmsg) + k * sizeof(int), sizeof(int));
+					if (conn->nfds < MAX_PASSED_FDS) conn->fds[conn->nfds++] = fd;
+					else close(fd);
+				}
+			}
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return NULL;
+		conn->len += n;
+	}
+}
+
+/* Drop the line read_request returned. */
+static void consume_request(connection_t *conn)
+{
+	memmove(conn->data, conn->data + conn->line_len, conn->len - conn->line_len);
+	conn->len -= conn->line_len;
+}
+
+/* The options of a request line over the server's. Returns the file part,
+ * or NULL if an option is not understood. */
+static char *parse_request(char *line, options_t *opt)
+{
+	char *word, *arg;
+
+	for (;;) {
+		while (*line == ' ') line++;
+		if (line[0] != '-' || line[1] == '\0' || line[2] != ' ') return line;
+		word = line;
+		line += 3;
+		while (*line == ' ') line++;
+		switch (word[1]) {
+		case 'p': opt->png = 1; continue;
+		case 'x': opt->dcr = 1; continue;
+		case 'z': opt->zoom = 1; continue;
+		case 'i': opt->regions = 1; continue;
+		case 'F': opt->features = 1; continue;
+		case 'M': opt->map_walk = 1; continue;
+		case 'O': opt->opcodes = 1; continue;
+		case 'v': opt->verify = 1; continue;
+		case 'e': opt->entropy = 1; continue;
+		}
+		// the rest take an argument
+		arg = line;
+		line = strchr(line, ' ');
+		if (line == NULL) return NULL;
+		*line++ = '\0';
+		switch (word[1]) {
+		case 'r':
+			if (sscanf(arg, "%zux%zu", &opt->thumb_width, &opt->thumb_height) != 2 ||
+			    opt->thumb_width == 0 || opt->thumb_height == 0) return NULL;
+			break;
+		case 'o': opt->outdir = arg; break;
+		case 'P': opt->parse_threads = atoi(arg); break;
+		default: return NULL;
+		}
+	}
+}
+
+/* Answer one request line. Returns 0 to go on reading, 1 if the client
+ * can't be written to any more. */
+static int serve_request(server_worker_t *w, connection_t *conn, char *line)
+{
+	options_t req = *w->opt;
+	struct timespec start, end;
+	char *file, *results = NULL, *reply, *p;
+	size_t results_len = 0;
+	FILE *input = NULL;
+	u8 bytes = 0;
+	int ret, rendered = 0, failed = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (strcmp(line, "stats") == 0) {
+		char summary[256];
+		latency_summary(w->latency, summary, sizeof(summary));
+		asprintf(&reply, "ok %s\n", summary);
+	} else if (strcmp(line, "header") == 0) {
+		FILE *mem = open_memstream(&results, &results_len);
+		dc_print_features_header(mem);
+		fclose(mem);
+		asprintf(&reply, "ok %s", results);
+	} else if ((file = parse_request(line, &req)) == NULL || *file == '\0') {
+		asprintf(&reply, "error bad request\n");
+	} else if (*file == '@' && conn->nfds == 0) {
+		asprintf(&reply, "error %s: no descriptor passed\n", file);
+	} else if (*file == '@' && (input = fdopen(conn->fds[0], "rb")) == NULL) {
+		close(conn->fds[0]);
+		memmove(conn->fds, conn->fds + 1, --conn->nfds * sizeof(int));
+		asprintf(&reply, "error %s: %s\n", file, strerror(errno));
+	} else {
+		if (*file == '@') {
+			// a descriptor in place of a path, the name is for the output
+			memmove(conn->fds, conn->fds + 1, --conn->nfds * sizeof(int));
+			file++;
+		}
+		// a request's own options would be cached under the server's key
+		if (req.features != w->opt->features || req.png != w->opt->png || req.dcr != w->opt->dcr ||
+		    req.zoom != w->opt->zoom || req.regions != w->opt->regions || req.map_walk != w->opt->map_walk ||
+		    req.entropy != w->opt->entropy || req.opcodes != w->opt->opcodes ||
+		    req.thumb_width != w->opt->thumb_width || req.thumb_height != w->opt->thumb_height)
+			req.cache = NULL;
+		req.batch = 1;
+		req.out = req.written = open_memstream(&results, &results_len);
+		ret = render_dex_stream(file, input, &req, &w->buf, &bytes);
+		fclose(req.out);
+		report_timing(&req, file, ret, bytes, &w->buf);
+		rendered = 1;
+		failed = ret != 0;
+		if (failed) {
+			asprintf(&reply, "error %s: %s\n", file, ret < 0 ? "size in the header does not match" :
+				"can't render, see the server log");
+		} else {
+			// one line back: results separated by tabs
+			for (p = results; *p; p++) if (*p == '\n') *p = '\t';
+			if (results_len > 0) results[results_len - 1] = '\0';
+			asprintf(&reply, "ok %s\n", results);
+		}
+	}
+	free(results);
+
+	ret = write_all(conn->out, reply, strlen(reply));
+	free(reply);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (rendered)
+		log_latency(w->latency, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, failed);
+	return ret != 0;
+}
+
+static void serve_connection(server_worker_t *w, connection_t *conn)
+{
+	char *line;
+
+	while ((line = read_request(conn)) != NULL) {
+		if (*line != '\0' && serve_request(w, conn, line) != 0) break;
+		consume_request(conn);
+	}
+	while (conn->nfds > 0) close(conn->fds[--conn->nfds]);
+}
+
+static void *server_worker(void *arg)
+{
+	server_worker_t *w = arg;
+	connection_t *conn = malloc(sizeof(*conn));
+	int fd;
+
+	if (conn == NULL) return NULL;
+	for (;;) {
+		fd = accept(w->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("accept");
+			break;
+		}
+		memset(conn, 0, sizeof(*conn));
+		conn->in = conn->out = fd;
+		serve_connection(w, conn);
+		close(fd);
+	}
+	free(conn);
+	return NULL;
+}
+
+/* Serve requests until stdin ends, or on the socket for good. */
+int run_server(const char *socket_path, options_t *opt, int nworkers)
+{
+	latency_log_t latency;
+	server_worker_t *workers;
+	pthread_t *threads;
+	struct sockaddr_un addr;
+	struct stat st;
+	char summary[256];
+	int listen_fd, k;
+
+	memset(&latency, 0, sizeof(latency));
+	pthread_mutex_init(&latency.lock, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (strcmp(socket_path, "-") == 0) {
+		server_worker_t w;
+		connection_t *conn = calloc(1, sizeof(*conn));
+
+		if (conn == NULL) return 1;
+		memset(&w, 0, sizeof(w));
+		w.opt = opt;
+		w.latency = &latency;
+		conn->in = STDIN_FILENO;
+		conn->out = STDOUT_FILENO;
+		serve_connection(&w, conn);
+		free(conn);
+		free_dex_buffers(&w.buf);
+		latency_summary(&latency, summary, sizeof(summary));
+		fprintf(stderr, "Server: %s\n", summary);
+		return 0;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "ERROR: %s: socket path too long\n", socket_path);
+		return 1;
+	}
+	strcpy(addr.sun_path, socket_path);
+	// a socket left behind by an earlier server, never a regular file
+	if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	    listen(listen_fd, 64) != 0) {
+		perror(socket_path);
+		return 1;
+	}
+
+	if (nworkers < 1) nworkers = 1;
+	workers = calloc(nworkers, sizeof(*workers));
+	threads = calloc(nworkers, sizeof(*threads));
+	for (k = 0; k < nworkers; k++) {
+		workers[k].opt = opt;
+		workers[k].latency = &latency;
+		workers[k].listen_fd = listen_fd;
+		pthread_create(&threads[k], NULL, server_worker, &workers[k]);
+	}
+	fprintf(stderr, "Server: listening on %s with %d thread%s\n", socket_path, nworkers,
+		nworkers == 1 ? "" : "s");
+	for (k = 0; k < nworkers; k++) pthread_join(threads[k], NULL);
+	close(listen_fd);
+	unlink(socket_path);
+	for (k = 0; k < nworkers; k++) free_dex_buffers(&workers[k].buf);
+	free(workers);
+	free(threads);
+	return 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+	options_t opt;
+	dex_buffers_t buf;
+	path_list_t list;
+	const char *batchdir = NULL;
+	const char *batchlist = NULL;
+	const char *cachedir = NULL;
+	const char *server = NULL;
+	u8 cachelimit = 1024;   // MB
+	result_cache_t cache;
+	int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	int depth = 0;          // -q
+	int c;
+	int ret;
+	u8 bytes;
+	size_t k;
+
+	memset(&opt, 0, sizeof(opt));
+	memset(&list, 0, sizeof(list));
+	opt.out = stdout;
+
+	if (argc < 2) {
+		help_show_message(argv[0]);
+		return 1;
+	}
+
+    while ((c = getopt(argc, argv, "slmveipxzFMOr:A:t:P:c:C:d:f:j:q:o:S:D:")) != -1) {
+                switch(c) {
+            case 's':
+                opt.silence =1 ;
+                break;
+            case 'l':
+            	opt.log=1;
+            	break;
+            case 'm':
+            	opt.mmap=1;
+            	break;
+            case 'v':
+            	opt.verify=1;
+            	break;
+            case 'e':
+            	opt.entropy=1;
+            	break;
+            case 'i':
+            	opt.regions=1;
+            	break;
+            case 'p':
+            	opt.png=1;
+            	break;
+            case 'x':
+            	opt.dcr=1;
+            	break;
+            case 'z':
+            	opt.zoom=1;
+            	break;
+            case 'F':
+            	opt.features=1;
+            	break;
+            case 'M':
+            	opt.map_walk=1;
+            	break;
+            case 'O':
+            	opt.opcodes=1;
+            	break;
+            case 'P':
+            	opt.parse_threads=atoi(optarg);
+            	break;
+            case 'r':
+            	if (sscanf(optarg, "%zux%zu", &opt.thumb_width, &opt.thumb_height) != 2 ||
+            	    opt.thumb_width == 0 || opt.thumb_height == 0) {
+                     help_show_message(argv[0]);
+                     return 1;
+            	}
+            	break;
+            case 'A':
+            	if (sscanf(optarg, "%zux%zu", &opt.aggregate_width, &opt.aggregate_height) != 2 ||
+            	    opt.aggregate_width == 0 || opt.aggregate_height == 0 ||
+            	    opt.aggregate_width > DC_AGGREGATE_MAX || opt.aggregate_height > DC_AGGREGATE_MAX) {
+                     help_show_message(argv[0]);
+                     return 1;
+            	}
+            	break;
+            case 't':
+            	opt.timing = strcmp(optarg, "-") == 0 ? stderr : fopen(optarg, "a");
+            	if (opt.timing == NULL) {
+            		perror(optarg);
+            		return 1;
+            	}
+            	break;
+            case 'd':
+            	batchdir=optarg;
+            	break;
+            case 'f':
+            	batchlist=optarg;
+            	break;
+            case 'j':
+            	nworkers=atoi(optarg);
+            	break;
+            case 'q':
+            	depth=atoi(optarg);
+            	break;
+            case 'o':
+            	opt.outdir=optarg;
+            	break;
+            case 'c':
+            	cachedir=optarg;
+            	break;
+            case 'C':
+            	cachelimit=strtoull(optarg, NULL, 10);
+            	break;
+            case 'S':
+            	server=optarg;
+            	break;
+            case 'D':
+            	opt.diff=optarg;
+            	break;
+
+            default:
+                     help_show_message(argv[0]);
+                     return 1;
+                }
+    }
+   
+ if (opt.silence>0)
+    {  
+    printf( "\n=== %s %s - (c) 2015 \n", argv[0],DC_VERSION);
+    printf( "Paper: Enriching Reverse Engineering through Visual Exploration of Android Binaries\n");
+    printf( "5th Program protection and Reverse Engineering Workshop (PPREW-5)\n");
+    printf( "http://dx.doi.org/10.1145/2843859.2843866\n===\n");
+    printf( "Usage: %s  <file.dex> [slmveipxzFMO] [-r WxH] [-A WxH] [-t json] [-P threads] [-c cachedir [-C MB]]\n",argv[0]);
+    printf( "\t-s\tsilence, no headers\n");
+    printf( "\t-l\tlog, create log file from the image\n");
+   }
+
+	if (opt.features && server == NULL) dc_print_features_header(stdout);
+
+	// a pyramid is a directory of files, not kept, and -A needs the runs
+	if (cachedir != NULL && !opt.zoom && !opt.aggregate_width) {
+		if (open_cache(&cache, cachedir, cachelimit << 20, &opt) != 0) return 1;
+		opt.cache = &cache;
+	}
+
+	if (opt.diff != NULL || server != NULL) {
+		// a grid belongs to a batch or a file, not to a diff or requests
+		opt.aggregate_width = opt.aggregate_height = 0;
+	}
+
+	if (opt.diff != NULL) {
+		if (optind >= argc) {
+			help_show_message(argv[0]);
+			return 1;
+		}
+		ret = run_diff(opt.diff, argv[optind], &opt);
+		if (opt.cache != NULL) report_cache(opt.cache);
+		return ret;
+	}
+
+	if (server != NULL) {
+		// -l prints to stdout, where the replies go
+		opt.log = 0;
+		ret = run_server(server, &opt, nworkers);
+		if (opt.cache != NULL) report_cache(opt.cache);
+		return ret;
+	}
+
+	if (batchdir != NULL || batchlist != NULL) {
+		opt.batch = 1;
+		if (batchdir != NULL && add_paths_from_dir(&list, batchdir) != 0) return 1;
+		if (batchlist != NULL && add_paths_from_file(&list, batchlist) != 0) return 1;
+		for (; optind < argc; optind++) add_path(&list, argv[optind]);
+		ret = run_batch(&list, &opt, nworkers, depth);
+		if (opt.cache != NULL) report_cache(opt.cache);
+		for (k = 0; k < list.count; k++) free(list.paths[k]);
+		free(list.paths);
+		return ret;
+	}
+
+	if (optind >= argc) {
+		help_show_message(argv[0]);
+		return 1;
+	}
+
+	memset(&buf, 0, sizeof(buf));
+	bytes = 0;
+	ret = render_dex_file(argv[optind], &opt, &buf, &bytes);
+	report_timing(&opt, argv[optind], ret, bytes, &buf);
+	if (buf.aggregate.counts != NULL && write_aggregate(&buf.aggregate, &opt) != 0) ret = 1;
+	free_dex_buffers(&buf);
+	return ret;
 }
@@ -0,0 +1,465 @@
+/*
+ * Ashutosh Jain, Hugo Gonzalez and Natalia Stakhanova
+ *
+ * libdroidcolors - the .dex layout walk and the renderers behind
+ * droidcolors, for use in-process.
+ *
+ * A dc_context_t holds everything one render needs between samples: the
+ * region lists, counters, timing and inflate state. Give each thread its
+ * own context and reuse it, the buffers only ever grow. Nothing in the
+ * library prints or exits, every call returns DC_OK or a DC_ERR_* code.
+ *
+ *     dc_context_t ctx;
+ *     bitmap_t image;
+ *
+ *     dc_init(&ctx);
+ *     if (dc_parse(&ctx, bytes, size) == DC_OK) {
+ *         image.width = ctx.width;
+ *         image.height = ctx.height;
+ *         image.pixels = <ctx.width * ctx.height pixels of your own>;
+ *         dc_render(&ctx, &image);
+ *     }
+ *     dc_free(&ctx);
+ */
+
+#ifndef DROIDCOLORS_H
+#define DROIDCOLORS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#define DC_VERSION "0.9"
+
+
+typedef uint8_t             dc_u1;
+typedef uint16_t            dc_u2;
+typedef uint32_t            dc_u4;
+typedef uint64_t            dc_u8;
+
+/* A coloured pixel. */
+
+typedef struct {
+ uint8_t red;
+ uint8_t green;
+ uint8_t blue;
+} pixel_t;
+
+/* A picture. */
+    
+typedef struct  {
+  pixel_t *pixels;
+  size_t width;
+  size_t height;
+} bitmap_t;
+
+/* Every structure the parser finds becomes a region: a byte range of the
+ * .dex and the kind of structure living there. The colour of each kind is
+ * kept in dc_region_info, the parser never touches pixels. */
+
+enum {
+	REGION_NONE = 0,
+	REGION_HEADER,
+	REGION_LINK,
+	REGION_MAP,
+	REGION_STRING_IDS,
+	REGION_TYPE_IDS,
+	REGION_PROTO_IDS,
+	REGION_FIELD_IDS,
+	REGION_METHOD_IDS,
+	REGION_CLASS_DEFS,
+	REGION_STRING_SIZE,
+	REGION_STRING_DATA,
+	REGION_STRING_DATA_ORDERED,
+	REGION_PROTO_PARAMETERS,
+	REGION_INTERFACES,
+	REGION_ANNOTATIONS,
+	REGION_CLASS_DATA,
+	REGION_DIRECT_CODE_HEAD,
+	REGION_DIRECT_CODE,
+	REGION_DIRECT_DEBUG_INFO,
+	REGION_VIRTUAL_CODE_HEAD,
+	REGION_VIRTUAL_CODE,
+	REGION_VIRTUAL_DEBUG_INFO,
+	REGION_TRIES,
+	REGION_STATIC_VALUES,
+	// with ctx->opcodes, the catch handlers and every instruction by kind
+	REGION_HANDLERS,
+	REGION_OP_OTHER,        // nop and unused opcodes
+	REGION_OP_MOVE,         // move, move-result, move-exception
+	REGION_OP_RETURN,
+	REGION_OP_CONST,        // const, const-wide, const-class, method handles
+	REGION_OP_CONST_STRING,
+	REGION_OP_OBJECT,       // new-instance, new-array, check-cast, throw, monitors
+	REGION_OP_BRANCH,       // goto, switch, if, cmp
+	REGION_OP_ARRAY,        // aget, aput
+	REGION_OP_FIELD,        // iget, iput, sget, sput
+	REGION_OP_INVOKE,
+	REGION_OP_ARITH,        // unary, binary and literal operations
+	REGION_OP_PAYLOAD,      // switch tables and array data inside insns
+	REGION_COUNT
+};
+
+typedef struct {
+	const char *name;
+	dc_u1 red;
+	dc_u1 green;
+	dc_u1 blue;
+} region_info_t;
+
+extern const region_info_t dc_region_info[REGION_COUNT];
+
+typedef struct {
+	dc_u4 offset;
+	dc_u4 len;
+	dc_u4 seq;     // emission order, on overlap the latest region wins
+	dc_u1 type;
+} region_t;
+
+typedef struct {
+	region_t *regions;
+	size_t count;
+	size_t size;
+	int nomem;  // an dc_add_region found no memory, the list is short
+} region_list_t;
+
+#define HIST_BUCKETS 16
+
+typedef struct {
+	dc_u4 strings;
+	dc_u4 proto_parameters;
+	dc_u4 classes;
+	dc_u4 interfaces;
+	dc_u4 annotations;
+	dc_u4 class_data;
+	dc_u4 static_values;
+	dc_u4 fields;
+	dc_u4 direct_methods;
+	dc_u4 virtual_methods;
+	dc_u4 code_items;         // distinct code_items, dup_code_items more methods share one
+	dc_u4 methods_with_tries;
+	dc_u4 try_items;
+	dc_u4 debug_infos;
+	dc_u8 insns_units;        // total insns_size, in 16-bit code units
+	dc_u8 instructions;       // decoded, with ctx->opcodes
+	dc_u4 catch_handlers;     // decoded, with ctx->opcodes
+	dc_u4 truncated;          // dynamic structures cut short by the end of the file
+	dc_u4 dup_code_items;     // references to an item already walked, skipped
+	dc_u4 dup_debug_infos;
+	dc_u4 dup_class_data;
+	dc_u4 dup_interfaces;
+	dc_u4 dup_annotations;
+	dc_u4 dup_static_values;
+	dc_u4 insns_hist[HIST_BUCKETS];
+	dc_u4 string_hist[HIST_BUCKETS];
+} dex_stats_t;
+
+/* Wall time, bytes and structures per phase of a render, when timed.
+ * class_data is the time spent in Analize_class_data and is included in
+ * class_defs. merge is putting the slices of a parallel walk back together,
+ * whose phases report the slowest slice. For the parse phases bytes and
+ * items are the regions the phase emitted, for verify and entropy the
+ * dex files read. */
+enum {
+	PHASE_LOAD = 0,
+	PHASE_VERIFY,
+	PHASE_TABLES,
+	PHASE_STRINGS,
+	PHASE_PROTOS,
+	PHASE_CLASS_DEFS,
+	PHASE_CLASS_DATA,
+	PHASE_MERGE,
+	PHASE_NORMALIZE,
+	PHASE_RENDER,
+	PHASE_ENTROPY,
+	PHASE_SAVE,
+	PHASE_COUNT
+};
+
+extern const char *dc_phase_names[PHASE_COUNT];
+
+typedef struct {
+	double seconds[PHASE_COUNT];
+	dc_u8 bytes[PHASE_COUNT];
+	dc_u8 items[PHASE_COUNT];
+} dex_timing_t;
+
+typedef struct {
+	double start;
+	size_t first_region;
+} phase_t;
+
+/* Downsampled rendering. Every pixel of the full-size image falls in one
+ * cell of a width x height thumbnail and a cell gets the average colour of
+ * its pixels. Runs are added straight into the cells, a row or a block of
+ * whole rows at a time, so the full-size bitmap is never allocated. When
+ * the thumbnail is larger than the image, empty cells repeat their left or
+ * upper neighbour. */
+typedef struct {
+	size_t width;
+	size_t height;
+	size_t full_width;
+	size_t full_height;
+	dc_u8 *sums;          // red, green, blue per cell
+	size_t sums_size;  // in cells
+} thumbnail_t;
+
+/* A classes*.dex entry of an .apk, see dc_zip_find_dex_entries. */
+typedef struct {
+	char name[32];        // classes.dex, classes2.dex, ...
+	dc_u4 index;             // 1 for classes.dex, N for classesN.dex
+	dc_u2 method;
+	dc_u4 compressed_size;
+	dc_u4 size;
+	dc_u4 local_offset;
+} zip_entry_t;
+
+/* A .dcr holds the runs of one dex in a file of their own, to be painted
+ * or queried later without the dex. Little endian, like the dex: this
+ * header, then block_count dcr_block_t, then the runs, each a uleb128 gap
+ * from the end of the previous run, a uleb128 length and a region byte.
+ * Every block_runs runs start a block, whose first gap is counted from the
+ * block's start, so a run is found with a binary search over the blocks
+ * and at most block_runs runs decoded. Mapping the file is enough. */
+#define DCR_MAGIC "DCR\n"
+#define DCR_FORMAT 1
+#define DCR_BLOCK_RUNS 64
+
+typedef struct {
+	char magic[4];          // DCR_MAGIC
+	dc_u4 format;              // DCR_FORMAT
+	dc_u4 dex_size;
+	char dex_version[4];    // "035" and a NUL, from the dex magic
+	dc_u1 signature[20];       // SHA-1 from the dex header
+	dc_u4 run_count;
+	dc_u4 block_runs;
+	dc_u4 block_count;
+	dc_u4 index_off;           // of the blocks, from the start of the file
+	dc_u4 runs_off;
+	dc_u4 runs_size;           // bytes
+	dc_u4 reserved;
+} dcr_header_t;
+
+typedef struct {
+	dc_u4 start;               // offset in the dex of the block's first run
+	dc_u4 pos;                 // of its encoding, from runs_off
+} dcr_block_t;
+
+/* A .dcr checked by dc_dcr_open, pointing into the caller's bytes. */
+typedef struct {
+	const dcr_header_t *header;
+	const dcr_block_t *blocks;
+	const dc_u1 *runs;
+	const dc_u1 *end;
+} dcr_file_t;
+
+/* Errors. */
+enum {
+	DC_OK = 0,
+	DC_ERR_IO,          // a file can't be opened or written
+	DC_ERR_NOT_DEX,     // too short or bad magic
+	DC_ERR_SIZE,        // header file_size doesn't match the bytes given
+	DC_ERR_NOMEM,
+	DC_ERR_ZIP,         // no central directory or a damaged entry
+	DC_ERR_DCR,         // bad magic or a damaged .dcr
+	DC_ERR_COUNT
+};
+
+/* Oddities dc_parse tolerates, or'ed into dc_context_t.warnings. */
+#define DC_WARN_VERSION     0x01   // version != 035
+#define DC_WARN_HEADER_SIZE 0x02   // header_size != 0x70
+#define DC_WARN_ENDIAN      0x04   // endian_tag != 0x12345678
+#define DC_WARN_MAP_OFFSET  0x08   // map_off before the data section
+#define DC_WARN_NO_MAP      0x10   // map_walk asked for, no usable map_list
+// and the mismatches dc_verify finds
+#define DC_WARN_CHECKSUM    0x20   // adler32 of the file != header checksum
+#define DC_WARN_SIGNATURE   0x40   // SHA-1 of the file != header signature
+
+typedef struct {
+	region_list_t regions;  // as the parser emitted them
+	region_list_t runs;     // sorted, non-overlapping, what gets painted
+	dex_stats_t stats;
+	dex_timing_t timing;    // accumulated over calls, clear it to restart
+	int timed;              // fill timing in dc_parse
+	int map_walk;           // walk the map_list sections in file order
+	int opcodes;            // paint insns instruction by instruction
+	int parse_threads;      // walk the tables in this many slices at once
+	dc_u4 warnings;            // DC_WARN_* of the last dc_parse
+	dc_u4 file_size;           // of the last dex parsed
+	size_t width;           // full-size image of the last dex parsed
+	size_t height;
+	thumbnail_t thumb;
+	dc_u1 *visited;            // bitset of the data items already walked
+	size_t visited_size;
+	dc_u1 *entropy;            // per byte, of the last dc_render_entropy
+	size_t entropy_size;
+	dc_u1 *inflated;           // deflated dex entries of an apk
+	size_t inflated_size;
+	z_stream inflater;
+	int inflater_ready;
+} dc_context_t;
+
+void dc_init (dc_context_t *ctx);
+void dc_free (dc_context_t *ctx);
+const char *dc_strerror (int err);
+
+/* The 256 pixel wide image a dex of file_size bytes is drawn on. */
+void dc_image_size (dc_u4 file_size, size_t *width, size_t *height);
+
+/* Check the magic of a dex header and copy out its SHA-1 signature and
+ * file_size, which identify the file without reading past the first
+ * DC_HEADER_SIZE bytes. Either pointer may be NULL. */
+#define DC_HEADER_SIZE 0x70
+int dc_dex_signature (const dc_u1 *dex, size_t size, dc_u1 signature[20], dc_u4 *file_size);
+
+/* Check the header, walk the dex and normalize its regions into ctx->runs.
+ * The bytes are only read during the call. With ctx->map_walk the sections
+ * the map_list lists are decoded in file order instead of following the
+ * offsets from the class definitions; without a map_list dc_parse falls
+ * back to the latter and sets DC_WARN_NO_MAP. With ctx->parse_threads > 1
+ * the pointer walk runs on that many threads, with the same result. */
+int dc_parse (dc_context_t *ctx, const dc_u1 *dex, size_t size);
+
+/* Recompute the adler32 checksum and SHA-1 signature of a dex and compare
+ * them with its header: *mismatch gets DC_WARN_CHECKSUM and
+ * DC_WARN_SIGNATURE for those that differ, 0 when the file is intact.
+ * Reads every byte once, on the SIMD and SHA instructions the CPU has. */
+int dc_verify (dc_context_t *ctx, const dc_u1 *dex, size_t size, dc_u4 *mismatch);
+
+/* Paint the runs of the last dc_parse into a caller-owned bitmap. Its
+ * width and height need not be ctx->width and ctx->height, the runs are
+ * laid out row by row and clipped to the bitmap. */
+int dc_render (dc_context_t *ctx, bitmap_t *bitmap);
+
+/* Average the runs of the last dc_parse into a bitmap->width x
+ * bitmap->height thumbnail of the full-size image. */
+int dc_render_thumbnail (dc_context_t *ctx, bitmap_t *bitmap);
+
+/* Byte entropy of a dex, painted on the same layout as its image: every
+ * byte gets the Shannon entropy of the DC_ENTROPY_WINDOW bytes around it,
+ * from black for padding through blue and red to yellow and white for
+ * packed or encrypted data. A bitmap of the size dc_image_size gives is
+ * painted byte for byte, any other size is averaged into a thumbnail.
+ * Independent of dc_parse, but reads every byte of the dex. */
+#define DC_ENTROPY_WINDOW 256
+int dc_render_entropy (dc_context_t *ctx, const dc_u1 *dex, size_t size, bitmap_t *bitmap);
+
+/* .dcr files, see dcr_header_t. dc_dcr_open checks the header and the
+ * index, dc_dcr_find looks up the run covering a dex offset and returns 1,
+ * or 0 when the offset falls between runs or past the last one, and
+ * dc_load_dcr decodes every run into ctx->runs and sets the sizes, the
+ * way dc_parse does, so dc_render and dc_render_thumbnail can follow. */
+int dc_dcr_open (dcr_file_t *dcr, const dc_u1 *data, size_t size);
+int dc_dcr_find (const dcr_file_t *dcr, dc_u4 offset, region_t *run);
+int dc_load_dcr (dc_context_t *ctx, const dc_u1 *data, size_t size);
+
+/* Deep Zoom tiles of the image of the last dc_parse, see dc_save_dzi_to_file.
+ * Level dc_zoom_levels() - 1 is the full-size image, each level above it
+ * halves both sides, down to 1x1 at level 0. dc_render_tile paints the
+ * tile_size square tile (tx, ty) of a level into bitmap->pixels, which
+ * holds tile_size * tile_size pixels, and sets the bitmap's size to that
+ * of the tile, 0x0 outside the level. *solid is set when the whole tile
+ * lies inside one run or one gap, and so do the tiles under it. */
+#define DZI_TILE_SIZE 256
+int dc_zoom_levels (size_t width, size_t height);
+int dc_render_tile (dc_context_t *ctx, int level, size_t tx, size_t ty, size_t tile_size,
+	bitmap_t *bitmap, int *solid);
+
+/* Layout diff. dc_hash_items lists the regions of the last dc_parse with
+ * a hash of their bytes, each region being one item of the dex. dc_diff
+ * matches the items of b against those of a by kind and content, wherever
+ * they sit, and dc_render_diff paints the layout of b with every byte of a
+ * matched item dimmed, so what changed stands out. */
+typedef struct {
+	dc_u8 hash;
+	dc_u4 offset;
+	dc_u4 len;
+	dc_u1 type;
+} dc_item_t;
+
+typedef struct {
+	dc_item_t *items;
+	size_t count;
+	size_t size;
+	dc_u4 file_size;           // of the dex they came from
+} dc_item_list_t;
+
+typedef struct {
+	dc_u4 items[2][REGION_COUNT];      // of a, then of b
+	dc_u8 bytes[2][REGION_COUNT];
+	dc_u4 same[REGION_COUNT];          // items of b with an identical one in a
+	dc_u8 changed_bytes[REGION_COUNT]; // in the items of b without one
+	dc_u8 removed_bytes[REGION_COUNT]; // in the items of a left over
+	region_list_t runs;             // b, as dc_parse normalizes it
+	region_list_t changed;          // the unmatched items of b, normalized
+	dc_u4 file_size;                   // of b
+	size_t width;
+	size_t height;
+} dc_diff_t;
+
+int dc_hash_items (dc_context_t *ctx, const dc_u1 *dex, dc_item_list_t *items);
+int dc_diff (const dc_item_list_t *a, const dc_item_list_t *b, dc_diff_t *diff);
+int dc_render_diff (dc_diff_t *diff, bitmap_t *bitmap);
+void dc_diff_free (dc_diff_t *diff);
+
+/* Mean layout of a corpus. Every dex added is laid on a width x height
+ * grid by relative position in the file, the cells in rows, and each cell
+ * sampled DC_AGGREGATE_SAMPLES times at evenly spaced offsets: counts has,
+ * per cell and region, the samples that fell in it, whatever the size of
+ * the dex. Aggregates of different files add up, dc_aggregate_merge, so
+ * every thread can keep its own. dc_render_aggregate paints a pixel per
+ * cell in the region colours mixed by their counts, and
+ * dc_save_aggregate_to_file writes the counts as CSV. Up to 2^26 files. */
+#define DC_AGGREGATE_SAMPLES 64
+#define DC_AGGREGATE_MAX 4096
+typedef struct {
+	size_t width;
+	size_t height;
+	dc_u8 files;
+	dc_u4 *counts;             // width * height * REGION_COUNT
+} dc_aggregate_t;
+
+int dc_aggregate_init (dc_aggregate_t *agg, size_t width, size_t height);
+void dc_aggregate_add (dc_aggregate_t *agg, const region_list_t *runs, dc_u4 file_size);
+void dc_aggregate_merge (dc_aggregate_t *total, const dc_aggregate_t *part);
+int dc_render_aggregate (const dc_aggregate_t *agg, bitmap_t *bitmap);
+void dc_aggregate_free (dc_aggregate_t *agg);
+
+/* Header fields of a dex that passed dc_parse, as the -l log shows them. */
+void dc_print_header (FILE *fp, const char *name, const dc_u1 *dex);
+
+/* The building blocks dc_parse and dc_render are made of. */
+int dc_add_region (region_list_t *list, dc_u4 offset, dc_u4 len, dc_u1 type);
+int dc_normalize_regions (region_list_t *list, region_list_t *runs);
+void dc_rasterize_span (region_list_t *runs, size_t *next, pixel_t *dst, dc_u8 start, dc_u8 count);
+void dc_rasterize_regions (region_list_t *runs, bitmap_t *bitmap);
+int dc_thumbnail_add_runs (thumbnail_t *thumb, region_list_t *runs);
+void dc_thumbnail_finish (thumbnail_t *thumb, bitmap_t *bitmap);
+void dc_add_stats (dex_stats_t *total, const dex_stats_t *stats);
+void dc_add_timing (dex_timing_t *total, const dex_timing_t *timing);
+void dc_phase_begin (dex_timing_t *timing, region_list_t *regions, phase_t *phase);
+void dc_phase_end (dex_timing_t *timing, region_list_t *regions, phase_t *phase, int id);
+
+/* Output. */
+void dc_print_features_header (FILE *fp);
+void dc_print_features (FILE *fp, const char *dexfile, dc_u4 file_size, region_list_t *runs, dex_stats_t *stats);
+void dc_print_diff (FILE *fp, dc_diff_t *diff);
+int dc_save_regions_to_file (region_list_t *runs, const char *path);
+int dc_save_ppm_to_file (bitmap_t *bitmap, const char *path);
+int dc_save_png_to_file (bitmap_t *bitmap, region_list_t *runs, const char *path);
+int dc_save_png_to_stream (bitmap_t *bitmap, region_list_t *runs, FILE *fp);
+int dc_save_dcr_to_file (region_list_t *runs, const dc_u1 *dex, const char *path);
+int dc_save_dzi_to_file (dc_context_t *ctx, const char *path);
+int dc_save_aggregate_to_file (const dc_aggregate_t *agg, const char *path);
+int dc_is_dcr_file (const dc_u1 *file, size_t size);
+
+/* APK input. */
+int dc_is_zip_file (const dc_u1 *file, size_t size);
+int dc_zip_find_dex_entries (const dc_u1 *zip, size_t size, zip_entry_t **entries);
+/* The bytes of entry into *data: into the zip for a stored entry, into a
+ * buffer of ctx, valid until the next call, for a deflated one. */
+int dc_zip_entry_data (dc_context_t *ctx, const dc_u1 *zip, size_t size, const zip_entry_t *entry,
+	const dc_u1 **data);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * fuzz_dex - libFuzzer target for the dex walk and everything drawn from it.
+ *
+ * compile:
+ *     make fuzz
+ * or
+ *     clang -g -O1 -fsanitize=fuzzer,address,undefined -o fuzz/fuzz_dex fuzz/fuzz_dex.c libdroidcolors.c -lm -lpthread -lpng -lz
+ * and without clang, a driver that runs the files it is given once each:
+ *     make fuzz FUZZCC=gcc FUZZFLAGS="-g -O1 -fsanitize=address,undefined -DFUZZ_MAIN"
+ *
+ * usage:
+ *     fuzz/fuzz_dex [libFuzzer options] corpus/
+ *
+ * An input is taken the way droidcolors takes a file: a zip has its
+ * classes*.dex entries found and unpacked, a .dcr is opened, searched and
+ * loaded, anything else is a dex. Every dex is parsed four ways, serial,
+ * with the map_list walk (-M), on two threads (-P 2) and instruction by
+ * instruction (-O). Each parse that succeeds is rendered full size, as a
+ * 64x64 thumbnail, and hashed into diff items, so the offsets of the walk
+ * are followed into the bytes of the input. Every dex is also verified
+ * and rendered as entropy, full size and as a thumbnail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../droidcolors.h"
+
+// full-size images of more pixels and dex entries of more bytes are
+// skipped, the fuzzer would only report them as running out of memory
+#define FUZZ_MAX_SIZE (1 << 24)
+
+static void fuzz_render(dc_context_t *ctx)
+{
+	bitmap_t bitmap;
+
+	if (ctx->width * ctx->height <= FUZZ_MAX_SIZE) {
+		bitmap.width = ctx->width;
+		bitmap.height = ctx->height;
+		bitmap.pixels = calloc(bitmap.width * bitmap.height, sizeof(pixel_t));
+		if (bitmap.pixels != NULL) {
+			dc_render(ctx, &bitmap);
+			free(bitmap.pixels);
+		}
+	}
+	bitmap.width = bitmap.height = 64;
+	bitmap.pixels = calloc(bitmap.width * bitmap.height, sizeof(pixel_t));
+	if (bitmap.pixels != NULL) {
+		dc_render_thumbnail(ctx, &bitmap);
+		free(bitmap.pixels);
+	}
+}
+
+static void fuzz_parse(const dc_u1 *data, size_t size, int map_walk, int parse_threads, int opcodes)
+{
+	dc_context_t ctx;
+	dc_item_list_t items;
+
+	dc_init(&ctx);
+	ctx.map_walk = map_walk;
+	ctx.parse_threads = parse_threads;
+	ctx.opcodes = opcodes;
+	if (dc_parse(&ctx, data, size) == DC_OK) {
+		fuzz_render(&ctx);
+		memset(&items, 0, sizeof(items));
+		dc_hash_items(&ctx, data, &items);
+		free(items.items);
+	}
+	dc_free(&ctx);
+}
+
+static void fuzz_dex(const dc_u1 *data, size_t size)
+{
+	dc_context_t ctx;
+	bitmap_t bitmap;
+	dc_u4 mismatch;
+
+	fuzz_parse(data, size, 0, 0, 0);
+	fuzz_parse(data, size, 1, 0, 0);
+	fuzz_parse(data, size, 0, 2, 0);
+	fuzz_parse(data, size, 0, 0, 1);
+
+	dc_init(&ctx);
+	dc_verify(&ctx, data, size, &mismatch);
+	dc_image_size(size, &bitmap.width, &bitmap.height);
+	bitmap.pixels = calloc(bitmap.width * bitmap.height, sizeof(pixel_t));
+	if (bitmap.pixels != NULL) {
+		dc_render_entropy(&ctx, data, size, &bitmap);
+		free(bitmap.pixels);
+	}
+	bitmap.width = bitmap.height = 64;
+	bitmap.pixels = calloc(bitmap.width * bitmap.height, sizeof(pixel_t));
+	if (bitmap.pixels != NULL) {
+		dc_render_entropy(&ctx, data, size, &bitmap);
+		free(bitmap.pixels);
+	}
+	dc_free(&ctx);
+}
+
+static void fuzz_apk(const dc_u1 *data, size_t size)
+{
+	dc_context_t ctx;
+	zip_entry_t *entries;
+	const dc_u1 *entry;
+	dc_u1 *copy;
+	int count, k;
+
+	dc_init(&ctx);
+	count = dc_zip_find_dex_entries(data, size, &entries);
+	for (k = 0; k < count; k++) {
+		if (entries[k].size > FUZZ_MAX_SIZE ||
+		    dc_zip_entry_data(&ctx, data, size, &entries[k], &entry) != DC_OK)
+			continue;
+		// a stored entry points into the zip, a copy of exactly its size
+		// lets ASan see a read past its end
+		copy = malloc(entries[k].size ? entries[k].size : 1);
+		if (copy == NULL) continue;
+		memcpy(copy, entry, entries[k].size);
+		fuzz_dex(copy, entries[k].size);
+		free(copy);
+	}
+	free(entries);
+	dc_free(&ctx);
+}
+
+static void fuzz_dcr(const dc_u1 *data, size_t size)
+{
+	dc_context_t ctx;
+	dcr_file_t dcr;
+	region_t run;
+	dc_u4 k;
+
+	if (dc_dcr_open(&dcr, data, size) == DC_OK) {
+		for (k = 0; k < dcr.header->block_count && k < 256; k++) {
+			dc_dcr_find(&dcr, dcr.blocks[k].start, &run);
+			dc_dcr_find(&dcr, dcr.blocks[k].start - 1, &run);
+		}
+		dc_dcr_find(&dcr, 0, &run);
+		dc_dcr_find(&dcr, dcr.header->dex_size / 2, &run);
+		dc_dcr_find(&dcr, dcr.header->dex_size - 1, &run);
+		dc_dcr_find(&dcr, 0xffffffff, &run);
+	}
+	dc_init(&ctx);
+	if (dc_load_dcr(&ctx, data, size) == DC_OK) {
+		fuzz_render(&ctx);
+		// every run back through the index
+		if (dc_dcr_open(&dcr, data, size) == DC_OK)
+			for (k = 0; k < ctx.runs.count && k < 4096; k++)
+				dc_dcr_find(&dcr, ctx.runs.regions[k].offset, &run);
+	}
+	dc_free(&ctx);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (dc_is_zip_file(data, size)) fuzz_apk(data, size);
+	else if (dc_is_dcr_file(data, size)) fuzz_dcr(data, size);
+	else fuzz_dex(data, size);
+	return 0;
+}
+
+#ifdef FUZZ_MAIN
+int main(int argc, char *argv[])
+{
+	dc_u1 *data;
+	long size;
+	FILE *fp;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		fp = fopen(argv[i], "rb");
+		if (fp == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		rewind(fp);
+		// exactly the file, so ASan sees a read past its end
+		data = malloc(size ? size : 1);
+		if (data == NULL || fread(data, 1, size, fp) != (size_t) size) {
+			fprintf(stderr, "ERROR: %s: can't read the file\n", argv[i]);
+			return 1;
+		}
+		fclose(fp);
+		LLVMFuzzerTestOneInput(data, size);
+		free(data);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,3870 @@
+/*
+ * Ashutosh Jain, Hugo Gonzalez and Natalia Stakhanova
+ *
+ * libdroidcolors - walks the layout of a .dex and renders it, see
+ * droidcolors.h for the interface and droidcolors.c for the command line
+ * tool built on it.
+ *
+ * compile:
+ *     make libdroidcolors.a libdroidcolors.so
+ * or
+ *     gcc -w -g -fPIC -shared -o libdroidcolors.so libdroidcolors.c -lm -lpthread -lpng -lz
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <png.h>
+#include <zlib.h>
+#include <math.h>
+
+#include "droidcolors.h"
+
+/* The short names the code was written with. */
+typedef dc_u1 u1;
+typedef dc_u2 u2;
+typedef dc_u4 u4;
+typedef dc_u8 u8;
+
+
+/* The on-disk structures, laid over the file bytes. Offsets in a damaged
+ * file (or a stored .dex that zipalign did not align) need not be 4 byte
+ * aligned, so they are packed: x86 loads them the same either way. */
+typedef struct {
+	char dex[3];
+	char newline[1];
+	char ver[3];
+	char zero[1];
+} __attribute__((packed)) dex_magic;
+
+typedef struct {
+	dex_magic magic;
+	u4 checksum[1];
+	unsigned char signature[20];
+	u4 file_size[1];
+	u4 header_size[1];
+	u4 endian_tag[1];
+	u4 link_size[1];
+	u4 link_off[1];
+	u4 map_off[1];
+	u4 string_ids_size[1];
+	u4 string_ids_off[1];
+	u4 type_ids_size[1];
+	u4 type_ids_off[1];
+	u4 proto_ids_size[1];
+	u4 proto_ids_off[1];
+	u4 field_ids_size[1];
+	u4 field_ids_off[1];
+	u4 method_ids_size[1];
+	u4 method_ids_off[1];
+	u4 class_defs_size[1];
+	u4 class_defs_off[1];
+	u4 data_size[1];
+	u4 data_off[1];
+} __attribute__((packed)) dex_header;
+
+
+typedef struct {
+	u4 string_data_off[1];
+} __attribute__((packed)) string_id_struct;
+
+typedef struct {
+	u4 class_idx[1];
+	u4 access_flags[1];
+	u4 superclass_idx[1];
+	u4 interfaces_off[1];
+	u4 source_file_idx[1];
+	u4 annotations_off[1];
+	u4 class_data_off[1];
+	u4 static_values_off[1];
+} __attribute__((packed)) class_def_struct;
+
+typedef struct {
+	u2 class_idx[1];
+	u2 proto_idx[1];
+	u4 name_idx[1];
+} __attribute__((packed)) method_id_struct;
+
+typedef struct {
+	u4 descriptor_idx[1];
+} __attribute__((packed)) type_id_struct;
+
+typedef struct {
+	u4 shorty_idx[1];
+    u4 return_type_idx[1];
+    u4 parameters_off[1];
+} __attribute__((packed)) proto_id_struct;
+
+typedef struct {
+    u2 class_idx[1];
+    u2 type_idx[1];
+    u4 name_idx[1];
+} __attribute__((packed)) field_id_struct;
+
+typedef struct {
+    u2 type[1];
+    u2 unused[1];
+    u4 size[1];
+    u4 offset[1];
+} __attribute__((packed)) map_item_struct;
+
+typedef struct {
+	u4 class_annotations_off[1];
+	u4 fields_size[1];
+	u4 annotated_methods_size[1];
+	u4 annotated_parameters_size[1];
+	// -- the rest are calculated, they are lists based on the previous sizes
+	// field_annotations
+	// method_annotations
+	// parameter_annotations
+	} __attribute__((packed)) annotations_directory_item_struct;
+
+typedef struct {
+    u2 registers_size[1];
+    u2 ins_size[1];
+    u2 outs_size[1];
+    u2 tries_size[1];
+    u4 debug_info_off[1];
+    u4 insns_size[1];
+    // insns u2[insns_size]  array of bytecode -- dynamic
+    // pading u2 -- optional
+    // tries try_itme -- optional
+    // handlers encoded_catch_handler_list -- optional
+} __attribute__((packed)) code_item_struct;
+
+typedef struct {
+	u4 start_add[1];
+	u2 insn_count[1];
+	u2 handler_off[1];
+} __attribute__((packed)) try_item_struct;
+
+const region_info_t dc_region_info[REGION_COUNT] = {
+	{ "none",                 0,   0,   0 },
+	{ "header",             255,   0,   0 },  // red
+	{ "link",               255, 255,   0 },  // orange
+	{ "map",                  0,   0, 255 },  // blue
+	{ "string_ids",           0, 109,  44 },  // darkgreen
+	{ "type_ids",            44, 162,  95 },  // green
+	{ "proto_ids",          102, 194, 164 },  // greenblue
+	{ "field_ids",          153, 216, 201 },  // aquamarine
+	{ "method_ids",         204, 236, 230 },  // bluegreen
+	{ "class_defs",         237, 248, 251 },
+	{ "string_size",        240,   0,   0 },  // red
+	{ "string_data",          0, 109,  44 },  // darkgreen
+	{ "string_data_ordered",100, 109,  44 },
+	{ "proto_parameters",     0, 100, 255 },
+	{ "interfaces",           0, 150, 255 },
+	{ "annotations",        155,   0, 175 },
+	{ "class_data",           0, 150,   0 },
+	{ "direct_code_head",    84,  39, 136 },  // purple
+	{ "direct_code",        153, 142, 195 },  // lightpurple
+	{ "direct_debug_info",  255,  10, 235 },
+	{ "virtual_code_head",  179,  88,   6 },
+	{ "virtual_code",       241, 163,  64 },
+	{ "virtual_debug_info", 235,   0, 255 },
+	{ "tries",              153, 142,   0 },
+	{ "static_values",      155, 150,   0 },
+	{ "handlers",           190, 175,  60 },
+	{ "op_other",            90,  90,  90 },  // grey
+	{ "op_move",            120, 160, 230 },  // lightblue
+	{ "op_return",           40,  60, 160 },  // darkblue
+	{ "op_const",           250, 200, 120 },  // lightorange
+	{ "op_const_string",    255, 140,   0 },  // orange
+	{ "op_object",          200, 120, 200 },  // orchid
+	{ "op_branch",          230,  30,  30 },  // red
+	{ "op_array",           140, 200, 120 },  // lightgreen
+	{ "op_field",            40, 170,  80 },  // green
+	{ "op_invoke",          255, 230,   0 },  // yellow
+	{ "op_arith",           170, 140, 100 },  // tan
+	{ "op_payload",           0, 200, 200 },  // cyan
+};
+
+/* On DC_ERR_NOMEM the region is dropped and list->nomem set, so the walk
+ * can go on and its caller checks once at the end. */
+int dc_add_region(region_list_t *list, u4 offset, u4 len, u1 type)
+{
+	region_t *region;
+	size_t size;
+
+	if (len == 0) return DC_OK;
+	if (list->count == list->size) {
+		size = list->size ? list->size * 2 : 4096;
+		region = realloc(list->regions, size * sizeof(region_t));
+		if (region == NULL) {
+			list->nomem = 1;
+			return DC_ERR_NOMEM;
+		}
+		list->regions = region;
+		list->size = size;
+	}
+	region = list->regions + list->count;
+	region->offset = offset;
+	region->len = len;
+	region->seq = list->count++;
+	region->type = type;
+	return DC_OK;
+}
+
+/* LSD radix sort on the offset, 13 bits per pass so a .dex up to 64 MB
+ * takes two passes. It is stable, so regions starting at the same offset
+ * keep their emission order. */
+#define SORT_BITS 13
+#define SORT_BUCKETS (1 << SORT_BITS)
+
+static void sort_regions(region_list_t *list, region_t *tmp)
+{
+	static __thread size_t count[SORT_BUCKETS];
+	region_t *src, *dst, *swap;
+	u4 maxoffset = 0;
+	size_t i, sum, n;
+	int shift;
+
+	if (list->count < 2) return;
+	for (i = 0; i < list->count; i++)
+		if (list->regions[i].offset > maxoffset) maxoffset = list->regions[i].offset;
+
+	src = list->regions;
+	dst = tmp;
+	for (shift = 0; shift < 32 && (maxoffset >> shift) != 0; shift += SORT_BITS) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < list->count; i++)
+			count[(src[i].offset >> shift) & (SORT_BUCKETS - 1)]++;
+		for (sum = 0, i = 0; i < SORT_BUCKETS; i++) {
+			n = count[i];
+			count[i] = sum;
+			sum += n;
+		}
+		for (i = 0; i < list->count; i++)
+			dst[count[(src[i].offset >> shift) & (SORT_BUCKETS - 1)]++] = src[i];
+		swap = src; src = dst; dst = swap;
+	}
+	if (src != list->regions) memcpy(list->regions, src, list->count * sizeof(region_t));
+}
+
+/* Counters gathered during the walk, for the feature vector. Histograms
+ * bucket by floor(log2(value)), the last bucket takes everything above. */
+static void hist_add(u4 *hist, u4 value)
+{
+	int bucket = 0;
+
+	while (value > 1 && bucket < HIST_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
+}
+
+void dc_add_stats(dex_stats_t *total, const dex_stats_t *stats)
+{
+	int b;
+
+	total->strings += stats->strings;
+	total->proto_parameters += stats->proto_parameters;
+	total->classes += stats->classes;
+	total->interfaces += stats->interfaces;
+	total->annotations += stats->annotations;
+	total->class_data += stats->class_data;
+	total->static_values += stats->static_values;
+	total->fields += stats->fields;
+	total->direct_methods += stats->direct_methods;
+	total->virtual_methods += stats->virtual_methods;
+	total->code_items += stats->code_items;
+	total->methods_with_tries += stats->methods_with_tries;
+	total->try_items += stats->try_items;
+	total->debug_infos += stats->debug_infos;
+	total->insns_units += stats->insns_units;
+	total->instructions += stats->instructions;
+	total->catch_handlers += stats->catch_handlers;
+	total->truncated += stats->truncated;
+	total->dup_code_items += stats->dup_code_items;
+	total->dup_debug_infos += stats->dup_debug_infos;
+	total->dup_class_data += stats->dup_class_data;
+	total->dup_interfaces += stats->dup_interfaces;
+	total->dup_annotations += stats->dup_annotations;
+	total->dup_static_values += stats->dup_static_values;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		total->insns_hist[b] += stats->insns_hist[b];
+		total->string_hist[b] += stats->string_hist[b];
+	}
+}
+
+const char *dc_phase_names[PHASE_COUNT] = {
+	"load", "verify", "tables", "strings", "protos", "class_defs", "class_data",
+	"merge", "normalize", "render", "entropy", "save"
+};
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void dc_add_timing(dex_timing_t *total, const dex_timing_t *timing)
+{
+	int p;
+
+	for (p = 0; p < PHASE_COUNT; p++) {
+		total->seconds[p] += timing->seconds[p];
+		total->bytes[p] += timing->bytes[p];
+		total->items[p] += timing->items[p];
+	}
+}
+
+static u8 region_end(const region_t *region)
+{
+	return (u8) region->offset + region->len;
+}
+
+/* max-heap on seq, used by dc_normalize_regions to know who owns a byte */
+typedef struct {
+	region_t **regions;
+	size_t count;
+	size_t size;
+} region_heap_t;
+
+static int heap_push(region_heap_t *heap, region_t *region)
+{
+	region_t **regions;
+	size_t i, size;
+
+	if (heap->count == heap->size) {
+		size = heap->size ? heap->size * 2 : 64;
+		regions = realloc(heap->regions, size * sizeof(region_t *));
+		if (regions == NULL) return DC_ERR_NOMEM;
+		heap->regions = regions;
+		heap->size = size;
+	}
+	i = heap->count++;
+	while (i > 0 && heap->regions[(i - 1) / 2]->seq < region->seq) {
+		heap->regions[i] = heap->regions[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap->regions[i] = region;
+	return DC_OK;
+}
+
+static void heap_pop(region_heap_t *heap)
+{
+	region_t *last = heap->regions[--heap->count];
+	size_t i = 0, child;
+
+	while ((child = 2 * i + 1) < heap->count) {
+		if (child + 1 < heap->count && heap->regions[child + 1]->seq > heap->regions[child]->seq) child++;
+		if (heap->regions[child]->seq <= last->seq) break;
+		heap->regions[i] = heap->regions[child];
+		i = child;
+	}
+	if (heap->count > 0) heap->regions[i] = last;
+}
+
+static int append_run(region_list_t *runs, u8 start, u8 end, u1 type)
+{
+	region_t *last = runs->count > 0 ? runs->regions + runs->count - 1 : NULL;
+
+	if (last != NULL && region_end(last) == start && last->type == type) {
+		last->len += end - start;
+		return DC_OK;
+	}
+	return dc_add_region(runs, start, end - start, type);
+}
+
+/* Turn the raw regions, in emission order and possibly overlapping, into a
+ * sorted list of disjoint runs. Where regions overlap the one emitted last
+ * wins, as it did when every structure was painted straight away. Adjacent
+ * runs of the same type are merged. Sorts list in place. Returns
+ * DC_ERR_NOMEM, with runs empty, if it runs out of memory. */
+int dc_normalize_regions(region_list_t *list, region_list_t *runs)
+{
+	region_heap_t heap;
+	region_t *top;
+	size_t i = 0;
+	u8 pos, next;
+	int err = DC_OK;
+
+	runs->count = 0;
+	runs->nomem = 0;
+	if (list->count == 0) return DC_OK;
+
+	// runs never outnumber regions by much, size it up front and borrow
+	// it as scratch space for the sort
+	if (runs->size < list->count) {
+		free(runs->regions);
+		runs->regions = malloc(list->count * sizeof(region_t));
+		runs->size = runs->regions ? list->count : 0;
+		if (runs->regions == NULL) return DC_ERR_NOMEM;
+	}
+	sort_regions(list, runs->regions);
+	memset(&heap, 0, sizeof(heap));
+
+	pos = list->regions[0].offset;
+	while ((i < list->count || heap.count > 0) && err == DC_OK) {
+		if (heap.count == 0) {
+			// most regions don't overlap anything, copy them straight out
+			if (list->regions[i].offset > pos) pos = list->regions[i].offset;
+			if (i + 1 == list->count || region_end(&list->regions[i]) <= list->regions[i + 1].offset) {
+				err = append_run(runs, pos, region_end(&list->regions[i]), list->regions[i].type);
+				pos = region_end(&list->regions[i++]);
+				continue;
+			}
+		}
+		while (i < list->count && list->regions[i].offset <= pos && err == DC_OK)
+			err = heap_push(&heap, &list->regions[i++]);
+		while (heap.count > 0 && region_end(heap.regions[0]) <= pos)
+			heap_pop(&heap);
+		if (heap.count == 0 || err != DC_OK) continue;
+
+		top = heap.regions[0];
+		next = region_end(top);
+		if (i < list->count && list->regions[i].offset < next) next = list->regions[i].offset;
+		err = append_run(runs, pos, next, top->type);
+		pos = next;
+	}
+	free(heap.regions);
+	if (err != DC_OK) runs->count = 0;
+	return err;
+}
+
+
+/* Fill len pixels with one colour. put_pixels is the innermost loop of the
+ * renderer, so on x86 runs are written 16 or 32 pixels at a time from a
+ * precomputed pattern: 48 bytes hold 16 whole pixels and three 16-byte
+ * stores (or three 32-byte stores for 96 bytes) lay the pattern down
+ * without ever splitting a pixel across iterations. */
+static void fill_rgb_scalar (pixel_t *pix, size_t len, u1 r, u1 g, u1 b)
+{
+	size_t x;
+	for (x=0; x<len; x++) {
+		pix->red = r;
+		pix->green = g;
+		pix->blue = b;
+		pix++;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+static void fill_rgb_pattern (u1 *pattern, size_t bytes, u1 r, u1 g, u1 b)
+{
+	size_t i;
+	for (i = 0; i < bytes; i += 3) {
+		pattern[i] = r;
+		pattern[i+1] = g;
+		pattern[i+2] = b;
+	}
+}
+
+__attribute__((target("sse2")))
+static void fill_rgb_sse2 (pixel_t *pix, size_t len, u1 r, u1 g, u1 b)
+{
+	u1 pattern[48];
+	u1 *dst = (u1 *) pix;
+	size_t bytes = len * sizeof(pixel_t);
+	__m128i p0, p1, p2;
+
+	if (len < 16) {
+		fill_rgb_scalar(pix, len, r, g, b);
+		return;
+	}
+	fill_rgb_pattern(pattern, sizeof(pattern), r, g, b);
+	p0 = _mm_loadu_si128((__m128i *) pattern);
+	p1 = _mm_loadu_si128((__m128i *) (pattern + 16));
+	p2 = _mm_loadu_si128((__m128i *) (pattern + 32));
+	for (; bytes >= 48; bytes -= 48, dst += 48) {
+		_mm_storeu_si128((__m128i *) dst, p0);
+		_mm_storeu_si128((__m128i *) (dst + 16), p1);
+		_mm_storeu_si128((__m128i *) (dst + 32), p2);
+	}
+	memcpy(dst, pattern, bytes);
+}
+
+__attribute__((target("avx2")))
+static void fill_rgb_avx2 (pixel_t *pix, size_t len, u1 r, u1 g, u1 b)
+{
+	u1 pattern[96];
+	u1 *dst = (u1 *) pix;
+	size_t bytes = len * sizeof(pixel_t);
+	__m256i p0, p1, p2;
+
+	if (len < 32) {
+		fill_rgb_sse2(pix, len, r, g, b);
+		return;
+	}
+	fill_rgb_pattern(pattern, sizeof(pattern), r, g, b);
+	p0 = _mm256_loadu_si256((__m256i *) pattern);
+	p1 = _mm256_loadu_si256((__m256i *) (pattern + 32));
+	p2 = _mm256_loadu_si256((__m256i *) (pattern + 64));
+	for (; bytes >= 96; bytes -= 96, dst += 96) {
+		_mm256_storeu_si256((__m256i *) dst, p0);
+		_mm256_storeu_si256((__m256i *) (dst + 32), p1);
+		_mm256_storeu_si256((__m256i *) (dst + 64), p2);
+	}
+	memcpy(dst, pattern, bytes);
+}
+#endif
+
+static void (*fill_rgb) (pixel_t *pix, size_t len, u1 r, u1 g, u1 b) = fill_rgb_scalar;
+
+__attribute__((constructor))
+static void select_fill_rgb (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) fill_rgb = fill_rgb_avx2;
+	else if (__builtin_cpu_supports("sse2")) fill_rgb = fill_rgb_sse2;
+#endif
+}
+
+static void put_pixels (pixel_t *pix, size_t len, u1 r, u1 g, u1 b)
+{
+	// most runs are a few pixels long, not worth the indirect call
+	if (len < 16) fill_rgb_scalar(pix, len, r, g, b);
+	else fill_rgb(pix, len, r, g, b);
+}
+
+/* Paint pixels [start, start + count) of the image from the normalized
+ * runs into dst, clearing the gaps between them. *next is the first run
+ * that may still reach start; calls for consecutive spans pick up where
+ * the previous one stopped, so an image can be produced a row at a time. */
+void dc_rasterize_span (region_list_t *runs, size_t *next, pixel_t *dst, u8 start, u8 count)
+{
+	u8 pos = start, total = start + count, end;
+	size_t i;
+	region_t *run;
+	const region_info_t *info;
+
+	for (i = *next; i < runs->count && pos < total; i++) {
+		run = runs->regions + i;
+		if (region_end(run) <= pos) continue;
+		if (run->offset > pos) {
+			end = run->offset < total ? run->offset : total;
+			memset(dst + (pos - start), 0, (end - pos) * sizeof(pixel_t));
+			pos = end;
+			if (pos == total) break;
+		}
+		end = region_end(run) < total ? region_end(run) : total;
+		info = dc_region_info + run->type;
+		put_pixels(dst + (pos - start), end - pos, info->red, info->green, info->blue);
+		pos = end;
+		if (region_end(run) > total) break;
+	}
+	*next = i;
+	if (pos < total) memset(dst + (pos - start), 0, (total - pos) * sizeof(pixel_t));
+}
+
+/* Paint normalized runs in one pass over the bitmap. Runs past the end of
+ * the bitmap are clipped. */
+void dc_rasterize_regions (region_list_t *runs, bitmap_t *bitmap)
+{
+	size_t next = 0;
+
+	dc_rasterize_span(runs, &next, bitmap->pixels, 0, (u8) bitmap->width * bitmap->height);
+}
+
+static size_t thumb_col_start (thumbnail_t *thumb, size_t cx)
+{
+	return (cx * thumb->full_width + thumb->width - 1) / thumb->width;
+}
+
+static size_t thumb_row_start (thumbnail_t *thumb, size_t cy)
+{
+	return ((u8) cy * thumb->full_height + thumb->height - 1) / thumb->height;
+}
+
+static void thumb_add (u8 *sum, u8 pixels, const region_info_t *info)
+{
+	sum[0] += pixels * info->red;
+	sum[1] += pixels * info->green;
+	sum[2] += pixels * info->blue;
+}
+
+int dc_thumbnail_add_runs (thumbnail_t *thumb, region_list_t *runs)
+{
+	u8 total = (u8) thumb->full_width * thumb->full_height;
+	u8 pos, end, x, xe, xn, y, y1, ye;
+	u8 next_row;    // first image row of cell row cy + 1
+	size_t i, cx, cy = 0;
+	size_t *col_cell = malloc(thumb->full_width * sizeof(size_t));
+	size_t *col_start = malloc((thumb->width + 1) * sizeof(size_t));
+	u8 *row;
+	const region_info_t *info;
+
+	if (col_cell == NULL || col_start == NULL) {
+		free(col_cell);
+		free(col_start);
+		return DC_ERR_NOMEM;
+	}
+	for (cx = 0; cx <= thumb->width; cx++) col_start[cx] = thumb_col_start(thumb, cx);
+	for (x = 0; x < thumb->full_width; x++) col_cell[x] = x * thumb->width / thumb->full_width;
+	next_row = thumb_row_start(thumb, 1);
+
+	memset(thumb->sums, 0, thumb->width * thumb->height * 3 * sizeof(u8));
+	for (i = 0; i < runs->count; i++) {
+		pos = runs->regions[i].offset;
+		end = region_end(runs->regions + i);
+		if (end > total) end = total;
+		if (runs->regions[i].type == REGION_NONE) continue;
+		info = dc_region_info + runs->regions[i].type;
+		while (pos < end) {
+			y = pos / thumb->full_width;
+			x = pos - y * thumb->full_width;
+			// runs are sorted, the cell row only moves forward
+			while (y >= next_row) next_row = thumb_row_start(thumb, ++cy + 1);
+			row = thumb->sums + cy * thumb->width * 3;
+			if (x == 0 && end - pos >= thumb->full_width) {
+				// a block of whole rows, one pass per cell row it touches
+				y1 = y + (end - pos) / thumb->full_width;
+				for (;;) {
+					ye = next_row < y1 ? next_row : y1;
+					for (cx = 0; cx < thumb->width; cx++)
+						thumb_add(row + cx * 3, (ye - y) * (col_start[cx + 1] - col_start[cx]), info);
+					y = ye;
+					if (y >= y1) break;
+					next_row = thumb_row_start(thumb, ++cy + 1);
+					row = thumb->sums + cy * thumb->width * 3;
+				}
+				pos = y1 * thumb->full_width;
+			} else {
+				xe = x + (end - pos);
+				if (xe > thumb->full_width) xe = thumb->full_width;
+				while (x < xe) {
+					cx = col_cell[x];
+					xn = col_start[cx + 1] < xe ? col_start[cx + 1] : xe;
+					thumb_add(row + cx * 3, xn - x, info);
+					x = xn;
+				}
+				pos = y * thumb->full_width + xe;
+			}
+		}
+	}
+	free(col_cell);
+	free(col_start);
+	return DC_OK;
+}
+
+void dc_thumbnail_finish (thumbnail_t *thumb, bitmap_t *bitmap)
+{
+	size_t cx, cy, rows, cols;
+	u8 count, *sum;
+	pixel_t *pix;
+
+	bitmap->width = thumb->width;
+	bitmap->height = thumb->height;
+	for (cy = 0; cy < thumb->height; cy++) {
+		rows = thumb_row_start(thumb, cy + 1) - thumb_row_start(thumb, cy);
+		for (cx = 0; cx < thumb->width; cx++) {
+			pix = bitmap->pixels + cy * thumb->width + cx;
+			cols = thumb_col_start(thumb, cx + 1) - thumb_col_start(thumb, cx);
+			count = (u8) rows * cols;
+			if (count == 0) {
+				if (rows == 0) *pix = *(pix - thumb->width);
+				else *pix = *(pix - 1);
+				continue;
+			}
+			sum = thumb->sums + (cy * thumb->width + cx) * 3;
+			pix->red = (sum[0] + count / 2) / count;
+			pix->green = (sum[1] + count / 2) / count;
+			pix->blue = (sum[2] + count / 2) / count;
+		}
+	}
+}
+
+/* Room for the sums of a thumbnail or tile of this many cells. */
+static int reserve_thumb_sums (dc_context_t *ctx, size_t cells)
+{
+	if (ctx->thumb.sums_size < cells) {
+		free(ctx->thumb.sums);
+		ctx->thumb.sums = malloc(cells * 3 * sizeof(u8));
+		ctx->thumb.sums_size = ctx->thumb.sums ? cells : 0;
+		if (ctx->thumb.sums == NULL) return DC_ERR_NOMEM;
+	}
+	return DC_OK;
+}
+
+/* -- zoom tiles --
+ * The image as a Deep Zoom pyramid. Level levels - 1 is the full-size
+ * image and every level above it halves both sides, rounding up, down to a
+ * single pixel at level 0. A pixel of a coarse level averages the scale x
+ * scale full-size pixels under it, clipped to the image, and is added up
+ * straight from the runs the way thumbnails are: nothing is parsed again
+ * and no level is made from the one below it. The full-size image is 256
+ * pixels wide, so the full-size rows under a tile are one contiguous span
+ * of the dex and the runs inside it are found with a binary search. */
+
+int dc_zoom_levels (size_t width, size_t height)
+{
+	size_t side = width > height ? width : height;
+	int levels = 1;
+
+	while (side > 1) {
+		side = (side + 1) / 2;
+		levels++;
+	}
+	return levels;
+}
+
+/* The first run ending after offset. */
+static size_t find_run(region_list_t *runs, u8 offset)
+{
+	size_t lo = 0, hi = runs->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (region_end(runs->regions + mid) <= offset) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+int dc_render_tile (dc_context_t *ctx, int level, size_t tx, size_t ty, size_t tile_size,
+	bitmap_t *bitmap, int *solid)
+{
+	int levels = dc_zoom_levels(ctx->width, ctx->height);
+	size_t full = ctx->width;
+	u8 scale, x0, y0, x1, y1, start, stop, pos, end, x, xe, xn, y, ye, yn, cx, cy, rows, cols, count;
+	size_t first, i, next, cells;
+	u8 red, green, blue;
+	int shift;              // scale is 1 << shift, divisions are the hot spot
+	int full_shift = 0;
+	region_t *run;
+	const region_info_t *info;
+	pixel_t colour = { 0, 0, 0 };
+	u8 *sum;
+
+	*solid = 0;
+	bitmap->width = bitmap->height = 0;
+	if (level < 0 || level >= levels || full == 0) return DC_OK;
+	shift = levels - 1 - level;
+	scale = (u8) 1 << shift;
+	x0 = (u8) tx * tile_size;
+	y0 = (u8) ty * tile_size;
+	x1 = (full + scale - 1) / scale;
+	y1 = (ctx->height + scale - 1) / scale;
+	if (x0 >= x1 || y0 >= y1) return DC_OK;
+	if (x1 > x0 + tile_size) x1 = x0 + tile_size;
+	if (y1 > y0 + tile_size) y1 = y0 + tile_size;
+	bitmap->width = x1 - x0;
+	bitmap->height = y1 - y0;
+	cells = bitmap->width * bitmap->height;
+	if (bitmap->pixels == NULL) return DC_ERR_NOMEM;
+
+	// the full-size rows under the tile
+	start = y0 * scale * full;
+	stop = y1 * scale < ctx->height ? y1 * scale * full : (u8) ctx->height * full;
+	first = find_run(&ctx->runs, start);
+	run = first < ctx->runs.count ? ctx->runs.regions + first : NULL;
+	if (run == NULL || run->offset >= stop) *solid = 1;
+	else if (run->offset <= start && region_end(run) >= stop) {
+		info = dc_region_info + run->type;
+		colour.red = info->red;
+		colour.green = info->green;
+		colour.blue = info->blue;
+		*solid = 1;
+	}
+	if (*solid) {
+		// inside one run or one gap, and so is every tile under it
+		for (i = 0; i < cells; i++) bitmap->pixels[i] = colour;
+		return DC_OK;
+	}
+	if (scale == 1 && x0 == 0 && x1 == full) {
+		next = first;
+		dc_rasterize_span(&ctx->runs, &next, bitmap->pixels, start, stop - start);
+		return DC_OK;
+	}
+
+	if (reserve_thumb_sums(ctx, cells) != DC_OK) return DC_ERR_NOMEM;
+	memset(ctx->thumb.sums, 0, cells * 3 * sizeof(u8));
+	// the image is 256 wide
+	while (((size_t) 1 << full_shift) < full) full_shift++;
+	if (((size_t) 1 << full_shift) != full) full_shift = -1;
+	for (i = first; i < ctx->runs.count && ctx->runs.regions[i].offset < stop; i++) {
+		run = ctx->runs.regions + i;
+		pos = run->offset > start ? run->offset : start;
+		end = region_end(run) < stop ? region_end(run) : stop;
+		info = dc_region_info + run->type;
+		red = scale * info->red;
+		green = scale * info->green;
+		blue = scale * info->blue;
+		while (pos < end) {
+			y = full_shift >= 0 ? pos >> full_shift : pos / full;
+			x = pos - y * full;
+			if (x == 0 && end - pos >= full) {
+				// whole rows, once per row of cells they cross
+				ye = y + (end - pos) / full;
+				for (; y < ye; y = yn) {
+					cy = y >> shift;
+					yn = (cy + 1) * scale < ye ? (cy + 1) * scale : ye;
+					sum = ctx->thumb.sums + (cy - y0) * bitmap->width * 3;
+					for (cx = x0; cx < x1; cx++) {
+						cols = ((cx + 1) * scale < full ? (cx + 1) * scale : full) - cx * scale;
+						thumb_add(sum + (cx - x0) * 3, (yn - y) * cols, info);
+					}
+				}
+				pos = ye * full;
+			} else {
+				xe = x + (end - pos) < full ? x + (end - pos) : full;
+				pos = y * full + xe;
+				sum = ctx->thumb.sums + ((y >> shift) - y0) * bitmap->width * 3;
+				// a partial cell at either end, whole cells in between
+				while (x < xe && (x & (scale - 1)) != 0) {
+					cx = x >> shift;
+					xn = (cx + 1) * scale < xe ? (cx + 1) * scale : xe;
+					if (cx >= x0 && cx < x1) thumb_add(sum + (cx - x0) * 3, xn - x, info);
+					x = xn;
+				}
+				if (x < xe) {
+					xn = xe & ~(scale - 1);
+					for (cx = x >> shift; cx < xn >> shift; cx++) {
+						if (cx < x0 || cx >= x1) continue;
+						sum[(cx - x0) * 3] += red;
+						sum[(cx - x0) * 3 + 1] += green;
+						sum[(cx - x0) * 3 + 2] += blue;
+					}
+					cx = xn >> shift;
+					if (xn < xe && cx >= x0 && cx < x1) thumb_add(sum + (cx - x0) * 3, xe - xn, info);
+				}
+			}
+		}
+	}
+
+	for (cy = y0; cy < y1; cy++) {
+		rows = ((cy + 1) * scale < ctx->height ? (cy + 1) * scale : ctx->height) - cy * scale;
+		for (cx = x0; cx < x1; cx++) {
+			cols = ((cx + 1) * scale < full ? (cx + 1) * scale : full) - cx * scale;
+			count = rows * cols;
+			i = (cy - y0) * bitmap->width + (cx - x0);
+			sum = ctx->thumb.sums + i * 3;
+			if (count == scale * scale) {
+				// all but the last row and column of cells
+				bitmap->pixels[i].red = (sum[0] + count / 2) >> 2 * shift;
+				bitmap->pixels[i].green = (sum[1] + count / 2) >> 2 * shift;
+				bitmap->pixels[i].blue = (sum[2] + count / 2) >> 2 * shift;
+				continue;
+			}
+			bitmap->pixels[i].red = (sum[0] + count / 2) / count;
+			bitmap->pixels[i].green = (sum[1] + count / 2) / count;
+			bitmap->pixels[i].blue = (sum[2] + count / 2) / count;
+		}
+	}
+	return DC_OK;
+}
+
+/* -- entropy --
+ * H = log2 W - sum(c log2 c) / W over the byte counts c of a window of W
+ * bytes. The sum is kept in 16.16 fixed point and carried along with the
+ * window, one byte out and one byte in, from a table of f(c + 1) - f(c),
+ * so it is exact, never drifts and every byte costs the same. The update
+ * is a scatter into the counts and does not vectorize. What bounds it is
+ * the store-to-load latency when a count is hit again right away, which
+ * the zero padding of a dex does all the time, so the file is cut in four
+ * slices whose windows move in lockstep and overlap those latencies. A
+ * byte gets the window centred on it, pushed inwards at the file ends. */
+
+static u4 entropy_step[DC_ENTROPY_WINDOW];   // f(c + 1) - f(c), f(c) = c log2 c << 16
+static pixel_t entropy_ramp[256];            // by H * 32
+static u8 entropy_packed[256];               // the same, red, green and blue 21 bits apart
+
+__attribute__((constructor))
+static void init_entropy_tables (void)
+{
+	static const struct { int at; u1 red, green, blue; } stops[] = {
+		{ 0, 0, 0, 0 }, { 64, 0, 0, 96 }, { 128, 40, 60, 220 }, { 176, 170, 0, 170 },
+		{ 208, 230, 30, 0 }, { 228, 255, 220, 0 }, { 240, 255, 255, 255 }, { 256, 255, 255, 255 },
+	};
+	long long f, prev = 0;
+	int c, v, s = 0, t, span;
+
+	for (c = 0; c < DC_ENTROPY_WINDOW; c++) {
+		f = llround((c + 1) * log2(c + 1) * 65536);
+		entropy_step[c] = f - prev;
+		prev = f;
+	}
+	for (v = 0; v < 256; v++) {
+		while (v >= stops[s + 1].at) s++;
+		t = v - stops[s].at;
+		span = stops[s + 1].at - stops[s].at;
+		entropy_ramp[v].red = stops[s].red + (stops[s + 1].red - stops[s].red) * t / span;
+		entropy_ramp[v].green = stops[s].green + (stops[s + 1].green - stops[s].green) * t / span;
+		entropy_ramp[v].blue = stops[s].blue + (stops[s + 1].blue - stops[s].blue) * t / span;
+		entropy_packed[v] = entropy_ramp[v].red | (u8) entropy_ramp[v].green << 21 |
+			(u8) entropy_ramp[v].blue << 42;
+	}
+}
+
+static u4 entropy_fill (u4 counts[256], const u1 *data)
+{
+	u4 sum = 0;
+	size_t i;
+
+	memset(counts, 0, 256 * sizeof(u4));
+	for (i = 0; i < DC_ENTROPY_WINDOW; i++) sum += entropy_step[counts[data[i]]++];
+	return sum;
+}
+
+/* H * 32 = 32 * (8 - sum / (256 << 16)) for a window of 256 bytes. */
+static u1 entropy_value (u4 sum)
+{
+	u4 v = ((1u << 27) - sum + (1u << 18)) >> 19;
+
+	return v > 255 ? 255 : v;
+}
+
+// from the window at data - 1 to the one at data
+#define ENTROPY_SLIDE(counts, sum, data) do { \
+	u4 c_ = --counts[(data)[-1]]; \
+	sum -= entropy_step[c_]; \
+	c_ = counts[(data)[DC_ENTROPY_WINDOW - 1]]++; \
+	sum += entropy_step[c_]; \
+} while (0)
+
+/* H * 32 of every byte of data into out. */
+static void entropy_bytes (const u1 *data, size_t size, u1 *out)
+{
+	const size_t half = DC_ENTROPY_WINDOW / 2;
+	u4 c0[256], c1[256], c2[256], c3[256];
+	u4 s0, s1, s2, s3;
+	size_t last, slice, k;   // windows start at 0 .. last
+	const u1 *d1, *d2, *d3;
+	u1 *o0, *o1, *o2, *o3;
+	double h;
+
+	if (size == 0) return;
+	if (size < DC_ENTROPY_WINDOW) {
+		// a single window, the whole file
+		memset(c0, 0, sizeof(c0));
+		for (k = 0; k < size; k++) c0[data[k]]++;
+		h = log2(size);
+		for (k = 0; k < 256; k++) if (c0[k]) h -= c0[k] * log2(c0[k]) / size;
+		memset(out, h * 32 > 255 ? 255 : (int) (h * 32 + 0.5), size);
+		return;
+	}
+	last = size - DC_ENTROPY_WINDOW;
+	slice = last / 4;
+	d1 = data + slice;
+	d2 = data + 2 * slice;
+	d3 = data + 3 * slice;
+	s0 = entropy_fill(c0, data);
+	s1 = entropy_fill(c1, d1);
+	s2 = entropy_fill(c2, d2);
+	s3 = entropy_fill(c3, d3);
+	memset(out, entropy_value(s0), half + 1);
+	// the window starting at k is the one of byte k + half
+	o0 = out + half;
+	o1 = o0 + slice;
+	o2 = o0 + 2 * slice;
+	o3 = o0 + 3 * slice;
+	for (k = 1; k <= slice; k++) {
+		ENTROPY_SLIDE(c0, s0, data + k);
+		ENTROPY_SLIDE(c1, s1, d1 + k);
+		ENTROPY_SLIDE(c2, s2, d2 + k);
+		ENTROPY_SLIDE(c3, s3, d3 + k);
+		o0[k] = entropy_value(s0);
+		o1[k] = entropy_value(s1);
+		o2[k] = entropy_value(s2);
+		o3[k] = entropy_value(s3);
+	}
+	for (k = 4 * slice + 1; k <= last; k++) {
+		ENTROPY_SLIDE(c3, s3, data + k);
+		out[k + half] = entropy_value(s3);
+	}
+	memset(out + last + half + 1, entropy_value(s3), half - 1);
+}
+
+/* Add the columns of one row of cells to its sums. */
+static void entropy_columns_to_cells (thumbnail_t *thumb, size_t cy, u8 *column, const size_t *col_cell)
+{
+	const u8 mask = (1 << 21) - 1;
+	u8 *row = thumb->sums + cy * thumb->width * 3, *sum;
+	size_t x;
+
+	for (x = 0; x < thumb->full_width; x++) {
+		sum = row + col_cell[x] * 3;
+		sum[0] += column[x] & mask;
+		sum[1] += column[x] >> 21 & mask;
+		sum[2] += column[x] >> 42;
+		column[x] = 0;
+	}
+}
+
+/* The thumbnail of the entropy. Every column of the full-size image is
+ * added up down the rows of a cell in one register of packed colours,
+ * which holds 8192 pixels before a field carries into the next, and the
+ * columns go into the cells once per row of cells. */
+static int thumbnail_add_entropy (thumbnail_t *thumb, const u1 *entropy, size_t size)
+{
+	size_t *col_cell = malloc(thumb->full_width * sizeof(size_t));
+	u8 *column = calloc(thumb->full_width, sizeof(u8));
+	size_t x, n, y = 0, cy = 0, rows = 0;
+	u8 next_row = thumb_row_start(thumb, 1);
+
+	if (col_cell == NULL || column == NULL) {
+		free(col_cell);
+		free(column);
+		return DC_ERR_NOMEM;
+	}
+	memset(thumb->sums, 0, thumb->width * thumb->height * 3 * sizeof(u8));
+	for (x = 0; x < thumb->full_width; x++) col_cell[x] = x * thumb->width / thumb->full_width;
+	for (; size > 0; y++, entropy += n, size -= n) {
+		if (y >= next_row || rows == 8192) {
+			entropy_columns_to_cells(thumb, cy, column, col_cell);
+			rows = 0;
+			while (y >= next_row) next_row = thumb_row_start(thumb, ++cy + 1);
+		}
+		n = size < thumb->full_width ? size : thumb->full_width;
+		for (x = 0; x < n; x++) column[x] += entropy_packed[entropy[x]];
+		rows++;
+	}
+	entropy_columns_to_cells(thumb, cy, column, col_cell);
+	free(col_cell);
+	free(column);
+	return DC_OK;
+}
+
+int dc_render_entropy (dc_context_t *ctx, const u1 *dex, size_t size, bitmap_t *bitmap)
+{
+	phase_t phase;
+	dex_timing_t *timing = ctx->timed ? &ctx->timing : NULL;
+	size_t cells = bitmap->width * bitmap->height;
+	size_t width, height, i, n;
+
+	if (bitmap->pixels == NULL || cells == 0) return DC_ERR_NOMEM;
+	if (ctx->entropy_size < size) {
+		free(ctx->entropy);
+		ctx->entropy = malloc(size);
+		ctx->entropy_size = ctx->entropy ? size : 0;
+		if (ctx->entropy == NULL) return DC_ERR_NOMEM;
+	}
+	dc_image_size(size, &width, &height);
+	if ((bitmap->width != width || bitmap->height != height) && reserve_thumb_sums(ctx, cells) != DC_OK)
+		return DC_ERR_NOMEM;
+
+	dc_phase_begin(timing, NULL, &phase);
+	entropy_bytes(dex, size, ctx->entropy);
+	if (bitmap->width == width && bitmap->height == height) {
+		n = size < cells ? size : cells;
+		for (i = 0; i < n; i++) bitmap->pixels[i] = entropy_ramp[ctx->entropy[i]];
+		memset(bitmap->pixels + n, 0, (cells - n) * sizeof(pixel_t));
+	} else {
+		ctx->thumb.width = bitmap->width;
+		ctx->thumb.height = bitmap->height;
+		ctx->thumb.full_width = width;
+		ctx->thumb.full_height = height;
+		if (thumbnail_add_entropy(&ctx->thumb, ctx->entropy, size) != DC_OK) return DC_ERR_NOMEM;
+		dc_thumbnail_finish(&ctx->thumb, bitmap);
+	}
+	dc_phase_end(timing, NULL, &phase, PHASE_ENTROPY);
+	ctx->timing.items[PHASE_ENTROPY]++;
+	ctx->timing.bytes[PHASE_ENTROPY] += size;
+	return DC_OK;
+}
+
+/* -- layout diff --
+ * Two versions of a dex are compared item by item: every region the walk
+ * emitted is one string_data, code_item, class_data, ... and is identified
+ * by its kind and a hash of its bytes, wherever it sits in the file. The
+ * items of the new side are matched against those of the old one as a
+ * multiset, so an item moved by an insertion in front of it still counts
+ * as the same. Tables of indices (ids, class_defs) change whenever an
+ * entry is added before them and show up as such. */
+
+static u8 hash_bytes(const u1 *ptr, size_t len)
+{
+	u8 hash = 0x9e3779b97f4a7c15ULL ^ len, word;
+
+	for (; len >= 8; ptr += 8, len -= 8) {
+		memcpy(&word, ptr, 8);
+		hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 32;
+	}
+	word = 0;
+	memcpy(&word, ptr, len);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+	return hash ^ hash >> 29;
+}
+
+int dc_hash_items (dc_context_t *ctx, const u1 *dex, dc_item_list_t *items)
+{
+	region_t *region;
+	size_t i;
+	u8 len;
+
+	if (items->size < ctx->regions.count) {
+		free(items->items);
+		items->items = malloc(ctx->regions.count * sizeof(dc_item_t));
+		items->size = items->items ? ctx->regions.count : 0;
+		if (items->items == NULL) return DC_ERR_NOMEM;
+	}
+	for (i = 0; i < ctx->regions.count; i++) {
+		region = ctx->regions.regions + i;
+		// regions may run past the end of a damaged file, the bytes don't
+		len = region->offset >= ctx->file_size ? 0 :
+			region_end(region) > ctx->file_size ? ctx->file_size - region->offset : region->len;
+		items->items[i].hash = hash_bytes(dex + region->offset, len);
+		items->items[i].offset = region->offset;
+		items->items[i].len = region->len;
+		items->items[i].type = region->type;
+	}
+	items->count = ctx->regions.count;
+	items->file_size = ctx->file_size;
+	return DC_OK;
+}
+
+/* Open addressing, kind and length folded into the hash. */
+typedef struct {
+	u8 key;
+	u4 count;
+} item_slot_t;
+
+static u8 item_key(const dc_item_t *item)
+{
+	u8 key = item->hash ^ (item->type * 0x100000001b3ULL) ^ ((u8) item->len << 24);
+
+	return key ? key : 1;
+}
+
+static item_slot_t *item_slot(item_slot_t *table, size_t mask, u8 key)
+{
+	size_t k = (key ^ key >> 31) & mask;
+
+	while (table[k].key != 0 && table[k].key != key) k = (k + 1) & mask;
+	return table + k;
+}
+
+int dc_diff (const dc_item_list_t *a, const dc_item_list_t *b, dc_diff_t *diff)
+{
+	item_slot_t *table, *slot;
+	region_list_t changed = { NULL, 0, 0 }, all = { NULL, 0, 0 };
+	const dc_item_t *item;
+	size_t i, mask = 1;
+	int err;
+
+	while (mask < 2 * a->count + 1) mask <<= 1;
+	table = calloc(mask, sizeof(item_slot_t));
+	if (table == NULL) return DC_ERR_NOMEM;
+	mask--;
+
+	memset(diff->bytes, 0, sizeof(diff->bytes));
+	memset(diff->items, 0, sizeof(diff->items));
+	memset(diff->same, 0, sizeof(diff->same));
+	memset(diff->changed_bytes, 0, sizeof(diff->changed_bytes));
+	memset(diff->removed_bytes, 0, sizeof(diff->removed_bytes));
+	for (i = 0; i < a->count; i++) {
+		item = a->items + i;
+		slot = item_slot(table, mask, item_key(item));
+		slot->key = item_key(item);
+		slot->count++;
+		diff->items[0][item->type]++;
+		diff->bytes[0][item->type] += item->len;
+	}
+	for (i = 0; i < b->count; i++) {
+		item = b->items + i;
+		slot = item_slot(table, mask, item_key(item));
+		diff->items[1][item->type]++;
+		diff->bytes[1][item->type] += item->len;
+		dc_add_region(&all, item->offset, item->len, item->type);
+		if (slot->count > 0) {
+			slot->count--;
+			diff->same[item->type]++;
+		} else {
+			dc_add_region(&changed, item->offset, item->len, item->type);
+			diff->changed_bytes[item->type] += item->len;
+		}
+	}
+	// what is left in the table was not found in b
+	for (i = 0; i < a->count; i++) {
+		item = a->items + i;
+		slot = item_slot(table, mask, item_key(item));
+		if (slot->count > 0) {
+			slot->count--;
+			diff->removed_bytes[item->type] += item->len;
+		}
+	}
+	free(table);
+
+	diff->runs.count = 0;
+	diff->changed.count = 0;
+	err = all.nomem || changed.nomem ? DC_ERR_NOMEM : dc_normalize_regions(&all, &diff->runs);
+	if (err == DC_OK) err = dc_normalize_regions(&changed, &diff->changed);
+	free(all.regions);
+	free(changed.regions);
+	if (err != DC_OK) return err;
+	diff->file_size = b->file_size;
+	dc_image_size(b->file_size, &diff->width, &diff->height);
+	return DC_OK;
+}
+
+static void dim_pixels (pixel_t *pix, u8 count)
+{
+	u8 k;
+
+	for (k = 0; k < count; k++) {
+		pix[k].red >>= 2;
+		pix[k].green >>= 2;
+		pix[k].blue >>= 2;
+	}
+}
+
+int dc_render_diff (dc_diff_t *diff, bitmap_t *bitmap)
+{
+	u8 total = (u8) bitmap->width * bitmap->height, pos = 0, start, end;
+	size_t i;
+
+	if (bitmap->pixels == NULL) return DC_ERR_NOMEM;
+	dc_rasterize_regions(&diff->runs, bitmap);
+	for (i = 0; i < diff->changed.count && pos < total; i++) {
+		start = diff->changed.regions[i].offset < total ? diff->changed.regions[i].offset : total;
+		end = region_end(diff->changed.regions + i) < total ? region_end(diff->changed.regions + i) : total;
+		if (start > pos) dim_pixels(bitmap->pixels + pos, start - pos);
+		pos = end;
+	}
+	if (pos < total) dim_pixels(bitmap->pixels + pos, total - pos);
+	return DC_OK;
+}
+
+void dc_diff_free (dc_diff_t *diff)
+{
+	free(diff->runs.regions);
+	free(diff->changed.regions);
+	memset(diff, 0, sizeof(*diff));
+}
+
+void dc_print_diff (FILE *fp, dc_diff_t *diff)
+{
+	u8 totals[7] = { 0 };
+	int r;
+
+	fprintf(fp, "region,items_old,items_new,same,bytes_old,bytes_new,delta,changed_bytes,removed_bytes\n");
+	for (r = 1; r < REGION_COUNT; r++) {
+		if (diff->items[0][r] == 0 && diff->items[1][r] == 0) continue;
+		fprintf(fp, "%s,%u,%u,%u,%llu,%llu,%lld,%llu,%llu\n", dc_region_info[r].name,
+			diff->items[0][r], diff->items[1][r], diff->same[r],
+			(unsigned long long) diff->bytes[0][r], (unsigned long long) diff->bytes[1][r],
+			(long long) (diff->bytes[1][r] - diff->bytes[0][r]),
+			(unsigned long long) diff->changed_bytes[r], (unsigned long long) diff->removed_bytes[r]);
+		totals[0] += diff->items[0][r];
+		totals[1] += diff->items[1][r];
+		totals[2] += diff->same[r];
+		totals[3] += diff->bytes[0][r];
+		totals[4] += diff->bytes[1][r];
+		totals[5] += diff->changed_bytes[r];
+		totals[6] += diff->removed_bytes[r];
+	}
+	fprintf(fp, "total,%llu,%llu,%llu,%llu,%llu,%lld,%llu,%llu\n",
+		(unsigned long long) totals[0], (unsigned long long) totals[1], (unsigned long long) totals[2],
+		(unsigned long long) totals[3], (unsigned long long) totals[4], (long long) (totals[4] - totals[3]),
+		(unsigned long long) totals[5], (unsigned long long) totals[6]);
+}
+
+/* -- aggregate layout --
+ * Every dex goes on the same grid by relative position: cell c of the
+ * width x height cells, in rows, covers the fraction [c, c + 1) / cells of
+ * the file. Each cell is sampled DC_AGGREGATE_SAMPLES times at evenly
+ * spaced offsets, sample j of the total at floor((2j + 1) * size / (2 *
+ * total)), so a 60 MB dex weighs the same as a 60 kB one. A run adds its
+ * samples a cell at a time, the cost is in runs and cells, not samples. */
+
+/* The first sample at or past offset. */
+static u8 first_sample(u8 offset, u8 size, u8 total)
+{
+	u8 twice = 2 * offset * total;
+
+	if (twice <= size) return 0;
+	return (twice - size + 2 * size - 1) / (2 * size);
+}
+
+static void add_samples(dc_aggregate_t *agg, u1 type, u8 from, u8 to)
+{
+	u8 cell, end;
+
+	while (from < to) {
+		cell = from / DC_AGGREGATE_SAMPLES;
+		end = (cell + 1) * DC_AGGREGATE_SAMPLES;
+		if (end > to) end = to;
+		agg->counts[cell * REGION_COUNT + type] += end - from;
+		from = end;
+	}
+}
+
+int dc_aggregate_init (dc_aggregate_t *agg, size_t width, size_t height)
+{
+	memset(agg, 0, sizeof(*agg));
+	if (width == 0 || height == 0 || width > DC_AGGREGATE_MAX || height > DC_AGGREGATE_MAX)
+		return DC_ERR_SIZE;
+	agg->counts = calloc(width * height * REGION_COUNT, sizeof(u4));
+	if (agg->counts == NULL) return DC_ERR_NOMEM;
+	agg->width = width;
+	agg->height = height;
+	return DC_OK;
+}
+
+void dc_aggregate_free (dc_aggregate_t *agg)
+{
+	free(agg->counts);
+	memset(agg, 0, sizeof(*agg));
+}
+
+void dc_aggregate_add (dc_aggregate_t *agg, const region_list_t *runs, u4 file_size)
+{
+	u8 total = (u8) agg->width * agg->height * DC_AGGREGATE_SAMPLES;
+	u8 done = 0, from, to;
+	const region_t *run;
+	size_t i;
+
+	if (file_size == 0) return;
+	for (i = 0; i < runs->count && done < total; i++) {
+		run = runs->regions + i;
+		from = first_sample(run->offset, file_size, total);
+		to = first_sample((u8) run->offset + run->len, file_size, total);
+		if (from > total) from = total;
+		if (to > total) to = total;
+		// gaps between the runs are none
+		if (from > done) add_samples(agg, REGION_NONE, done, from);
+		else from = done;
+		add_samples(agg, run->type, from, to);
+		if (to > done) done = to;
+	}
+	add_samples(agg, REGION_NONE, done, total);
+	agg->files++;
+}
+
+void dc_aggregate_merge (dc_aggregate_t *total, const dc_aggregate_t *part)
+{
+	size_t i, n = total->width * total->height * REGION_COUNT;
+
+	for (i = 0; i < n; i++) total->counts[i] += part->counts[i];
+	total->files += part->files;
+}
+
+int dc_render_aggregate (const dc_aggregate_t *agg, bitmap_t *bitmap)
+{
+	u8 samples = agg->files * DC_AGGREGATE_SAMPLES, red, green, blue;
+	const u4 *counts;
+	size_t cell;
+	int r;
+
+	if (bitmap->width != agg->width || bitmap->height != agg->height) return DC_ERR_SIZE;
+	for (cell = 0; cell < agg->width * agg->height; cell++) {
+		counts = agg->counts + cell * REGION_COUNT;
+		red = green = blue = samples / 2;
+		for (r = 0; r < REGION_COUNT; r++) {
+			red += (u8) counts[r] * dc_region_info[r].red;
+			green += (u8) counts[r] * dc_region_info[r].green;
+			blue += (u8) counts[r] * dc_region_info[r].blue;
+		}
+		bitmap->pixels[cell].red = samples ? red / samples : 0;
+		bitmap->pixels[cell].green = samples ? green / samples : 0;
+		bitmap->pixels[cell].blue = samples ? blue / samples : 0;
+	}
+	return DC_OK;
+}
+
+int dc_save_aggregate_to_file (const dc_aggregate_t *agg, const char *path)
+{
+	const u4 *counts;
+	size_t x, y;
+	FILE *fp;
+	int r;
+
+	fp = fopen(path, "w");
+	if (! fp) return DC_ERR_IO;
+	fprintf(fp, "x,y,samples");
+	for (r = 0; r < REGION_COUNT; r++) fprintf(fp, ",%s", dc_region_info[r].name);
+	fprintf(fp, "\n");
+	for (y = 0; y < agg->height; y++)
+		for (x = 0; x < agg->width; x++) {
+			counts = agg->counts + (y * agg->width + x) * REGION_COUNT;
+			fprintf(fp, "%zu,%zu,%llu", x, y, (unsigned long long) agg->files * DC_AGGREGATE_SAMPLES);
+			for (r = 0; r < REGION_COUNT; r++) fprintf(fp, ",%u", counts[r]);
+			fprintf(fp, "\n");
+		}
+	return fclose(fp) == 0 ? DC_OK : DC_ERR_IO;
+}
+
+/* -- feature vector -- */
+
+void dc_print_features_header (FILE *fp)
+{
+	int r, b;
+
+	fprintf(fp, "file,file_size");
+	for (r = 0; r < REGION_COUNT; r++) fprintf(fp, ",bytes_%s", dc_region_info[r].name);
+	for (r = 0; r < REGION_COUNT; r++) fprintf(fp, ",frac_%s", dc_region_info[r].name);
+	fprintf(fp, ",strings,proto_parameters,classes,interfaces,annotations,class_data,static_values"
+		",fields,direct_methods,virtual_methods,code_items,methods_with_tries,try_items,debug_infos"
+		",insns_units,avg_insns_size");
+	for (b = 0; b < HIST_BUCKETS; b++) fprintf(fp, ",insns_hist_%d", b);
+	for (b = 0; b < HIST_BUCKETS; b++) fprintf(fp, ",string_hist_%d", b);
+	fprintf(fp, ",dup_code_items,dup_debug_infos,dup_class_data,dup_interfaces,dup_annotations"
+		",dup_static_values");
+	fprintf(fp, "\n");
+}
+
+/* One CSV line per file, built in memory first so lines written by batch
+ * workers never interleave. Region bytes are counted on the normalized
+ * runs inside the file, "none" is whatever no structure claimed. */
+void dc_print_features (FILE *fp, const char *dexfile, u4 file_size, region_list_t *runs, dex_stats_t *stats)
+{
+	u8 bytes[REGION_COUNT];
+	u8 covered = 0, end;
+	char *line;
+	size_t len;
+	FILE *mem;
+	size_t i;
+	int r, b;
+
+	memset(bytes, 0, sizeof(bytes));
+	for (i = 0; i < runs->count && runs->regions[i].offset < file_size; i++) {
+		end = region_end(runs->regions + i) < file_size ? region_end(runs->regions + i) : file_size;
+		bytes[runs->regions[i].type] += end - runs->regions[i].offset;
+		covered += end - runs->regions[i].offset;
+	}
+	bytes[REGION_NONE] += file_size - covered;
+
+	mem = open_memstream(&line, &len);
+	fprintf(mem, "%s,%u", dexfile, file_size);
+	for (r = 0; r < REGION_COUNT; r++) fprintf(mem, ",%llu", (unsigned long long) bytes[r]);
+	for (r = 0; r < REGION_COUNT; r++) fprintf(mem, ",%.5f", file_size ? (double) bytes[r] / file_size : 0.0);
+	fprintf(mem, ",%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%llu,%.2f",
+		stats->strings, stats->proto_parameters, stats->classes, stats->interfaces,
+		stats->annotations, stats->class_data, stats->static_values, stats->fields,
+		stats->direct_methods, stats->virtual_methods, stats->code_items,
+		stats->methods_with_tries, stats->try_items, stats->debug_infos,
+		(unsigned long long) stats->insns_units,
+		stats->code_items ? (double) stats->insns_units / stats->code_items : 0.0);
+	for (b = 0; b < HIST_BUCKETS; b++) fprintf(mem, ",%u", stats->insns_hist[b]);
+	for (b = 0; b < HIST_BUCKETS; b++) fprintf(mem, ",%u", stats->string_hist[b]);
+	fprintf(mem, ",%u,%u,%u,%u,%u,%u", stats->dup_code_items, stats->dup_debug_infos,
+		stats->dup_class_data, stats->dup_interfaces, stats->dup_annotations, stats->dup_static_values);
+	fprintf(mem, "\n");
+	fclose(mem);
+
+	fputs(line, fp);
+	free(line);
+}
+
+int dc_save_regions_to_file (region_list_t *runs, const char *path)
+{
+	FILE * fp;
+	size_t i;
+
+	fp = fopen (path, "w");
+	if (! fp) return DC_ERR_IO;
+	fprintf(fp, "offset,length,region\n");
+	for (i = 0; i < runs->count; i++)
+		fprintf(fp, "%u,%u,%s\n", runs->regions[i].offset, runs->regions[i].len,
+			dc_region_info[runs->regions[i].type].name);
+	return fclose (fp) == 0 ? DC_OK : DC_ERR_IO;
+}
+
+int dc_save_ppm_to_file (bitmap_t *bitmap, const char *path)
+{
+	FILE * fp;
+	size_t written;
+
+	fp = fopen (path, "wb");
+	if (! fp) return DC_ERR_IO;
+    
+  (void) fprintf(fp, "P6\n%zu %zu\n255\n", bitmap->width,bitmap->height);
+  written = fwrite(bitmap->pixels, sizeof(pixel_t), bitmap->width*bitmap->height, fp);
+ 
+  if (fclose (fp) != 0 || written != bitmap->width*bitmap->height) return DC_ERR_IO;
+ 
+  return DC_OK;
+	}
+
+/* PNG output. Rows are handed to libpng as they are produced: from the
+ * bitmap when there is one (thumbnails), otherwise rasterized straight from
+ * the runs into a single row buffer, so the full-size image never exists
+ * in memory. The images are long flat runs of a few colours, a 3 byte
+ * pattern that plain LZ77 matches at distance 3 without any filtering.
+ * Unfiltered rows at level 3 came out both smaller and faster than SUB,
+ * Z_RLE (which only sees distance 1) or level 1, and 40x smaller than
+ * the .ppn; higher levels double the time for little gain. */
+#define PNG_ROWS_PER_WRITE 64
+
+int dc_save_png_to_stream (bitmap_t *bitmap, region_list_t *runs, FILE *fp)
+{
+	png_structp png;
+	png_infop info;
+	png_bytep rows[PNG_ROWS_PER_WRITE];
+	pixel_t * volatile block = NULL;   // freed after a longjmp
+	size_t next = 0, y, k, n;
+
+	if (bitmap->pixels == NULL) {
+		block = malloc(PNG_ROWS_PER_WRITE * bitmap->width * sizeof(pixel_t));
+		if (block == NULL) return DC_ERR_NOMEM;
+	}
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png ? png_create_info_struct(png) : NULL;
+	if (info == NULL) {
+		png_destroy_write_struct(&png, NULL);
+		free(block);
+		return DC_ERR_NOMEM;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		free(block);
+		return DC_ERR_IO;
+	}
+
+	png_init_io(png, fp);
+	png_set_IHDR(png, info, bitmap->width, bitmap->height, 8, PNG_COLOR_TYPE_RGB,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+	png_set_compression_level(png, 3);
+	png_write_info(png, info);
+
+	for (y = 0; y < bitmap->height; y += n) {
+		n = bitmap->height - y < PNG_ROWS_PER_WRITE ? bitmap->height - y : PNG_ROWS_PER_WRITE;
+		if (block != NULL)
+			dc_rasterize_span(runs, &next, block, (u8) y * bitmap->width, (u8) n * bitmap->width);
+		for (k = 0; k < n; k++)
+			rows[k] = (png_bytep) (block != NULL ? block + k * bitmap->width
+				: bitmap->pixels + (y + k) * bitmap->width);
+		png_write_rows(png, rows, n);
+	}
+
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+	free(block);
+	return DC_OK;
+}
+
+int dc_save_png_to_file (bitmap_t *bitmap, region_list_t *runs, const char *path)
+{
+	FILE *fp;
+	int err;
+
+	fp = fopen (path, "wb");
+	if (! fp) return DC_ERR_IO;
+	err = dc_save_png_to_stream(bitmap, runs, fp);
+	if (fclose(fp) != 0 && err == DC_OK) err = DC_ERR_IO;
+	return err;
+}
+
+/* Deep Zoom output, for viewers that load the visible tiles only. path is
+ * the .dzi descriptor, the tiles go to <path without .dzi>_files/<level>/
+ * <column>_<row>.png. A solid tile is encoded the first time its colour
+ * and size come up and hard linked after that: long runs of string data or
+ * code make most tiles of the finer levels solid. The descriptor is written
+ * last, so a pyramid with one is complete. */
+typedef struct {
+	pixel_t colour;
+	size_t width;
+	size_t height;
+	char *path;
+} solid_tile_t;
+
+int dc_save_dzi_to_file (dc_context_t *ctx, const char *path)
+{
+	int levels = dc_zoom_levels(ctx->width, ctx->height);
+	size_t base = strlen(path), scale, columns, rows, tx, ty, k, nsolid = 0;
+	char *dir, *tile;
+	solid_tile_t *solids = NULL, *found, *grown;
+	bitmap_t bitmap;
+	int level, solid, err = DC_OK;
+	FILE *fp;
+
+	if (base > 4 && strcmp(path + base - 4, ".dzi") == 0) base -= 4;
+	dir = malloc(base + 16);
+	tile = malloc(base + 96);
+	bitmap.pixels = malloc(DZI_TILE_SIZE * DZI_TILE_SIZE * sizeof(pixel_t));
+	if (dir == NULL || tile == NULL || bitmap.pixels == NULL) err = DC_ERR_NOMEM;
+	else {
+		sprintf(dir, "%.*s_files", (int) base, path);
+		if (mkdir(dir, 0777) != 0 && errno != EEXIST) err = DC_ERR_IO;
+	}
+
+	for (level = 0; level < levels && err == DC_OK; level++) {
+		scale = (size_t) 1 << (levels - 1 - level);
+		columns = ((ctx->width + scale - 1) / scale + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+		rows = ((ctx->height + scale - 1) / scale + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+		sprintf(tile, "%s/%d", dir, level);
+		if (mkdir(tile, 0777) != 0 && errno != EEXIST) err = DC_ERR_IO;
+		for (ty = 0; ty < rows && err == DC_OK; ty++) {
+			for (tx = 0; tx < columns && err == DC_OK; tx++) {
+				err = dc_render_tile(ctx, level, tx, ty, DZI_TILE_SIZE, &bitmap, &solid);
+				if (err != DC_OK) break;
+				sprintf(tile, "%s/%d/%zu_%zu.png", dir, level, tx, ty);
+				// a tile of an older pyramid may be linked to others
+				unlink(tile);
+				found = NULL;
+				for (k = 0; solid && k < nsolid; k++)
+					if (solids[k].width == bitmap.width && solids[k].height == bitmap.height &&
+					    memcmp(&solids[k].colour, bitmap.pixels, sizeof(pixel_t)) == 0)
+						found = solids + k;
+				if (found != NULL && link(found->path, tile) == 0) continue;
+				err = dc_save_png_to_file(&bitmap, NULL, tile);
+				if (err == DC_OK && solid && found == NULL) {
+					// without room the tile is just not shared
+					grown = realloc(solids, (nsolid + 1) * sizeof(solid_tile_t));
+					if (grown == NULL) continue;
+					solids = grown;
+					solids[nsolid].colour = bitmap.pixels[0];
+					solids[nsolid].width = bitmap.width;
+					solids[nsolid].height = bitmap.height;
+					solids[nsolid++].path = strdup(tile);
+				}
+			}
+		}
+	}
+
+	if (err == DC_OK) {
+		fp = fopen(path, "w");
+		if (fp == NULL) err = DC_ERR_IO;
+		else {
+			fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+				"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"0\" TileSize=\"%d\">\n"
+				"  <Size Width=\"%zu\" Height=\"%zu\"/>\n"
+				"</Image>\n", DZI_TILE_SIZE, ctx->width, ctx->height);
+			if (fclose(fp) != 0) err = DC_ERR_IO;
+		}
+	}
+	for (k = 0; k < nsolid; k++) free(solids[k].path);
+	free(solids);
+	free(bitmap.pixels);
+	free(dir);
+	free(tile);
+	return err;
+}
+
+/* Offsets of the shared items a -P worker walked first. */
+typedef struct {
+	u4 *offsets;
+	size_t count;
+	size_t size;
+	int nomem;  // a claim was lost, the slice can't be merged
+} claim_list_t;
+
+/* What the walk over one .dex needs: the bytes, where they end, and where
+ * regions and counters go. */
+typedef struct {
+	u1 *file;
+	u1 *end;
+	region_list_t *regions;
+	dex_stats_t *stats;
+	dex_timing_t *timing;   // NULL unless timed
+	u4 warnings;
+	u1 *visited;            // one bit per byte offset of the file
+	int threads;            // -P, slices walked side by side
+	int opcodes;            // paint insns instruction by instruction
+	claim_list_t *claims;   // NULL unless walking a -P slice
+	u4 strings;             // entries of string_ids, proto_ids and class_defs
+	u4 protos;              // that lie inside the file, see check_tables
+	u4 classes;
+} dex_parse_t;
+
+/* Data items can be shared: optimizers and obfuscators point many methods
+ * at one code_item or debug_info, many classes at one interfaces list or
+ * annotations directory. Each is walked and painted the first time it is
+ * reached only, in the colour of its first user. Offsets past the end are
+ * left to the walkers. */
+static inline int first_visit(dex_parse_t *dex, u4 offset)
+{
+	u1 *byte, bit;
+
+	if (offset >= dex->end - dex->file) return 1;
+	byte = dex->visited + (offset >> 3);
+	bit = 1 << (offset & 7);
+	if (*byte & bit) return 0;
+	*byte |= bit;
+	if (dex->claims != NULL) {
+		claim_list_t *claims = dex->claims;
+		u4 *offsets;
+		if (claims->count == claims->size) {
+			offsets = realloc(claims->offsets, (claims->size ? claims->size * 2 : 4096) * sizeof(u4));
+			if (offsets == NULL) {
+				claims->nomem = 1;
+				return 1;
+			}
+			claims->offsets = offsets;
+			claims->size = claims->size ? claims->size * 2 : 4096;
+		}
+		claims->offsets[claims->count++] = offset;
+	}
+	return 1;
+}
+
+/* Whether len bytes at offset lie inside the file. The walk reads nothing
+ * it reached through an offset from the file before checking it here, or
+ * against dex->end in the LEB128 readers. */
+static inline int fits(dex_parse_t *dex, u4 offset, u8 len)
+{
+	return (u8) offset + len <= (u8) (dex->end - dex->file);
+}
+
+/* A u4 at offset, which may be unaligned on a damaged file. */
+static inline u4 read_u4(dex_parse_t *dex, u4 offset)
+{
+	u4 value;
+
+	memcpy(&value, dex->file + offset, sizeof(u4));
+	return value;
+}
+
+/* Both are no-ops when timing is off. With a region list, dc_phase_end also
+ * charges the regions emitted since dc_phase_begin to the phase. */
+void dc_phase_begin(dex_timing_t *timing, region_list_t *regions, phase_t *phase)
+{
+	if (timing == NULL) return;
+	phase->first_region = regions ? regions->count : 0;
+	phase->start = now_seconds();
+}
+
+void dc_phase_end(dex_timing_t *timing, region_list_t *regions, phase_t *phase, int id)
+{
+	size_t i;
+
+	if (timing == NULL) return;
+	timing->seconds[id] += now_seconds() - phase->start;
+	if (regions == NULL) return;
+	for (i = phase->first_region; i < regions->count; i++)
+		timing->bytes[id] += regions->regions[i].len;
+	timing->items[id] += regions->count - phase->first_region;
+}
+
+/* The oddities both walks tolerate, into dex->warnings. */
+static void check_header(dex_parse_t *dex)
+{
+	dex_header *header = (dex_header *) dex->file;
+
+	if (strncmp(header->magic.ver,"035",3) != 0) {
+		dex->warnings |= DC_WARN_VERSION;
+	}
+	if (*header->header_size != 0x70) {
+		dex->warnings |= DC_WARN_HEADER_SIZE;
+	}
+	if (*header->endian_tag != 0x12345678) {
+		dex->warnings |= DC_WARN_ENDIAN;
+	}
+	if (*header->map_off != 0 && *header->map_off < *header->data_off) {
+		dex->warnings |= DC_WARN_MAP_OFFSET;
+	}
+}
+
+/* The id tables the walk goes through entry by entry are checked against
+ * the file once, here, rather than entry by entry: the walk takes as many
+ * entries as fit and counts a table cut short as truncated. */
+static u4 table_entries(dex_parse_t *dex, u4 offset, u4 count, u4 entry_size)
+{
+	u4 size = dex->end - dex->file;
+
+	if (fits(dex, offset, (u8) count * entry_size)) return count;
+	dex->stats->truncated++;
+	return offset < size ? (size - offset) / entry_size : 0;
+}
+
+static void check_tables(dex_parse_t *dex)
+{
+	dex_header *header = (dex_header *) dex->file;
+
+	dex->strings = table_entries(dex, *header->string_ids_off, *header->string_ids_size, sizeof(string_id_struct));
+	dex->protos = table_entries(dex, *header->proto_ids_off, *header->proto_ids_size, sizeof(proto_id_struct));
+	dex->classes = table_entries(dex, *header->class_defs_off, *header->class_defs_size, sizeof(class_def_struct));
+}
+
+static u4 readUnsignedLeb128Slow(u1 **pStream, const u1 *limit, int *okay)
+{
+	u1 *ptr = *pStream;
+	u4 result = 0;
+	int shift = 0;
+	u1 cur;
+
+	do {
+		if (ptr >= limit) {
+			*okay = 0;
+			break;
+		}
+		cur = *(ptr++);
+		if (shift < 32) result |= (u4) (cur & 0x7f) << shift;
+		shift += 7;
+	} while (cur > 0x7f && shift < 35);
+
+	*pStream = ptr;
+	return result;
+}
+
+/* Decode one unsigned LEB128 of at most five bytes, unchecked: the caller
+ * makes sure five bytes are left. Like dalvik's libdex/Leb128.h, garbage
+ * in the high four bits of the fifth byte is tolerated. */
+static inline u4 decodeUnsignedLeb128(u1 **pStream)
+{
+    u1* ptr = *pStream;
+    u4 result = *(ptr++), cur;
+
+    if (result > 0x7f) {
+        cur = *(ptr++);
+        result = (result & 0x7f) | ((cur & 0x7f) << 7);
+        if (cur > 0x7f) {
+            cur = *(ptr++);
+            result |= (cur & 0x7f) << 14;
+            if (cur > 0x7f) {
+                cur = *(ptr++);
+                result |= (cur & 0x7f) << 21;
+                if (cur > 0x7f) {
+                    cur = *(ptr++);
+                    result |= cur << 28;
+                }
+            }
+        }
+    }
+
+    *pStream = ptr;
+    return result;
+}
+
+/* The same without the value, unchecked as well. */
+static inline u1 *skipLeb128(u1 *ptr)
+{
+	if (*(ptr++) <= 0x7f) return ptr;
+	if (*(ptr++) <= 0x7f) return ptr;
+	if (*(ptr++) <= 0x7f) return ptr;
+	if (*(ptr++) <= 0x7f) return ptr;
+	return ptr + 1;
+}
+
+/* Decode one unsigned LEB128 and move *pStream past it, never reading at or
+ * past limit. A value cut short by limit clears *okay, which is never set
+ * again, so callers can test it once after a batch of reads. A value ends
+ * after five bytes whatever their top bits. */
+static inline u4 readUnsignedLeb128(u1 **pStream, const u1 *limit, int *okay)
+{
+	if (limit - *pStream < 5) return readUnsignedLeb128Slow(pStream, limit, okay);
+	return decodeUnsignedLeb128(pStream);
+}
+
+/* Skip count LEB128 values without decoding them, for the field lists and
+ * the parts of method entries nobody looks at. Long lists are counted
+ * eight bytes at a time with a popcount of the bytes with the top bit
+ * clear, which end a value, until a run of five continuation bytes would
+ * make that differ from readUnsignedLeb128. Short ones go a value at a
+ * time, unchecked only when there is room for count of the longest
+ * encodings. */
+static void skipUnsignedLeb128(u1 **pStream, const u1 *limit, u8 count, int *okay)
+{
+	const u8 high = 0x8080808080808080ULL;
+	u1 *ptr = *pStream;
+	u8 word, more, ends;
+	unsigned n, carry = 0;   // continuation bytes at the end of the last word
+
+	while (count >= 8 && limit - ptr >= 8) {
+		memcpy(&word, ptr, sizeof(word));
+		more = word & high;
+		ends = ~word & high;
+		// a value of more than five bytes, the rest of the list goes by value
+		if (carry + __builtin_ctzll(ends | 1ULL << 63) / 8 >= 5 ||
+		    (more & more << 8 & more << 16 & more << 24 & more << 32))
+			break;
+		n = __builtin_popcountll(ends);
+		if (n < count) {
+			count -= n;
+			carry = __builtin_clzll(ends) / 8;
+			ptr += 8;
+			continue;
+		}
+		// the last value ends inside this word, drop the terminators before it
+		while (--count > 0) ends &= ends - 1;
+		ptr += __builtin_ctzll(ends) / 8 + 1;
+		*pStream = ptr;
+		return;
+	}
+	// back to the start of the value the last word ended in
+	ptr -= carry;
+	if ((u8) (limit - ptr) / 5 >= count) {
+		for (; count > 0; count--) ptr = skipLeb128(ptr);
+		*pStream = ptr;
+		return;
+	}
+	for (; count > 0; count--) {
+		n = 0;
+		do {
+			if (ptr >= limit) {
+				*okay = 0;
+				*pStream = ptr;
+				return;
+			}
+		} while (*(ptr++) > 0x7f && ++n < 5);
+	}
+	*pStream = ptr;
+}
+
+/* The code_off of one encoded_method, past its method_idx_diff and
+ * access_flags. With room for the three longest encodings the entry takes
+ * one bounds check instead of one per value. */
+static inline u4 readMethodCodeOff(u1 **pStream, const u1 *limit, int *okay)
+{
+	u1 *ptr = *pStream;
+
+	if (limit - ptr < 15) {
+		skipUnsignedLeb128(pStream, limit, 2, okay);
+		return readUnsignedLeb128(pStream, limit, okay);
+	}
+	ptr = skipLeb128(skipLeb128(ptr));
+	*pStream = ptr;
+	return decodeUnsignedLeb128(pStream);
+}
+
+/* Signed LEB128, for the handler counts of encoded_catch_handler: the
+ * unsigned decode, sign extended from the last bit it read. */
+static int32_t readSignedLeb128(u1 **pStream, const u1 *limit, int *okay)
+{
+	u1 *start = *pStream;
+	u4 result = readUnsignedLeb128(pStream, limit, okay);
+	int bits = (*pStream - start) * 7;
+
+	if (bits > 0 && bits < 32 && (result & (1u << (bits - 1)))) result |= ~0u << bits;
+	return (int32_t) result;
+}
+
+
+static void ColorStrings(dex_parse_t *dex, u4 offset, u1 order)
+{
+	region_list_t *regions = dex->regions;
+	dex_stats_t *stats = dex->stats;
+	int okay = 1;
+	u1 *ptr;
+	u4 result;
+	u1 size;
+
+	if (!fits(dex, offset, 1)) {
+		stats->truncated++;
+		return;
+	}
+	ptr = dex->file + offset;
+	result = readUnsignedLeb128(&ptr, dex->end, &okay);
+	size = ptr - (dex->file + offset);
+
+    dc_add_region ( regions,offset, size , REGION_STRING_SIZE);  // string_ids  -- red
+    dc_add_region ( regions,offset + size, result , order ? REGION_STRING_DATA_ORDERED : REGION_STRING_DATA);  // string_ids  -- darkgreen
+    stats->strings++;
+    hist_add(stats->string_hist, result);
+    if (!okay) stats->truncated++;
+}
+
+
+/* -O: Dalvik instructions. The width in 16-bit code units of every opcode,
+ * from its format, and the region it is painted as. */
+static const u1 op_units[256] = {
+	[0x00 ... 0x01] = 1, [0x02] = 2, [0x03] = 3, [0x04] = 1, [0x05] = 2, [0x06] = 3,
+	[0x07] = 1, [0x08] = 2, [0x09] = 3, [0x0a ... 0x12] = 1, [0x13] = 2, [0x14] = 3,
+	[0x15 ... 0x16] = 2, [0x17] = 3, [0x18] = 5, [0x19 ... 0x1a] = 2, [0x1b] = 3,
+	[0x1c] = 2, [0x1d ... 0x1e] = 1, [0x1f ... 0x20] = 2, [0x21] = 1, [0x22 ... 0x23] = 2,
+	[0x24 ... 0x26] = 3, [0x27 ... 0x28] = 1, [0x29] = 2, [0x2a ... 0x2c] = 3,
+	[0x2d ... 0x3d] = 2, [0x3e ... 0x43] = 1, [0x44 ... 0x6d] = 2, [0x6e ... 0x72] = 3,
+	[0x73] = 1, [0x74 ... 0x78] = 3, [0x79 ... 0x8f] = 1, [0x90 ... 0xaf] = 2,
+	[0xb0 ... 0xcf] = 1, [0xd0 ... 0xe2] = 2, [0xe3 ... 0xf9] = 1, [0xfa ... 0xfb] = 4,
+	[0xfc ... 0xfd] = 3, [0xfe ... 0xff] = 2,
+};
+
+static const u1 op_region[256] = {
+	[0x00] = REGION_OP_OTHER,
+	[0x01 ... 0x0d] = REGION_OP_MOVE,
+	[0x0e ... 0x11] = REGION_OP_RETURN,
+	[0x12 ... 0x19] = REGION_OP_CONST,
+	[0x1a ... 0x1b] = REGION_OP_CONST_STRING,
+	[0x1c] = REGION_OP_CONST,
+	[0x1d ... 0x27] = REGION_OP_OBJECT,
+	[0x28 ... 0x3d] = REGION_OP_BRANCH,
+	[0x3e ... 0x43] = REGION_OP_OTHER,
+	[0x44 ... 0x51] = REGION_OP_ARRAY,
+	[0x52 ... 0x6d] = REGION_OP_FIELD,
+	[0x6e ... 0x72] = REGION_OP_INVOKE,
+	[0x73] = REGION_OP_OTHER,
+	[0x74 ... 0x78] = REGION_OP_INVOKE,
+	[0x79 ... 0x7a] = REGION_OP_OTHER,
+	[0x7b ... 0xe2] = REGION_OP_ARITH,
+	[0xe3 ... 0xf9] = REGION_OP_OTHER,
+	[0xfa ... 0xfd] = REGION_OP_INVOKE,
+	[0xfe ... 0xff] = REGION_OP_CONST,
+};
+
+/* Code units of the payload pseudo-instruction at code, whose first unit
+ * is its ident (0x0100, 0x0200 or 0x0300), or 0 for any other nop. */
+static u8 payload_units(const u1 *code, u4 left)
+{
+	u2 size = left >= 2 ? code[2] | code[3] << 8 : 0;
+
+	switch (code[1]) {
+	case 1:   // packed-switch: size, first_key, targets[size]
+		return (u8) size * 2 + 4;
+	case 2:   // sparse-switch: size, keys[size], targets[size]
+		return (u8) size * 4 + 2;
+	case 3:   // fill-array-data: element_width, size, data
+		if (left < 4) return left;
+		return ((u8) size * (code[4] | code[5] << 8 | code[6] << 16 | (u4) code[7] << 24) + 1) / 2 + 4;
+	}
+	return 0;
+}
+
+/* The insns of a code_item, units code units at offset, one region per
+ * run of instructions of the same kind. The tables leave one branch on
+ * the data besides the runs, for the payloads after the code of a method. */
+static void paint_insns(dex_parse_t *dex, u4 offset, u4 units)
+{
+	const u1 *code = dex->file + offset;
+	u8 pc = 0, start = 0, next;
+	u4 count = 0;
+	u1 op, type, run;
+
+	if (units == 0) return;
+	run = op_region[code[0]];
+	while (pc < units) {
+		op = code[pc * 2];
+		next = pc + op_units[op];
+		type = op_region[op];
+		if (op == 0 && code[pc * 2 + 1] != 0) {
+			next = pc + payload_units(code + pc * 2, units - pc);
+			if (next > pc) type = REGION_OP_PAYLOAD;
+			else next = pc + 1;
+		}
+		if (type != run) {
+			dc_add_region(dex->regions, offset + start * 2, (pc - start) * 2, run);
+			run = type;
+			start = pc;
+		}
+		pc = next;
+		count++;
+	}
+	// the last one may claim more units than insns_size has
+	dc_add_region(dex->regions, offset + start * 2, (units - start) * 2, run);
+	dex->stats->instructions += count;
+}
+
+/* Step over an encoded_catch_handler_list, counting the handlers. */
+static int skip_catch_handlers(u1 **ptr, const u1 *end, u4 *handlers)
+{
+	int okay = 1;
+	int32_t size;
+	u4 count, i;
+
+	count = readUnsignedLeb128(ptr, end, &okay);
+	for (i = 0; i < count && okay; i++) {
+		// size pairs of type_idx, addr, and catch_all_addr if size <= 0
+		size = readSignedLeb128(ptr, end, &okay);
+		skipUnsignedLeb128(ptr, end, size < 0 ? -(u8) size * 2 + 1 : (u8) size * 2 + (size == 0), &okay);
+	}
+	*handlers = i;
+	return okay;
+}
+
+/* -O: a code_item where it really lies, the header, the instructions, the
+ * tries after the padding and the encoded_catch_handler_list. */
+static void paint_code_item(dex_parse_t *dex, u4 code_off, int virtual)
+{
+	code_item_struct *code_item = (code_item_struct *) (dex->file + code_off);
+	u4 insns = code_off + sizeof(*code_item);
+	u4 tries, handlers;
+	u1 *ptr, *start;
+
+	dc_add_region(dex->regions, code_off, sizeof(*code_item), virtual ? REGION_VIRTUAL_CODE_HEAD : REGION_DIRECT_CODE_HEAD);
+	if (!fits(dex, insns, (u8) *code_item->insns_size * sizeof(u2))) {
+		dex->stats->truncated++;
+		return;
+	}
+	paint_insns(dex, insns, *code_item->insns_size);
+	if (*code_item->tries_size == 0) return;
+
+	tries = insns + *code_item->insns_size * sizeof(u2) + (*code_item->insns_size % 2) * sizeof(u2);
+	if (!fits(dex, tries, (u8) *code_item->tries_size * sizeof(try_item_struct) + 1)) {
+		dex->stats->truncated++;
+		return;
+	}
+	dc_add_region(dex->regions, tries, *code_item->tries_size * sizeof(try_item_struct), REGION_TRIES);
+	ptr = start = dex->file + tries + *code_item->tries_size * sizeof(try_item_struct);
+	if (!skip_catch_handlers(&ptr, dex->end, &handlers)) dex->stats->truncated++;
+	dc_add_region(dex->regions, start - dex->file, ptr - start, REGION_HANDLERS);
+	dex->stats->catch_handlers += handlers;
+}
+
+/* Follow one method's code_off: the code_item header, insns, tries and the
+ * head of its debug_info. */
+static void Analize_code_item(dex_parse_t *dex, u4 code_off, int *padding, int virtual)
+{
+	region_list_t *regions = dex->regions;
+	dex_stats_t *stats = dex->stats;
+	u1 *file = dex->file;
+	code_item_struct* code_item;
+
+	if (!fits(dex, code_off, sizeof(code_item_struct))) {
+		stats->truncated++;
+		return;
+	}
+	code_item = (code_item_struct *) (file + code_off);
+	if (!first_visit(dex, code_off)) {
+		// still carry the padding this item would have left behind
+		if (*code_item->tries_size > 0 && *code_item->insns_size % 2 == 1) *padding = 2;
+		stats->dup_code_items++;
+		return;
+	}
+	stats->code_items++;
+	stats->insns_units += *code_item->insns_size;
+	hist_add(stats->insns_hist, *code_item->insns_size);
+	if (*code_item->tries_size > 0) {  //There are tries, more space
+		stats->methods_with_tries++;
+		stats->try_items += *code_item->tries_size;
+		if (*code_item->insns_size % 2 == 1)  *padding = 2;
+	}
+	if (dex->opcodes) {
+		// instruction by instruction, and the handlers after the tries
+		paint_code_item(dex, code_off, virtual);
+	} else {
+		dc_add_region( regions,code_off, sizeof(code_item), virtual ? REGION_VIRTUAL_CODE_HEAD : REGION_DIRECT_CODE_HEAD);  // head of the method
+		dc_add_region( regions,code_off+sizeof(code_item), *code_item->insns_size * sizeof(u2) , virtual ? REGION_VIRTUAL_CODE : REGION_DIRECT_CODE);  // insns
+		if (*code_item->tries_size > 0)
+			dc_add_region( regions,code_off+sizeof(code_item)+*code_item->insns_size * sizeof(u2)+*padding, *code_item->tries_size * sizeof(try_item_struct) , REGION_TRIES);  // tries
+	}
+
+	if (*code_item->debug_info_off != 0 && !fits(dex, *code_item->debug_info_off, 1)) {
+		stats->truncated++;
+	} else if (*code_item->debug_info_off != 0 && !first_visit(dex, *code_item->debug_info_off)) {
+		stats->dup_debug_infos++;
+	} else if (*code_item->debug_info_off !=0) {
+		u1 *ptr2 = file + *code_item->debug_info_off;
+		int okay = 1;
+		stats->debug_infos++;
+		readUnsignedLeb128( &ptr2, dex->end, &okay); // line_start
+		u4 parameter_size = readUnsignedLeb128( &ptr2, dex->end, &okay); // parameter_size
+		skipUnsignedLeb128( &ptr2, dex->end, parameter_size, &okay);  // parameter_names array uleb128p1[parameters_size]
+		dc_add_region(regions, *code_item->debug_info_off, ptr2 - (file + *code_item->debug_info_off) , virtual ? REGION_VIRTUAL_DEBUG_INFO : REGION_DIRECT_DEBUG_INFO);  // debug info 
+		if (!okay) stats->truncated++;
+	}
+}
+
+static int Analize_class_data(dex_parse_t *dex, u4 offset)
+{
+	dex_stats_t *stats = dex->stats;
+	u4 static_fields_size;
+	u4 instance_fields_size;
+	u4 direct_methods_size;
+	u4 virtual_methods_size;
+	u4 i;
+	u4 code_off;
+	int padding = 0;
+	int okay = 1;
+	u1 *ptr;
+
+	if (!fits(dex, offset, 1)) {
+		stats->truncated++;
+		return 0;
+	}
+	ptr = dex->file + offset;
+	
+	static_fields_size = readUnsignedLeb128( &ptr, dex->end, &okay);
+	instance_fields_size = readUnsignedLeb128( &ptr, dex->end, &okay);
+	direct_methods_size = readUnsignedLeb128( &ptr, dex->end, &okay);
+	virtual_methods_size = readUnsignedLeb128( &ptr, dex->end, &okay);
+	stats->class_data++;
+	stats->fields += static_fields_size + instance_fields_size;
+	stats->direct_methods += direct_methods_size;
+	stats->virtual_methods += virtual_methods_size;
+
+	// field_idx_diff and access_flags of every static and instance field
+	skipUnsignedLeb128( &ptr, dex->end, ((u8) static_fields_size + instance_fields_size) * 2, &okay);
+	
+	for (i=0; i<direct_methods_size && okay; i++)
+	{
+		code_off = readMethodCodeOff( &ptr, dex->end, &okay);	// code_off  if 0 means abstract or native. Follow the code item.
+		if (code_off !=0 && okay) Analize_code_item(dex, code_off, &padding, 0);
+	}
+	
+	for (i=0; i<virtual_methods_size && okay; i++)
+	{
+		code_off = readMethodCodeOff( &ptr, dex->end, &okay);	// code_off  if 0 means abstract or native. Follow the code item.
+		if (code_off !=0 && okay) Analize_code_item(dex, code_off, &padding, 1);
+	}
+    
+     
+    u4 diff = ptr - (dex->file + offset);
+    dc_add_region (dex->regions, offset , diff , REGION_CLASS_DATA);  // Encoded values
+    if (!okay) stats->truncated++;
+    return okay;
+	}
+
+static int Analyze_encoded_value(dex_parse_t *dex, u4 offset)
+{
+	//encoded_array format  size=uleb128 + encoded_values[size]
+	//Analyze_encoded_value(&dexpng, fileinmemory, *class_def_list->static_values_off); // This is a dynamic structure
+	//printf("Analyzing encoded values\n");
+	u4 i;
+	u1 VaVt = 0;
+	int okay = 1;
+    u1 *ptr;
+    u4 result;
+
+    if (!fits(dex, offset, 1)) {
+        dex->stats->truncated++;
+        return 0;
+    }
+    ptr = dex->file + offset;
+    result = readUnsignedLeb128( &ptr, dex->end, &okay);
+    for (i=0; i<result && ptr < dex->end; i++)
+    {
+		VaVt = *(ptr++);  // (Value_arg << 5) | value_type
+		ptr+=(VaVt & 00000111)+1;  // extracting the size of the encoded value and move the pointer, do not care about value.
+	}
+    if (ptr > dex->end) {
+        ptr = dex->end;
+        okay = 0;
+    }
+    
+    u4 diff = ptr - (dex->file + offset);
+    dc_add_region (dex->regions, offset , diff , REGION_STATIC_VALUES);  // Encoded values
+    dex->stats->static_values++;
+    if (!okay) dex->stats->truncated++;
+    return okay;
+	}
+
+
+/* -- map_list walk --
+ * The other engine (-M). Instead of chasing offsets from the class
+ * definitions, read the map_list and decode every section front to back,
+ * one item after the other, so the file is read in order. Items nothing
+ * points at get painted too.
+ *
+ * The colour of some items still depends on who refers to them: a
+ * type_list is an interfaces list or prototype parameters, a code_item or
+ * debug_info belongs to a direct or a virtual method. The sections that
+ * refer are walked first and set a bit in dex->visited on every item to
+ * paint in the second colour: class_defs mark the interfaces lists,
+ * class_data the code of virtual methods, code_items the debug_info of
+ * virtual methods. */
+
+#define MAP_HEADER_ITEM             0x0000
+#define MAP_STRING_ID_ITEM          0x0001
+#define MAP_TYPE_ID_ITEM            0x0002
+#define MAP_PROTO_ID_ITEM           0x0003
+#define MAP_FIELD_ID_ITEM           0x0004
+#define MAP_METHOD_ID_ITEM          0x0005
+#define MAP_CLASS_DEF_ITEM          0x0006
+#define MAP_MAP_LIST                0x1000
+#define MAP_TYPE_LIST               0x1001
+#define MAP_ANNOTATION_SET_REF_LIST 0x1002
+#define MAP_ANNOTATION_SET_ITEM     0x1003
+#define MAP_CLASS_DATA_ITEM         0x2000
+#define MAP_CODE_ITEM               0x2001
+#define MAP_STRING_DATA_ITEM        0x2002
+#define MAP_DEBUG_INFO_ITEM         0x2003
+#define MAP_ANNOTATION_ITEM         0x2004
+#define MAP_ENCODED_ARRAY_ITEM      0x2005
+#define MAP_ANNOTATIONS_DIRECTORY   0x2006
+
+#define MAP_PASSES 3
+#define MAX_VALUE_DEPTH 64
+
+static inline void mark_item(dex_parse_t *dex, u4 offset)
+{
+	if (offset < dex->end - dex->file) dex->visited[offset >> 3] |= 1 << (offset & 7);
+}
+
+static inline int item_marked(dex_parse_t *dex, u4 offset)
+{
+	if (offset >= dex->end - dex->file) return 0;
+	return (dex->visited[offset >> 3] >> (offset & 7)) & 1;
+}
+
+static inline u1 *align_item(dex_parse_t *dex, u1 *ptr)
+{
+	return dex->file + ((ptr - dex->file + 3) & ~(size_t) 3);
+}
+
+/* A u4 count at ptr followed by count entries of entry_size bytes, or
+ * NULL if they run past the end. */
+static u1 *counted_list_end(dex_parse_t *dex, u1 *ptr, u4 entry_size)
+{
+	u4 count;
+
+	if (dex->end - ptr < sizeof(u4)) return NULL;
+	memcpy(&count, ptr, sizeof(u4));
+	if ((u8) count * entry_size > (u8) (dex->end - ptr) - sizeof(u4)) return NULL;
+	return ptr + sizeof(u4) + (u8) count * entry_size;
+}
+
+static int skip_encoded_value(dex_parse_t *dex, u1 **ptr, int depth);
+
+static int skip_encoded_array(dex_parse_t *dex, u1 **ptr, int depth)
+{
+	int okay = 1;
+	u4 size = readUnsignedLeb128(ptr, dex->end, &okay);
+	u4 i;
+
+	for (i = 0; i < size && okay; i++) okay = skip_encoded_value(dex, ptr, depth);
+	return okay;
+}
+
+static int skip_encoded_annotation(dex_parse_t *dex, u1 **ptr, int depth)
+{
+	int okay = 1;
+	u4 size, i;
+
+	readUnsignedLeb128(ptr, dex->end, &okay);  // type_idx
+	size = readUnsignedLeb128(ptr, dex->end, &okay);
+	for (i = 0; i < size && okay; i++) {
+		readUnsignedLeb128(ptr, dex->end, &okay);  // name_idx
+		if (okay) okay = skip_encoded_value(dex, ptr, depth);
+	}
+	return okay;
+}
+
+/* (value_arg << 5) | value_type, then value_arg + 1 bytes for the scalar
+ * types, nothing for null and boolean, a nested array or annotation for
+ * the rest. */
+static int skip_encoded_value(dex_parse_t *dex, u1 **ptr, int depth)
+{
+	u1 type, arg;
+
+	if (*ptr >= dex->end || depth > MAX_VALUE_DEPTH) return 0;
+	type = **ptr & 0x1f;
+	arg = **ptr >> 5;
+	(*ptr)++;
+	switch (type) {
+	case 0x1c: return skip_encoded_array(dex, ptr, depth + 1);
+	case 0x1d: return skip_encoded_annotation(dex, ptr, depth + 1);
+	case 0x1e:
+	case 0x1f: return 1;
+	}
+	if (dex->end - *ptr < arg + 1) return 0;
+	*ptr += arg + 1;
+	return 1;
+}
+
+/* The debug_info header and its state machine up to DBG_END_SEQUENCE. */
+static int skip_debug_info(dex_parse_t *dex, u1 **ptr)
+{
+	int okay = 1;
+	u4 parameters_size;
+
+	readUnsignedLeb128(ptr, dex->end, &okay);  // line_start
+	parameters_size = readUnsignedLeb128(ptr, dex->end, &okay);
+	skipUnsignedLeb128(ptr, dex->end, parameters_size, &okay);  // parameter_names
+	while (okay && *ptr < dex->end) {
+		switch (*((*ptr)++)) {
+		case 0x00:  // DBG_END_SEQUENCE
+			return 1;
+		case 0x01:  // DBG_ADVANCE_PC
+		case 0x02:  // DBG_ADVANCE_LINE
+		case 0x05:  // DBG_END_LOCAL
+		case 0x06:  // DBG_RESTART_LOCAL
+		case 0x09:  // DBG_SET_FILE
+			skipUnsignedLeb128(ptr, dex->end, 1, &okay);
+			break;
+		case 0x03:  // DBG_START_LOCAL
+			skipUnsignedLeb128(ptr, dex->end, 3, &okay);
+			break;
+		case 0x04:  // DBG_START_LOCAL_EXTENDED
+			skipUnsignedLeb128(ptr, dex->end, 4, &okay);
+			break;
+		default:    // prologue, epilogue and the special opcodes
+			break;
+		}
+	}
+	return 0;
+}
+
+static u1 *map_string_data(dex_parse_t *dex, u1 *ptr)
+{
+	dex_stats_t *stats = dex->stats;
+	u4 offset = ptr - dex->file;
+	int okay = 1;
+	u4 utf16_size = readUnsignedLeb128(&ptr, dex->end, &okay);
+	u1 *zero;
+
+	if (!okay) return NULL;
+	zero = memchr(ptr, 0, dex->end - ptr);
+	if (zero == NULL) return NULL;
+	dc_add_region(dex->regions, offset, ptr - (dex->file + offset), REGION_STRING_SIZE);
+	dc_add_region(dex->regions, ptr - dex->file, zero - ptr, REGION_STRING_DATA);
+	stats->strings++;
+	hist_add(stats->string_hist, utf16_size);
+	return zero + 1;
+}
+
+static u1 *map_type_list(dex_parse_t *dex, u1 *ptr)
+{
+	u4 offset = ptr - dex->file;
+	u1 *end = counted_list_end(dex, ptr, sizeof(u2));
+
+	if (end == NULL) return NULL;
+	if (item_marked(dex, offset)) {
+		dc_add_region(dex->regions, offset, end - ptr, REGION_INTERFACES);
+		dex->stats->interfaces++;
+	} else {
+		dc_add_region(dex->regions, offset, end - ptr, REGION_PROTO_PARAMETERS);
+		dex->stats->proto_parameters++;
+	}
+	return align_item(dex, end);
+}
+
+/* annotation_set_ref_list and annotation_set_item, lists of u4 offsets. */
+static u1 *map_annotation_set(dex_parse_t *dex, u1 *ptr)
+{
+	u1 *end = counted_list_end(dex, ptr, sizeof(u4));
+
+	if (end == NULL) return NULL;
+	dc_add_region(dex->regions, ptr - dex->file, end - ptr, REGION_ANNOTATIONS);
+	return align_item(dex, end);
+}
+
+static u1 *map_annotations_directory(dex_parse_t *dex, u1 *ptr)
+{
+	annotations_directory_item_struct *directory = (annotations_directory_item_struct *) ptr;
+	u8 size;
+
+	if (dex->end - ptr < sizeof(*directory)) return NULL;
+	size = sizeof(*directory) + ((u8) *directory->fields_size + *directory->annotated_methods_size +
+		*directory->annotated_parameters_size) * sizeof(u4) * 2;
+	if (size > dex->end - ptr) return NULL;
+	dc_add_region(dex->regions, ptr - dex->file, size, REGION_ANNOTATIONS);
+	dex->stats->annotations++;
+	return align_item(dex, ptr + size);
+}
+
+static u1 *map_annotation_item(dex_parse_t *dex, u1 *ptr)
+{
+	u1 *start = ptr++;  // visibility
+
+	if (ptr > dex->end || !skip_encoded_annotation(dex, &ptr, 0)) return NULL;
+	dc_add_region(dex->regions, start - dex->file, ptr - start, REGION_ANNOTATIONS);
+	return ptr;
+}
+
+static u1 *map_encoded_array(dex_parse_t *dex, u1 *ptr)
+{
+	u1 *start = ptr;
+
+	if (!skip_encoded_array(dex, &ptr, 0)) return NULL;
+	dc_add_region(dex->regions, start - dex->file, ptr - start, REGION_STATIC_VALUES);
+	dex->stats->static_values++;
+	return ptr;
+}
+
+static u1 *map_class_data(dex_parse_t *dex, u1 *ptr)
+{
+	dex_stats_t *stats = dex->stats;
+	u1 *start = ptr;
+	u4 static_fields_size, instance_fields_size, direct_methods_size, virtual_methods_size;
+	u4 i, code_off;
+	int okay = 1;
+
+	static_fields_size = readUnsignedLeb128(&ptr, dex->end, &okay);
+	instance_fields_size = readUnsignedLeb128(&ptr, dex->end, &okay);
+	direct_methods_size = readUnsignedLeb128(&ptr, dex->end, &okay);
+	virtual_methods_size = readUnsignedLeb128(&ptr, dex->end, &okay);
+	skipUnsignedLeb128(&ptr, dex->end, ((u8) static_fields_size + instance_fields_size) * 2, &okay);
+	// direct methods: method_idx_diff, access_flags, code_off
+	skipUnsignedLeb128(&ptr, dex->end, (u8) direct_methods_size * 3, &okay);
+	for (i = 0; i < virtual_methods_size && okay; i++) {
+		code_off = readMethodCodeOff(&ptr, dex->end, &okay);
+		if (code_off != 0 && okay) mark_item(dex, code_off);
+	}
+	if (!okay) return NULL;
+
+	dc_add_region(dex->regions, start - dex->file, ptr - start, REGION_CLASS_DATA);
+	stats->class_data++;
+	stats->fields += static_fields_size + instance_fields_size;
+	stats->direct_methods += direct_methods_size;
+	stats->virtual_methods += virtual_methods_size;
+	return ptr;
+}
+
+/* The header, insns, tries and the encoded_catch_handler_list after them,
+ * which has to be decoded to find the next item. */
+static u1 *map_code_item(dex_parse_t *dex, u1 *ptr)
+{
+	dex_stats_t *stats = dex->stats;
+	code_item_struct *code_item = (code_item_struct *) ptr;
+	u4 offset = ptr - dex->file;
+	int virtual = item_marked(dex, offset);
+	u4 handlers;
+	u1 *start;
+
+	if (dex->end - ptr < sizeof(*code_item)) return NULL;
+	if ((u8) *code_item->insns_size * sizeof(u2) > dex->end - ptr - sizeof(*code_item)) return NULL;
+	dc_add_region(dex->regions, offset, sizeof(*code_item), virtual ? REGION_VIRTUAL_CODE_HEAD : REGION_DIRECT_CODE_HEAD);
+	if (dex->opcodes) paint_insns(dex, offset + sizeof(*code_item), *code_item->insns_size);
+	else dc_add_region(dex->regions, offset + sizeof(*code_item), *code_item->insns_size * sizeof(u2),
+		virtual ? REGION_VIRTUAL_CODE : REGION_DIRECT_CODE);
+	stats->code_items++;
+	stats->insns_units += *code_item->insns_size;
+	hist_add(stats->insns_hist, *code_item->insns_size);
+	ptr += sizeof(*code_item) + *code_item->insns_size * sizeof(u2);
+
+	if (*code_item->tries_size > 0) {
+		if (*code_item->insns_size % 2 == 1) ptr += sizeof(u2);  // padding
+		if ((u8) *code_item->tries_size * sizeof(try_item_struct) > (u8) (dex->end - ptr)) return NULL;
+		dc_add_region(dex->regions, ptr - dex->file, *code_item->tries_size * sizeof(try_item_struct), REGION_TRIES);
+		stats->methods_with_tries++;
+		stats->try_items += *code_item->tries_size;
+		ptr += *code_item->tries_size * sizeof(try_item_struct);
+		start = ptr;
+		if (!skip_catch_handlers(&ptr, dex->end, &handlers)) return NULL;
+		if (dex->opcodes) {
+			dc_add_region(dex->regions, start - dex->file, ptr - start, REGION_HANDLERS);
+			stats->catch_handlers += handlers;
+		}
+	}
+	if (virtual && *code_item->debug_info_off != 0) mark_item(dex, *code_item->debug_info_off);
+	return align_item(dex, ptr);
+}
+
+static u1 *map_debug_info(dex_parse_t *dex, u1 *ptr)
+{
+	u1 *start = ptr;
+
+	if (!skip_debug_info(dex, &ptr)) return NULL;
+	dc_add_region(dex->regions, start - dex->file, ptr - start,
+		item_marked(dex, start - dex->file) ? REGION_VIRTUAL_DEBUG_INFO : REGION_DIRECT_DEBUG_INFO);
+	dex->stats->debug_infos++;
+	return ptr;
+}
+
+/* Which pass a section is walked in: the ones that mark (class_defs,
+ * class_data, code_item) before the ones they mark. */
+static int map_section_pass(u2 type)
+{
+	switch (type) {
+	case MAP_CODE_ITEM:
+		return 1;
+	case MAP_TYPE_LIST:
+	case MAP_DEBUG_INFO_ITEM:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static void map_walk_section(dex_parse_t *dex, u2 type, u4 count, u4 offset)
+{
+	region_list_t *regions = dex->regions;
+	dex_header *header = (dex_header *) dex->file;
+	class_def_struct *class_def;
+	u1 *(*walk_item)(dex_parse_t *dex, u1 *ptr);
+	u1 *ptr = dex->file + offset;
+	u4 i;
+
+	if (offset >= dex->end - dex->file) {
+		dex->stats->truncated++;
+		return;
+	}
+	switch (type) {
+	case MAP_HEADER_ITEM:
+		dc_add_region(regions, 0, *header->header_size, REGION_HEADER);
+		return;
+	case MAP_STRING_ID_ITEM:
+		dc_add_region(regions, offset, count * sizeof(string_id_struct), REGION_STRING_IDS);
+		return;
+	case MAP_TYPE_ID_ITEM:
+		dc_add_region(regions, offset, count * sizeof(type_id_struct), REGION_TYPE_IDS);
+		return;
+	case MAP_PROTO_ID_ITEM:
+		dc_add_region(regions, offset, count * sizeof(proto_id_struct), REGION_PROTO_IDS);
+		return;
+	case MAP_FIELD_ID_ITEM:
+		dc_add_region(regions, offset, count * sizeof(field_id_struct), REGION_FIELD_IDS);
+		return;
+	case MAP_METHOD_ID_ITEM:
+		dc_add_region(regions, offset, count * sizeof(method_id_struct), REGION_METHOD_IDS);
+		return;
+	case MAP_CLASS_DEF_ITEM:
+		dc_add_region(regions, offset, count * sizeof(class_def_struct), REGION_CLASS_DEFS);
+		for (i = 0; i < count && (u8) (i + 1) * sizeof(*class_def) <= dex->end - ptr; i++) {
+			class_def = (class_def_struct *) ptr + i;
+			if (*class_def->interfaces_off != 0) mark_item(dex, *class_def->interfaces_off);
+		}
+		return;
+	case MAP_MAP_LIST:
+		if (counted_list_end(dex, ptr, sizeof(map_item_struct)) != NULL)
+			dc_add_region(regions, offset, counted_list_end(dex, ptr, sizeof(map_item_struct)) - ptr, REGION_MAP);
+		return;
+	case MAP_STRING_DATA_ITEM:        walk_item = map_string_data; break;
+	case MAP_TYPE_LIST:               walk_item = map_type_list; break;
+	case MAP_ANNOTATION_SET_REF_LIST:
+	case MAP_ANNOTATION_SET_ITEM:     walk_item = map_annotation_set; break;
+	case MAP_ANNOTATIONS_DIRECTORY:   walk_item = map_annotations_directory; break;
+	case MAP_ANNOTATION_ITEM:         walk_item = map_annotation_item; break;
+	case MAP_ENCODED_ARRAY_ITEM:      walk_item = map_encoded_array; break;
+	case MAP_CLASS_DATA_ITEM:         walk_item = map_class_data; break;
+	case MAP_CODE_ITEM:               walk_item = map_code_item; break;
+	case MAP_DEBUG_INFO_ITEM:         walk_item = map_debug_info; break;
+	default:
+		// call sites, method handles, hiddenapi data: no colour of their own
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if (ptr >= dex->end || (ptr = walk_item(dex, ptr)) == NULL) {
+			dex->stats->truncated++;
+			return;
+		}
+	}
+}
+
+/* The phase a section's time goes to. class_data, code and debug_info are
+ * charged to PHASE_CLASS_DATA and PHASE_CLASS_DEFS both, as in the pointer
+ * walk where they are reached from the class definitions. */
+static int map_section_phase(u2 type)
+{
+	switch (type) {
+	case MAP_HEADER_ITEM:
+	case MAP_STRING_ID_ITEM:
+	case MAP_TYPE_ID_ITEM:
+	case MAP_PROTO_ID_ITEM:
+	case MAP_FIELD_ID_ITEM:
+	case MAP_METHOD_ID_ITEM:
+	case MAP_MAP_LIST:
+		return PHASE_TABLES;
+	case MAP_STRING_DATA_ITEM:
+		return PHASE_STRINGS;
+	case MAP_TYPE_LIST:
+		return PHASE_PROTOS;
+	case MAP_CLASS_DATA_ITEM:
+	case MAP_CODE_ITEM:
+	case MAP_DEBUG_INFO_ITEM:
+		return PHASE_CLASS_DATA;
+	default:
+		return PHASE_CLASS_DEFS;
+	}
+}
+
+/* Returns 0 without emitting anything if there is no map_list to walk. */
+static int walk_map_list(dex_parse_t *dex)
+{
+	dex_header *header = (dex_header *) dex->file;
+	region_list_t *regions = dex->regions;
+	map_item_struct *items;
+	phase_t phase;
+	u4 count, i;
+	int pass, id;
+
+	if (*header->map_off == 0 || *header->map_off >= dex->end - dex->file ||
+	    counted_list_end(dex, dex->file + *header->map_off, sizeof(map_item_struct)) == NULL)
+		return 0;
+	count = read_u4(dex, *header->map_off);
+	items = (map_item_struct *) (dex->file + *header->map_off + sizeof(u4));
+
+	regions->count = 0;
+	memset(dex->stats, 0, sizeof(*dex->stats));
+	dex->stats->classes = *header->class_defs_size;
+	check_header(dex);
+	if (*header->link_size != 0 && *header->link_off != 0)
+		dc_add_region(regions, *header->data_off + *header->data_size + *header->link_off, *header->link_size, REGION_LINK);
+
+	for (pass = 0; pass < MAP_PASSES; pass++) {
+		for (i = 0; i < count; i++) {
+			if (map_section_pass(*items[i].type) != pass) continue;
+			id = map_section_phase(*items[i].type);
+			dc_phase_begin(dex->timing, regions, &phase);
+			map_walk_section(dex, *items[i].type, *items[i].size, *items[i].offset);
+			dc_phase_end(dex->timing, regions, &phase, id);
+			if (id == PHASE_CLASS_DATA) dc_phase_end(dex->timing, regions, &phase, PHASE_CLASS_DEFS);
+		}
+	}
+	return 1;
+}
+
+
+/* -- compact run files --
+ * The runs of a dex on their own, see dcr_header_t. Gaps between runs are
+ * what the image paints black and are not stored, the runs of a classes.dex
+ * come to a few bytes each where its .ppn takes three per byte of dex. */
+
+static u1 *write_uleb128(u1 *ptr, u4 value)
+{
+	while (value > 0x7f) {
+		*ptr++ = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	*ptr++ = value;
+	return ptr;
+}
+
+int dc_is_dcr_file(const u1 *file, size_t size)
+{
+	return size >= 4 && memcmp(file, DCR_MAGIC, 4) == 0;
+}
+
+int dc_save_dcr_to_file (region_list_t *runs, const u1 *dex, const char *path)
+{
+	dex_header *dex_h = (dex_header *) dex;
+	dcr_header_t header;
+	dcr_block_t *blocks;
+	region_t *run;
+	u1 *data, *ptr;
+	u8 end = 0;
+	size_t i, block_count = (runs->count + DCR_BLOCK_RUNS - 1) / DCR_BLOCK_RUNS;
+	FILE *fp;
+	int ok;
+
+	// at most five bytes per uleb128 and the region byte
+	blocks = malloc(block_count * sizeof(dcr_block_t) + 1);
+	data = malloc(runs->count * 11 + 1);
+	if (blocks == NULL || data == NULL) {
+		free(blocks);
+		free(data);
+		return DC_ERR_NOMEM;
+	}
+	ptr = data;
+	for (i = 0; i < runs->count; i++) {
+		run = runs->regions + i;
+		if (i % DCR_BLOCK_RUNS == 0) {
+			blocks[i / DCR_BLOCK_RUNS].start = run->offset;
+			blocks[i / DCR_BLOCK_RUNS].pos = ptr - data;
+			end = run->offset;
+		}
+		ptr = write_uleb128(ptr, run->offset - end);
+		ptr = write_uleb128(ptr, run->len);
+		*ptr++ = run->type;
+		end = (u8) run->offset + run->len;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DCR_MAGIC, 4);
+	header.format = DCR_FORMAT;
+	header.dex_size = *dex_h->file_size;
+	memcpy(header.dex_version, dex_h->magic.ver, 3);
+	memcpy(header.signature, dex_h->signature, 20);
+	header.run_count = runs->count;
+	header.block_runs = DCR_BLOCK_RUNS;
+	header.block_count = block_count;
+	header.index_off = sizeof(header);
+	header.runs_off = header.index_off + block_count * sizeof(dcr_block_t);
+	header.runs_size = ptr - data;
+
+	fp = fopen(path, "wb");
+	ok = fp != NULL &&
+		fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		fwrite(blocks, sizeof(dcr_block_t), block_count, fp) == block_count &&
+		fwrite(data, 1, header.runs_size, fp) == header.runs_size;
+	if (fp != NULL && fclose(fp) != 0) ok = 0;
+	free(blocks);
+	free(data);
+	return ok ? DC_OK : DC_ERR_IO;
+}
+
+int dc_dcr_open (dcr_file_t *dcr, const u1 *data, size_t size)
+{
+	const dcr_header_t *header = (const dcr_header_t *) data;
+
+	if (size < sizeof(dcr_header_t) || !dc_is_dcr_file(data, size) || header->format != DCR_FORMAT ||
+	    header->block_runs == 0 ||
+	    header->block_count != ((u8) header->run_count + header->block_runs - 1) / header->block_runs ||
+	    header->index_off % 4 != 0 ||
+	    (u8) header->index_off + (u8) header->block_count * sizeof(dcr_block_t) > size ||
+	    (u8) header->runs_off + header->runs_size > size)
+		return DC_ERR_DCR;
+	dcr->header = header;
+	dcr->blocks = (const dcr_block_t *) (data + header->index_off);
+	dcr->runs = data + header->runs_off;
+	dcr->end = dcr->runs + header->runs_size;
+	return DC_OK;
+}
+
+/* Decode the next run of a block, *end is where the previous one ended.
+ * Returns 0 on a damaged run. */
+static int dcr_next_run(const dcr_file_t *dcr, const u1 **ptr, u8 *end, region_t *run)
+{
+	int okay = 1;
+	u4 gap, len;
+
+	gap = readUnsignedLeb128((u1 **) ptr, dcr->end, &okay);
+	len = readUnsignedLeb128((u1 **) ptr, dcr->end, &okay);
+	if (!okay || *ptr >= dcr->end || **ptr == REGION_NONE || **ptr >= REGION_COUNT ||
+	    *end + gap + len > 0xffffffffULL)
+		return 0;
+	run->offset = *end + gap;
+	run->len = len;
+	run->type = *(*ptr)++;
+	*end = (u8) run->offset + len;
+	return 1;
+}
+
+static size_t dcr_block_size(const dcr_file_t *dcr, size_t block)
+{
+	size_t first = block * dcr->header->block_runs;
+
+	return dcr->header->run_count - first < dcr->header->block_runs ?
+		dcr->header->run_count - first : dcr->header->block_runs;
+}
+
+int dc_dcr_find (const dcr_file_t *dcr, u4 offset, region_t *run)
+{
+	size_t lo = 0, hi = dcr->header->block_count, mid, k, n;
+	const u1 *ptr;
+	u8 end;
+
+	if (hi == 0 || dcr->blocks[0].start > offset) return 0;
+	// the last block starting at or before offset
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (dcr->blocks[mid].start <= offset) lo = mid;
+		else hi = mid;
+	}
+	if (dcr->blocks[lo].pos >= dcr->header->runs_size) return 0;
+	ptr = dcr->runs + dcr->blocks[lo].pos;
+	end = dcr->blocks[lo].start;
+	n = dcr_block_size(dcr, lo);
+	for (k = 0; k < n; k++) {
+		if (!dcr_next_run(dcr, &ptr, &end, run) || offset < run->offset) return 0;
+		if (offset < end) {
+			run->seq = lo * dcr->header->block_runs + k;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int dc_load_dcr (dc_context_t *ctx, const u1 *data, size_t size)
+{
+	dex_timing_t *timing = ctx->timed ? &ctx->timing : NULL;
+	dcr_file_t dcr;
+	region_t run;
+	phase_t phase;
+	const u1 *ptr;
+	u8 end;
+	size_t block, k, n;
+	int err;
+
+	err = dc_dcr_open(&dcr, data, size);
+	if (err != DC_OK) return err;
+	dc_phase_begin(timing, NULL, &phase);
+	ctx->regions.count = 0;
+	ctx->runs.count = 0;
+	ctx->warnings = 0;
+	for (block = 0; block < dcr.header->block_count; block++) {
+		if (dcr.blocks[block].pos >= dcr.header->runs_size) return DC_ERR_DCR;
+		ptr = dcr.runs + dcr.blocks[block].pos;
+		end = dcr.blocks[block].start;
+		n = dcr_block_size(&dcr, block);
+		for (k = 0; k < n; k++) {
+			if (!dcr_next_run(&dcr, &ptr, &end, &run) || end > dcr.header->dex_size) return DC_ERR_DCR;
+			if (dc_add_region(&ctx->runs, run.offset, run.len, run.type) != DC_OK) {
+				ctx->runs.count = 0;
+				return DC_ERR_NOMEM;
+			}
+		}
+	}
+	dc_phase_end(timing, NULL, &phase, PHASE_NORMALIZE);
+	ctx->timing.items[PHASE_NORMALIZE] += ctx->runs.count;
+	ctx->timing.bytes[PHASE_NORMALIZE] += dcr.header->runs_size;
+
+	ctx->file_size = dcr.header->dex_size;
+	dc_image_size(ctx->file_size, &ctx->width, &ctx->height);
+	return DC_OK;
+}
+
+
+/* -- APK input --
+ * An .apk is a zip. The central directory at the end lists every entry,
+ * the classes*.dex ones are picked from it and read in place: stored
+ * entries straight from the (mapped) file, deflated ones inflated into a
+ * buffer the caller keeps between files. Nothing goes through the disk. */
+
+#define ZIP_LOCAL_MAGIC 0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_END_MAGIC 0x06054b50
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+static inline u2 zip_u2(const u1 *p) { return p[0] | p[1] << 8; }
+static inline u4 zip_u4(const u1 *p) { return zip_u2(p) | (u4) zip_u2(p + 2) << 16; }
+
+int dc_is_zip_file(const u1 *file, size_t size)
+{
+	return size >= 4 && zip_u4(file) == ZIP_LOCAL_MAGIC;
+}
+
+/* classes.dex is 1, classesN.dex is N, anything else 0. Only entries at
+ * the root of the archive are dex files the runtime would load. */
+static u4 dex_entry_index(const u1 *name, u2 len)
+{
+	u4 index = 0;
+	u2 i;
+
+	if (len < 11 || memcmp(name, "classes", 7) != 0 || memcmp(name + len - 4, ".dex", 4) != 0)
+		return 0;
+	if (len == 11) return 1;
+	if (name[7] == '0' || len > 7 + 9 + 4) return 0;
+	for (i = 7; i < len - 4; i++) {
+		if (name[i] < '0' || name[i] > '9') return 0;
+		index = index * 10 + name[i] - '0';
+	}
+	return index > 1 ? index : 0;
+}
+
+static int compare_zip_entries(const void *a, const void *b)
+{
+	const zip_entry_t *x = a, *y = b;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* List the dex entries of a zip, in multidex order. Returns the number of
+ * entries (*entries is malloc'ed) or -1 when the central directory can't
+ * be found or runs past the file. Zip64 archives are not supported. */
+int dc_zip_find_dex_entries(const u1 *zip, size_t size, zip_entry_t **entries)
+{
+	const u1 *end = NULL, *p, *cd_end;
+	zip_entry_t *list = NULL;
+	size_t at, first;
+	u4 cd_offset, cd_size;
+	u2 name_len, total;
+	int count = 0, k;
+
+	*entries = NULL;
+	if (size < 22) return -1;
+	// the end record is the last 22 bytes plus a comment of up to 64K
+	first = size > 22 + 0xffff ? size - 22 - 0xffff : 0;
+	for (at = size - 22; end == NULL; at--) {
+		if (zip_u4(zip + at) == ZIP_END_MAGIC) end = zip + at;
+		if (at == first) break;
+	}
+	if (end == NULL) return -1;
+	total = zip_u2(end + 10);
+	cd_size = zip_u4(end + 12);
+	cd_offset = zip_u4(end + 16);
+	if (cd_offset == 0xffffffff || (u8) cd_offset + cd_size > (u8) (end - zip)) return -1;
+
+	list = calloc(total ? total : 1, sizeof(zip_entry_t));
+	if (list == NULL) return -1;
+	p = zip + cd_offset;
+	cd_end = p + cd_size;
+	for (k = 0; k < total; k++) {
+		if (p + 46 > cd_end || zip_u4(p) != ZIP_CENTRAL_MAGIC) break;
+		name_len = zip_u2(p + 28);
+		if (p + 46 + name_len > cd_end) break;
+		list[count].index = dex_entry_index(p + 46, name_len);
+		if (list[count].index) {
+			memcpy(list[count].name, p + 46, name_len);
+			list[count].name[name_len] = '\0';
+			list[count].method = zip_u2(p + 10);
+			list[count].compressed_size = zip_u4(p + 20);
+			list[count].size = zip_u4(p + 24);
+			list[count].local_offset = zip_u4(p + 42);
+			count++;
+		}
+		p += 46 + name_len + zip_u2(p + 30) + zip_u2(p + 32);
+	}
+	qsort(list, count, sizeof(zip_entry_t), compare_zip_entries);
+	*entries = list;
+	return count;
+}
+
+/* The bytes of one entry into *data. Stored entries point into the zip
+ * itself, deflated ones are inflated into *out, which grows as needed and
+ * is kept for the next entry. DC_ERR_ZIP on a damaged entry or an
+ * unsupported compression method. */
+static int zip_entry_data(const u1 *zip, size_t size, const zip_entry_t *entry,
+	z_stream *inflater, u1 **out, size_t *out_size, const u1 **data)
+{
+	const u1 *local = zip + entry->local_offset;
+	const u1 *stored;
+	u8 data_off;
+
+	*data = NULL;
+	if ((u8) entry->local_offset + 30 > size || zip_u4(local) != ZIP_LOCAL_MAGIC) return DC_ERR_ZIP;
+	// the local header may carry a different extra field than the central one
+	data_off = (u8) entry->local_offset + 30 + zip_u2(local + 26) + zip_u2(local + 28);
+	if (data_off + entry->compressed_size > size) return DC_ERR_ZIP;
+	stored = zip + data_off;
+
+	if (entry->method == ZIP_STORED) {
+		if (entry->compressed_size != entry->size) return DC_ERR_ZIP;
+		*data = stored;
+		return DC_OK;
+	}
+	if (entry->method != ZIP_DEFLATED) return DC_ERR_ZIP;
+
+	if (*out_size < entry->size) {
+		free(*out);
+		*out = malloc(entry->size);
+		*out_size = *out ? entry->size : 0;
+		if (*out == NULL) return DC_ERR_NOMEM;
+	}
+	if (inflateReset(inflater) != Z_OK) return DC_ERR_ZIP;
+	inflater->next_in = (u1 *) stored;
+	inflater->avail_in = entry->compressed_size;
+	inflater->next_out = *out;
+	inflater->avail_out = entry->size;
+	if (inflate(inflater, Z_FINISH) != Z_STREAM_END || inflater->total_out != entry->size)
+		return DC_ERR_ZIP;
+	*data = *out;
+	return DC_OK;
+}
+
+
+
+/* The three walks over the id tables, each over the entries [first, last)
+ * so that -P can hand out slices of them. */
+static void walk_strings(dex_parse_t *dex, u4 first, u4 last)
+{
+	u4 i;
+	dex_header* header = (dex_header *) dex->file;
+	string_id_struct* string_id_list;
+
+	// only the first string ever came out as ordered; [first, last) lies
+	// inside dex->strings, the entries that fit
+	for (i = first; i < last; i++) {
+		string_id_list = (string_id_struct *) (dex->file + *header->string_ids_off + sizeof(string_id_struct) * i);
+		ColorStrings(dex, *string_id_list->string_data_off, i == 0 && *header->string_ids_off > 0);
+	}
+}
+
+static void walk_protos(dex_parse_t *dex, u4 first, u4 last)
+{
+	u4 i;
+	dex_header* header = (dex_header *) dex->file;
+	proto_id_struct* proto_id_list;
+
+	for (i = first; i < last; i++) {
+		proto_id_list = (proto_id_struct *) (dex->file + *header->proto_ids_off + sizeof(proto_id_struct) * i);
+		if (*proto_id_list->parameters_off != 0 && !fits(dex, *proto_id_list->parameters_off, sizeof(u4))) {
+				dex->stats->truncated++;
+		} else if (*proto_id_list->parameters_off != 0) {  // It contains parameters ...
+				u4 listsize = read_u4(dex, *proto_id_list->parameters_off);
+				dc_add_region (dex->regions, *proto_id_list->parameters_off ,listsize*sizeof(type_id_struct)+sizeof(u4), REGION_PROTO_PARAMETERS);  // prototype parameters
+				dex->stats->proto_parameters++;
+			}
+	}
+}
+
+static void walk_class_def(dex_parse_t *dex, u4 i)
+{
+	u1 *fileinmemory = dex->file;
+	region_list_t *regions = dex->regions;
+	dex_stats_t *stats = dex->stats;
+	dex_header* header = (dex_header *)fileinmemory;
+	class_def_struct* class_def_list;
+	annotations_directory_item_struct* annotations_directory_list;
+	phase_t class_data_phase;
+
+        class_def_list = (class_def_struct *) (fileinmemory + *header->class_defs_off + sizeof(class_def_struct) *i);
+		// -- interfaces
+        if (*class_def_list->interfaces_off != 0 && !fits(dex, *class_def_list->interfaces_off, sizeof(u4))) {
+				stats->truncated++;
+		} else if (*class_def_list->interfaces_off != 0 && !first_visit(dex, *class_def_list->interfaces_off)) {
+				stats->dup_interfaces++;
+		} else if (*class_def_list->interfaces_off != 0) {  // It contains interfaces ...
+				u4 listsize = read_u4(dex, *class_def_list->interfaces_off);
+				dc_add_region (regions, *class_def_list->interfaces_off ,listsize*sizeof(type_id_struct)+sizeof(u4), REGION_INTERFACES);  // class interfaces
+				stats->interfaces++;
+		}
+		// -- annotations
+        if (*class_def_list->annotations_off != 0 && !fits(dex, *class_def_list->annotations_off, sizeof(annotations_directory_item_struct))) {
+				stats->truncated++;
+		} else if (*class_def_list->annotations_off != 0 && !first_visit(dex, *class_def_list->annotations_off)) {
+				stats->dup_annotations++;
+		} else if (*class_def_list->annotations_off != 0) {  // It contains interfaces ...
+				annotations_directory_list = (annotations_directory_item_struct *) (fileinmemory + *class_def_list->annotations_off);
+				u4 listsize = sizeof(annotations_directory_item_struct) + *annotations_directory_list->fields_size * sizeof(u4)*2;
+				listsize += (*annotations_directory_list->annotated_methods_size * sizeof(u4))*2;
+				listsize += (*annotations_directory_list->annotated_parameters_size * sizeof(u4))*2;
+				dc_add_region (regions, *class_def_list->annotations_off ,listsize+sizeof(u4), REGION_ANNOTATIONS);  // annotations
+				stats->annotations++;
+			}
+		// TODO : work with the offsets inside the annotations 
+		// -- class_data
+		if (*class_def_list->class_data_off != 0 && !first_visit(dex, *class_def_list->class_data_off)) {
+				stats->dup_class_data++;
+		} else if (*class_def_list->class_data_off != 0) {  // It contains data, that means not interface.
+				dc_phase_begin(dex->timing, regions, &class_data_phase);
+				Analize_class_data(dex, *class_def_list->class_data_off); // This is a dynamic structure
+				dc_phase_end(dex->timing, regions, &class_data_phase, PHASE_CLASS_DATA);
+			}
+		// -- static_values
+		if (*class_def_list->static_values_off != 0 && !first_visit(dex, *class_def_list->static_values_off)) {
+				stats->dup_static_values++;
+		} else if (*class_def_list->static_values_off != 0) {  // Offset to the list of initial values for static fields
+				//encoded_array format  size=uleb128 + encoded_values[size]
+				Analyze_encoded_value(dex, *class_def_list->static_values_off); // This is a dynamic structure
+		}
+}
+
+static int parse_parallel(dex_parse_t *dex);
+
+static void parse_dex_layout(dex_parse_t *dex)
+{
+	u4 i;
+	u1 *fileinmemory = dex->file;
+	region_list_t *regions = dex->regions;
+	dex_stats_t *stats = dex->stats;
+	dex_header* header = (dex_header *)fileinmemory;
+	phase_t phase;
+
+	regions->count = 0;
+	memset(stats, 0, sizeof(*stats));
+	stats->classes = *header->class_defs_size;
+	dc_phase_begin(dex->timing, regions, &phase);
+
+	check_header(dex);
+	check_tables(dex);
+	dc_add_region (regions, 0 ,*header->header_size, REGION_HEADER);  // header -- red
+
+	/* check the link stuff */
+	if (*header->link_size != 0 && *header->link_off !=0 ){
+		dc_add_region (regions, *header->data_off + *header->data_size+*header->link_off ,*header->link_size, REGION_LINK);  // link -- orange
+	}
+	
+	/* check the map stuff the offset should be in the data section*/
+	if (*header->map_off != 0 && !fits(dex, *header->map_off, sizeof(u4))) {
+		stats->truncated++;
+	} else if (*header->map_off != 0){
+		u4 mapsize = read_u4(dex, *header->map_off);
+		dc_add_region (regions, *header->map_off ,mapsize*sizeof(map_item_struct)+sizeof(u4), REGION_MAP);  // map -- blue
+	}
+
+
+    u2 strptr = sizeof(string_id_struct);
+
+	/* Print the string part of the header */
+	dc_add_region ( regions,*header->string_ids_off,*header->string_ids_size*strptr , REGION_STRING_IDS);  // string_ids  -- darkgreen
+	dc_add_region( regions, *header->type_ids_off, *header->type_ids_size*sizeof(type_id_struct), REGION_TYPE_IDS); // type_ids -- green
+	dc_add_region( regions, *header->proto_ids_off, *header->proto_ids_size*sizeof(proto_id_struct), REGION_PROTO_IDS); // proto ids -- greenblue
+	dc_add_region( regions, *header->field_ids_off, *header->field_ids_size*sizeof(field_id_struct), REGION_FIELD_IDS); // fields -- aquamarine  
+    dc_add_region( regions, *header->method_ids_off, *header->method_ids_size*sizeof(method_id_struct), REGION_METHOD_IDS); // Method ids  -- bluegreen 
+    dc_add_region( regions, *header->class_defs_off, *header->class_defs_size*sizeof(class_def_struct), REGION_CLASS_DEFS); // class defs  
+
+    dc_phase_end(dex->timing, regions, &phase, PHASE_TABLES);
+
+    if (dex->threads > 1 && parse_parallel(dex)) return;
+
+    // Color the strings
+    dc_phase_begin(dex->timing, regions, &phase);
+    walk_strings(dex, 0, dex->strings);
+    dc_phase_end(dex->timing, regions, &phase, PHASE_STRINGS);
+
+    //Color the prototypes parameters
+    dc_phase_begin(dex->timing, regions, &phase);
+    walk_protos(dex, 0, dex->protos);
+    dc_phase_end(dex->timing, regions, &phase, PHASE_PROTOS);
+	
+	// Working with the classes
+	dc_phase_begin(dex->timing, regions, &phase);
+    for (i= 0; i < dex->classes; i++) walk_class_def(dex, i);
+	dc_phase_end(dex->timing, regions, &phase, PHASE_CLASS_DEFS);
+}
+
+
+/* -- parallel walk --
+ * -P n splits the string_ids, proto_ids and class_defs tables in n slices
+ * and walks each on its own thread, into its own region list, counters and
+ * visited bitset. The slices are then merged in table order into what the
+ * serial walk would have emitted, region for region.
+ *
+ * Shared data items are what makes that hard: serially an item is painted
+ * once, by the first class to reach it. A worker only knows about its own
+ * slice, so it records the items it walked first, per class. The merge
+ * replays the classes in order against one global bitset: a class none of
+ * whose items was taken by an earlier class is copied as is, otherwise it
+ * is walked again right there, serially. Only classes sharing items across
+ * slices pay for that. */
+
+typedef struct {
+	size_t region_end;      // in the worker's list
+	size_t claim_end;
+	dex_stats_t stats;
+} class_walk_t;
+
+typedef struct {
+	dex_parse_t dex;
+	region_list_t regions;
+	claim_list_t claims;
+	dex_stats_t stats;      // strings and protos, each class has its own
+	dex_timing_t timing;
+	u4 strings_first, strings_last;
+	u4 protos_first, protos_last;
+	u4 classes_first, classes_last;
+	size_t strings_end;     // regions after the strings and after the protos
+	size_t protos_end;
+	class_walk_t *classes;  // shared, indexed by class_def
+	pthread_t thread;
+} parse_worker_t;
+
+/* Room for count more regions, else DC_ERR_NOMEM and list->nomem set. */
+static int reserve_regions(region_list_t *list, size_t count)
+{
+	region_t *regions;
+	size_t size = list->size;
+
+	if (list->count + count <= size) return DC_OK;
+	while (list->count + count > size) size = size ? size * 2 : 4096;
+	regions = realloc(list->regions, size * sizeof(region_t));
+	if (regions == NULL) {
+		list->nomem = 1;
+		return DC_ERR_NOMEM;
+	}
+	list->regions = regions;
+	list->size = size;
+	return DC_OK;
+}
+
+/* dc_add_region for a run of regions, renumbered in the order they land. */
+static void append_regions(region_list_t *list, const region_t *regions, size_t count)
+{
+	region_t *dst;
+	size_t i;
+
+	// a slice that emitted nothing may not have a list at all
+	if (count == 0 || reserve_regions(list, count) != DC_OK) return;
+	dst = list->regions + list->count;
+	memcpy(dst, regions, count * sizeof(region_t));
+	for (i = 0; i < count; i++) dst[i].seq = list->count + i;
+	list->count += count;
+}
+
+static void *parse_worker(void *arg)
+{
+	parse_worker_t *worker = arg;
+	dex_parse_t *dex = &worker->dex;
+	phase_t phase;
+	u4 i;
+
+	dc_phase_begin(dex->timing, dex->regions, &phase);
+	walk_strings(dex, worker->strings_first, worker->strings_last);
+	dc_phase_end(dex->timing, dex->regions, &phase, PHASE_STRINGS);
+	worker->strings_end = dex->regions->count;
+
+	dc_phase_begin(dex->timing, dex->regions, &phase);
+	walk_protos(dex, worker->protos_first, worker->protos_last);
+	dc_phase_end(dex->timing, dex->regions, &phase, PHASE_PROTOS);
+	worker->protos_end = dex->regions->count;
+
+	dc_phase_begin(dex->timing, dex->regions, &phase);
+	for (i = worker->classes_first; i < worker->classes_last; i++) {
+		dex->stats = &worker->classes[i].stats;
+		walk_class_def(dex, i);
+		worker->classes[i].region_end = dex->regions->count;
+		worker->classes[i].claim_end = worker->claims.count;
+	}
+	dc_phase_end(dex->timing, dex->regions, &phase, PHASE_CLASS_DEFS);
+	dex->stats = &worker->stats;
+	return NULL;
+}
+
+/* Copy class i from its worker if no earlier class took any of its items,
+ * else walk it again against the global bitset. */
+static void merge_class(dex_parse_t *dex, parse_worker_t *worker, u4 i, size_t *region, size_t *claim)
+{
+	class_walk_t *walk = &worker->classes[i];
+	u4 *claims = worker->claims.offsets;
+	u1 *visited = dex->visited;
+	size_t c;
+
+	for (c = *claim; c < walk->claim_end; c++)
+		if (visited[claims[c] >> 3] & (1 << (claims[c] & 7))) break;
+	if (c == walk->claim_end) {
+		for (c = *claim; c < walk->claim_end; c++) visited[claims[c] >> 3] |= 1 << (claims[c] & 7);
+		append_regions(dex->regions, worker->regions.regions + *region, walk->region_end - *region);
+		dc_add_stats(dex->stats, &walk->stats);
+	} else {
+		walk_class_def(dex, i);
+	}
+	*region = walk->region_end;
+	*claim = walk->claim_end;
+}
+
+/* Take the worker's timing: the walk phases ran side by side, so their wall
+ * time is the slowest worker's, bytes and items add up. */
+static void merge_timing(dex_timing_t *total, const dex_timing_t *timing)
+{
+	static const int phases[] = { PHASE_STRINGS, PHASE_PROTOS, PHASE_CLASS_DEFS, PHASE_CLASS_DATA };
+	int p, id;
+
+	for (p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+		id = phases[p];
+		if (timing->seconds[id] > total->seconds[id]) total->seconds[id] = timing->seconds[id];
+		total->bytes[id] += timing->bytes[id];
+		total->items[id] += timing->items[id];
+	}
+}
+
+static void slice(u4 count, int n, int k, u4 *first, u4 *last)
+{
+	*first = (u8) count * k / n;
+	*last = (u8) count * (k + 1) / n;
+}
+
+/* Returns 0 if it could not start or a slice ran out of memory, the
+ * caller then walks serially. */
+static int parse_parallel(dex_parse_t *dex)
+{
+	size_t size = dex->end - dex->file;
+	u4 classes = dex->classes;
+	parse_worker_t *workers;
+	class_walk_t *class_walks;
+	dex_timing_t *timing = dex->timing;
+	dex_parse_t merge;
+	phase_t phase;
+	size_t region, claim;
+	int n = dex->threads, k, started;
+	u4 i;
+
+	workers = calloc(n, sizeof(*workers));
+	class_walks = calloc(classes + 1, sizeof(*class_walks));
+	if (workers == NULL || class_walks == NULL) {
+		free(workers);
+		free(class_walks);
+		return 0;
+	}
+
+	for (k = 0; k < n; k++) {
+		parse_worker_t *worker = &workers[k];
+		worker->dex = *dex;
+		worker->dex.regions = &worker->regions;
+		worker->dex.stats = &worker->stats;
+		worker->dex.timing = timing ? &worker->timing : NULL;
+		worker->dex.visited = calloc(size / 8 + 1, 1);
+		worker->dex.claims = &worker->claims;
+		worker->dex.warnings = 0;
+		worker->classes = class_walks;
+		slice(dex->strings, n, k, &worker->strings_first, &worker->strings_last);
+		slice(dex->protos, n, k, &worker->protos_first, &worker->protos_last);
+		slice(classes, n, k, &worker->classes_first, &worker->classes_last);
+	}
+	for (started = 0; started < n; started++) {
+		if (workers[started].dex.visited == NULL ||
+		    pthread_create(&workers[started].thread, NULL, parse_worker, &workers[started]) != 0)
+			break;
+	}
+	for (k = 0; k < started; k++) pthread_join(workers[k].thread, NULL);
+
+	// a slice short of regions or claims can't be merged, nor can any of
+	// them without room for all: nothing is in dex yet, walk it serially
+	for (k = 0; k < started; k++)
+		if (workers[k].regions.nomem || workers[k].claims.nomem) started = 0;
+	for (region = 0, k = 0; k < started; k++) region += workers[k].regions.count;
+	if (started == n && reserve_regions(dex->regions, region) != DC_OK) {
+		dex->regions->nomem = 0;
+		started = 0;
+	}
+
+	if (started == n) {
+		// strings, protos, then classes, in table order
+		dc_phase_begin(timing, dex->regions, &phase);
+		for (k = 0; k < n; k++) {
+			append_regions(dex->regions, workers[k].regions.regions, workers[k].strings_end);
+			dc_add_stats(dex->stats, &workers[k].stats);
+			if (timing) merge_timing(timing, &workers[k].timing);
+		}
+		for (k = 0; k < n; k++)
+			append_regions(dex->regions, workers[k].regions.regions + workers[k].strings_end,
+				workers[k].protos_end - workers[k].strings_end);
+		merge = *dex;
+		merge.timing = NULL;
+		for (k = 0; k < n; k++) {
+			region = workers[k].protos_end;
+			claim = 0;
+			for (i = workers[k].classes_first; i < workers[k].classes_last; i++)
+				merge_class(&merge, &workers[k], i, &region, &claim);
+		}
+		dc_phase_end(timing, dex->regions, &phase, PHASE_MERGE);
+	}
+
+	for (k = 0; k < n; k++) {
+		free(workers[k].regions.regions);
+		free(workers[k].claims.offsets);
+		free(workers[k].dex.visited);
+	}
+	free(workers);
+	free(class_walks);
+	return started == n;
+}
+
+
+
+
+/* -- verification --
+ * The header carries an adler32 checksum of everything after it and a
+ * SHA-1 signature of everything after that. dc_verify recomputes both in
+ * one pass: the file goes by in chunks that fit in L1, each is summed and
+ * hashed while it is still there. adler32 takes 32 bytes a step on AVX2
+ * or 16 on SSSE3, SHA-1 runs on the SHA extensions; either falls back to
+ * plain C on CPUs without them. */
+
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552        // bytes before the sums could overflow a u4
+#define VERIFY_CHUNK 16384     // a multiple of the SHA-1 block
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+static u4 adler32_scalar (u4 adler, const u1 *data, size_t len)
+{
+	u4 s1 = adler & 0xffff, s2 = adler >> 16;
+	size_t n;
+
+	while (len > 0) {
+		n = len < ADLER_NMAX ? len : ADLER_NMAX;
+		len -= n;
+		while (n--) {
+			s1 += *data++;
+			s2 += s1;
+		}
+		s1 %= ADLER_BASE;
+		s2 %= ADLER_BASE;
+	}
+	return s2 << 16 | s1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Over a block of n bytes s1 grows by their sum and s2 by n times the s1
+ * it started from plus every byte weighted by how many bytes follow it,
+ * itself included. maddubs multiplies the bytes by those weights, sad
+ * adds them up; vps sums s1 at the start of each step, which is worth one
+ * step's length in s2. */
+__attribute__((target("ssse3")))
+static u4 adler32_ssse3 (u4 adler, const u1 *data, size_t len)
+{
+	const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i zero = _mm_setzero_si128();
+	u4 s1 = adler & 0xffff, s2 = adler >> 16;
+	__m128i vs1, vs2, vps, bytes;
+	u4 sums[4];
+	size_t n;
+
+	while (len >= 16) {
+		n = len / 16 < ADLER_NMAX / 16 ? len / 16 : ADLER_NMAX / 16;
+		len -= n * 16;
+		s2 += s1 * n * 16;
+		vs1 = vs2 = vps = zero;
+		while (n--) {
+			bytes = _mm_loadu_si128((const __m128i *) data);
+			data += 16;
+			vps = _mm_add_epi32(vps, vs1);
+			vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes, zero));
+			vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(bytes, weights), ones));
+		}
+		vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vps, 4));
+		_mm_storeu_si128((__m128i *) sums, vs1);
+		s1 += sums[0] + sums[2];
+		_mm_storeu_si128((__m128i *) sums, vs2);
+		s2 += sums[0] + sums[1] + sums[2] + sums[3];
+		s1 %= ADLER_BASE;
+		s2 %= ADLER_BASE;
+	}
+	return adler32_scalar(s2 << 16 | s1, data, len);
+}
+
+__attribute__((target("avx2")))
+static u4 adler32_avx2 (u4 adler, const u1 *data, size_t len)
+{
+	const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+		16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i zero = _mm256_setzero_si256();
+	u4 s1 = adler & 0xffff, s2 = adler >> 16;
+	__m256i vs1, vs2, vps, bytes;
+	u4 sums[8];
+	size_t n;
+
+	while (len >= 32) {
+		n = len / 32 < ADLER_NMAX / 32 ? len / 32 : ADLER_NMAX / 32;
+		len -= n * 32;
+		s2 += s1 * n * 32;
+		vs1 = vs2 = vps = zero;
+		while (n--) {
+			bytes = _mm256_loadu_si256((const __m256i *) data);
+			data += 32;
+			vps = _mm256_add_epi32(vps, vs1);
+			vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(bytes, zero));
+			vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+		}
+		vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(vps, 5));
+		_mm256_storeu_si256((__m256i *) sums, vs1);
+		s1 += sums[0] + sums[2] + sums[4] + sums[6];
+		_mm256_storeu_si256((__m256i *) sums, vs2);
+		s2 += sums[0] + sums[1] + sums[2] + sums[3] + sums[4] + sums[5] + sums[6] + sums[7];
+		s1 %= ADLER_BASE;
+		s2 %= ADLER_BASE;
+	}
+	return adler32_ssse3(s2 << 16 | s1, data, len);
+}
+#endif
+
+#define ROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+
+/* The schedule is kept as a ring of 16 words and the rounds unrolled, so
+ * the five working variables stay in registers. */
+#define SHA1_W(i) (w[(i) & 15] = ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+#define SHA1_ROUND(a, b, c, d, e, f, k, x) \
+	e += ROL(a, 5) + (f) + (k) + (x); \
+	b = ROL(b, 30)
+#define SHA1_F1(b, c, d) (d ^ (b & (c ^ d)))
+#define SHA1_F2(b, c, d) (b ^ c ^ d)
+#define SHA1_F3(b, c, d) ((b & c) | (d & (b | c)))
+#define SHA1_FIVE(i, F, k, X) \
+	SHA1_ROUND(a, b, c, d, e, F(b, c, d), k, X(i)); \
+	SHA1_ROUND(e, a, b, c, d, F(a, b, c), k, X(i + 1)); \
+	SHA1_ROUND(d, e, a, b, c, F(e, a, b), k, X(i + 2)); \
+	SHA1_ROUND(c, d, e, a, b, F(d, e, a), k, X(i + 3)); \
+	SHA1_ROUND(b, c, d, e, a, F(c, d, e), k, X(i + 4))
+#define SHA1_LOAD(i) (w[i] = (u4) data[4*(i)] << 24 | (u4) data[4*(i)+1] << 16 | (u4) data[4*(i)+2] << 8 | data[4*(i)+3])
+
+static void sha1_blocks_scalar (u4 state[5], const u1 *data, size_t blocks)
+{
+	u4 w[16], a, b, c, d, e;
+
+	for (; blocks > 0; blocks--, data += 64) {
+		a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+		SHA1_FIVE(0, SHA1_F1, 0x5a827999, SHA1_LOAD);
+		SHA1_FIVE(5, SHA1_F1, 0x5a827999, SHA1_LOAD);
+		SHA1_FIVE(10, SHA1_F1, 0x5a827999, SHA1_LOAD);
+		SHA1_ROUND(a, b, c, d, e, SHA1_F1(b, c, d), 0x5a827999, SHA1_LOAD(15));
+		SHA1_ROUND(e, a, b, c, d, SHA1_F1(a, b, c), 0x5a827999, SHA1_W(16));
+		SHA1_ROUND(d, e, a, b, c, SHA1_F1(e, a, b), 0x5a827999, SHA1_W(17));
+		SHA1_ROUND(c, d, e, a, b, SHA1_F1(d, e, a), 0x5a827999, SHA1_W(18));
+		SHA1_ROUND(b, c, d, e, a, SHA1_F1(c, d, e), 0x5a827999, SHA1_W(19));
+		SHA1_FIVE(20, SHA1_F2, 0x6ed9eba1, SHA1_W);
+		SHA1_FIVE(25, SHA1_F2, 0x6ed9eba1, SHA1_W);
+		SHA1_FIVE(30, SHA1_F2, 0x6ed9eba1, SHA1_W);
+		SHA1_FIVE(35, SHA1_F2, 0x6ed9eba1, SHA1_W);
+		SHA1_FIVE(40, SHA1_F3, 0x8f1bbcdc, SHA1_W);
+		SHA1_FIVE(45, SHA1_F3, 0x8f1bbcdc, SHA1_W);
+		SHA1_FIVE(50, SHA1_F3, 0x8f1bbcdc, SHA1_W);
+		SHA1_FIVE(55, SHA1_F3, 0x8f1bbcdc, SHA1_W);
+		SHA1_FIVE(60, SHA1_F2, 0xca62c1d6, SHA1_W);
+		SHA1_FIVE(65, SHA1_F2, 0xca62c1d6, SHA1_W);
+		SHA1_FIVE(70, SHA1_F2, 0xca62c1d6, SHA1_W);
+		SHA1_FIVE(75, SHA1_F2, 0xca62c1d6, SHA1_W);
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Four rounds per sha1rnds4, the message schedule computed four words at
+ * a time alongside. Step g of 20 uses words m0 and works ahead on the
+ * next three; the last steps compute some words nothing reads, which the
+ * compiler drops. */
+#define SHA1_STEP(f, e_next, e_prev, m0, m1, m2, m3) \
+	e_next = _mm_sha1nexte_epu32(e_next, m0); \
+	e_prev = abcd; \
+	m1 = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, e_next, f); \
+	m3 = _mm_sha1msg1_epu32(m3, m0); \
+	m2 = _mm_xor_si128(m2, m0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani (u4 state[5], const u1 *data, size_t blocks)
+{
+	const __m128i order = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e1, e_save, m0, m1, m2, m3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; blocks > 0; blocks--, data += 64) {
+		abcd_save = abcd;
+		e_save = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), order);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), order);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), order);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), order);
+		SHA1_STEP(0, e1, e0, m3, m0, m1, m2);
+		SHA1_STEP(0, e0, e1, m0, m1, m2, m3);
+		SHA1_STEP(1, e1, e0, m1, m2, m3, m0);
+		SHA1_STEP(1, e0, e1, m2, m3, m0, m1);
+		SHA1_STEP(1, e1, e0, m3, m0, m1, m2);
+		SHA1_STEP(1, e0, e1, m0, m1, m2, m3);
+		SHA1_STEP(1, e1, e0, m1, m2, m3, m0);
+		SHA1_STEP(2, e0, e1, m2, m3, m0, m1);
+		SHA1_STEP(2, e1, e0, m3, m0, m1, m2);
+		SHA1_STEP(2, e0, e1, m0, m1, m2, m3);
+		SHA1_STEP(2, e1, e0, m1, m2, m3, m0);
+		SHA1_STEP(2, e0, e1, m2, m3, m0, m1);
+		SHA1_STEP(3, e1, e0, m3, m0, m1, m2);
+		SHA1_STEP(3, e0, e1, m0, m1, m2, m3);
+		SHA1_STEP(3, e1, e0, m1, m2, m3, m0);
+		SHA1_STEP(3, e0, e1, m2, m3, m0, m1);
+
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+static u4 (*adler32_update) (u4 adler, const u1 *data, size_t len) = adler32_scalar;
+static void (*sha1_blocks) (u4 state[5], const u1 *data, size_t blocks) = sha1_blocks_scalar;
+
+__attribute__((constructor))
+static void select_verify (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) adler32_update = adler32_avx2;
+	else if (__builtin_cpu_supports("ssse3")) adler32_update = adler32_ssse3;
+	// no __builtin_cpu_supports("sha") in older compilers, ask cpuid
+	{
+		unsigned int eax, ebx, ecx, edx;
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) &&
+		    __builtin_cpu_supports("sse4.1"))
+			sha1_blocks = sha1_blocks_shani;
+	}
+#endif
+}
+
+/* The last block or two: the tail, 0x80, zeros and the length in bits. */
+static void sha1_finish (u4 state[5], const u1 *tail, size_t len, u8 total, u1 digest[20])
+{
+	u1 last[128];
+	size_t padded = len < 56 ? 64 : 128;
+	int i;
+
+	memset(last, 0, sizeof(last));
+	memcpy(last, tail, len);
+	last[len] = 0x80;
+	for (i = 0; i < 8; i++) last[padded - 1 - i] = (total * 8) >> (8 * i);
+	sha1_blocks(state, last, padded / 64);
+	for (i = 0; i < 20; i++) digest[i] = state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+int dc_verify (dc_context_t *ctx, const u1 *dex, size_t size, u4 *mismatch)
+{
+	dex_header *header = (dex_header *) dex;
+	u4 state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	const u1 *data = dex + 32, *end = dex + size;
+	u1 digest[20];
+	size_t n;
+	phase_t phase = { 0 };   // only read when timed, gcc can't tell
+	u4 checksum;
+
+	*mismatch = 0;
+	if (dc_dex_signature(dex, size, NULL, NULL) != DC_OK) return DC_ERR_NOT_DEX;
+	dc_phase_begin(ctx->timed ? &ctx->timing : NULL, NULL, &phase);
+
+	// the checksum starts at the signature, SHA-1 after it
+	checksum = adler32_update(1, dex + 12, 20);
+	while (end - data >= 64) {
+		n = end - data < VERIFY_CHUNK ? (end - data) & ~(size_t) 63 : VERIFY_CHUNK;
+		checksum = adler32_update(checksum, data, n);
+		sha1_blocks(state, data, n / 64);
+		data += n;
+	}
+	checksum = adler32_update(checksum, data, end - data);
+	sha1_finish(state, data, end - data, size - 32, digest);
+
+	if (checksum != *header->checksum) *mismatch |= DC_WARN_CHECKSUM;
+	if (memcmp(digest, header->signature, 20) != 0) *mismatch |= DC_WARN_SIGNATURE;
+	dc_phase_end(ctx->timed ? &ctx->timing : NULL, NULL, &phase, PHASE_VERIFY);
+	ctx->timing.items[PHASE_VERIFY]++;
+	ctx->timing.bytes[PHASE_VERIFY] += size;
+	return DC_OK;
+}
+
+
+
+/* -- context -- */
+
+void dc_init (dc_context_t *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void dc_free (dc_context_t *ctx)
+{
+	free(ctx->regions.regions);
+	free(ctx->runs.regions);
+	free(ctx->thumb.sums);
+	free(ctx->visited);
+	free(ctx->entropy);
+	free(ctx->inflated);
+	if (ctx->inflater_ready) inflateEnd(&ctx->inflater);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+const char *dc_strerror (int err)
+{
+	static const char *messages[DC_ERR_COUNT] = {
+		"no error",
+		"can't open or write the file",
+		"not a dex file",
+		"size of the file and reported filesize are different",
+		"out of memory",
+		"damaged or unsupported zip archive",
+		"not a .dcr file or a damaged one",
+	};
+
+	if (err < 0 || err >= DC_ERR_COUNT) return "unknown error";
+	return messages[err];
+}
+
+void dc_image_size (u4 file_size, size_t *width, size_t *height)
+{
+	*width = 256;
+	*height = round(file_size/256)+1;
+}
+
+int dc_dex_signature (const u1 *dex, size_t size, u1 signature[20], u4 *file_size)
+{
+	dex_header *header = (dex_header *) dex;
+
+	if (size < sizeof(dex_header) ||
+	    (strncmp(header->magic.dex,"dex",3) != 0) || 
+	    (strncmp(header->magic.newline,"\n",1) != 0) || 
+	    (strncmp(header->magic.zero,"\0",1) != 0 ) )
+		return DC_ERR_NOT_DEX;
+	if (signature != NULL) memcpy(signature, header->signature, 20);
+	if (file_size != NULL) *file_size = *header->file_size;
+	return DC_OK;
+}
+
+int dc_parse (dc_context_t *ctx, const u1 *dex, size_t size)
+{
+	dex_header *header = (dex_header *) dex;
+	dex_parse_t walk;
+	phase_t phase;
+	dex_timing_t *timing = ctx->timed ? &ctx->timing : NULL;
+	int err;
+
+	ctx->regions.count = 0;
+	ctx->regions.nomem = 0;
+	ctx->runs.count = 0;
+	ctx->warnings = 0;
+	if (dc_dex_signature(dex, size, NULL, NULL) != DC_OK) return DC_ERR_NOT_DEX;
+	if (size != *header->file_size) return DC_ERR_SIZE;
+
+	ctx->file_size = *header->file_size;
+	dc_image_size(ctx->file_size, &ctx->width, &ctx->height);
+
+	walk.file = (u1 *) dex;
+	walk.end = (u1 *) dex + size;
+	walk.regions = &ctx->regions;
+	walk.stats = &ctx->stats;
+	walk.timing = timing;
+	walk.warnings = 0;
+	if (ctx->visited_size < size / 8 + 1) {
+		free(ctx->visited);
+		ctx->visited = malloc(size / 8 + 1);
+		ctx->visited_size = ctx->visited ? size / 8 + 1 : 0;
+		if (ctx->visited == NULL) return DC_ERR_NOMEM;
+	}
+	memset(ctx->visited, 0, size / 8 + 1);
+	walk.visited = ctx->visited;
+	walk.threads = ctx->parse_threads;
+	walk.opcodes = ctx->opcodes;
+	walk.claims = NULL;
+	if (!ctx->map_walk) {
+		parse_dex_layout(&walk);
+	} else if (!walk_map_list(&walk)) {
+		walk.warnings |= DC_WARN_NO_MAP;
+		parse_dex_layout(&walk);
+	}
+	ctx->warnings = walk.warnings;
+	if (ctx->regions.nomem) return DC_ERR_NOMEM;
+
+	dc_phase_begin(timing, NULL, &phase);
+	err = dc_normalize_regions(&ctx->regions, &ctx->runs);
+	dc_phase_end(timing, NULL, &phase, PHASE_NORMALIZE);
+	if (err != DC_OK) return err;
+	ctx->timing.items[PHASE_NORMALIZE] += ctx->runs.count;
+	ctx->timing.bytes[PHASE_NORMALIZE] += ctx->runs.count * sizeof(region_t);
+	return DC_OK;
+}
+
+int dc_render (dc_context_t *ctx, bitmap_t *bitmap)
+{
+	phase_t phase;
+	dex_timing_t *timing = ctx->timed ? &ctx->timing : NULL;
+
+	if (bitmap->pixels == NULL) return DC_ERR_NOMEM;
+	dc_phase_begin(timing, NULL, &phase);
+	dc_rasterize_regions(&ctx->runs, bitmap);
+	dc_phase_end(timing, NULL, &phase, PHASE_RENDER);
+	ctx->timing.items[PHASE_RENDER] += bitmap->width * bitmap->height;
+	ctx->timing.bytes[PHASE_RENDER] += bitmap->width * bitmap->height * sizeof(pixel_t);
+	return DC_OK;
+}
+
+int dc_render_thumbnail (dc_context_t *ctx, bitmap_t *bitmap)
+{
+	phase_t phase;
+	dex_timing_t *timing = ctx->timed ? &ctx->timing : NULL;
+	size_t cells = bitmap->width * bitmap->height;
+
+	if (bitmap->pixels == NULL || cells == 0) return DC_ERR_NOMEM;
+	if (reserve_thumb_sums(ctx, cells) != DC_OK) return DC_ERR_NOMEM;
+	dc_phase_begin(timing, NULL, &phase);
+	ctx->thumb.width = bitmap->width;
+	ctx->thumb.height = bitmap->height;
+	ctx->thumb.full_width = ctx->width;
+	ctx->thumb.full_height = ctx->height;
+	if (dc_thumbnail_add_runs(&ctx->thumb, &ctx->runs) != DC_OK) return DC_ERR_NOMEM;
+	dc_thumbnail_finish(&ctx->thumb, bitmap);
+	dc_phase_end(timing, NULL, &phase, PHASE_RENDER);
+	ctx->timing.items[PHASE_RENDER] += cells;
+	ctx->timing.bytes[PHASE_RENDER] += cells * sizeof(pixel_t);
+	return DC_OK;
+}
+
+void dc_print_header (FILE *fp, const char *name, const u1 *dex)
+{
+	dex_header *header = (dex_header *) dex;
+
+	    fprintf(fp, "%-25s%6s\n","Dex file:",name);   
+	    fprintf(fp, "%-25s%6d\n","File size",*header->file_size);
+	    fprintf(fp, "%-25s%6d\n","Header Size(bytes)",*header->header_size);
+	    fprintf(fp, "%-33s0x%x\n","Header Size",*header->header_size);
+
+	    fprintf(fp, "\n\n");
+	    fprintf(fp, "%-25s%6d\n","Link_size",*header->link_size);
+	    fprintf(fp, "%-35s%6x hex\n","Link_offset", *header->link_off);
+	    fprintf(fp, "%-35s%6x hex\n","Map_offset", *header->map_off);
+	    fprintf(fp, "%-25s%6d\n","String_size", *header->string_ids_size);
+	    fprintf(fp, "%-35s%6x hex\n","String_Offset", *header->string_ids_off);
+	    fprintf(fp, "%-25s%6d\n","Type_size", *header->type_ids_size);
+	    fprintf(fp, "%-35s%6x hex\n","Type_offset", *header->type_ids_off);
+	    fprintf(fp, "%-25s%6d\n","Prototype_size", *header->proto_ids_size);
+	    fprintf(fp, "%-35s%6x hex\n","Prototype_offset", *header->proto_ids_off);
+	    fprintf(fp, "%-25s%6d\n","Field_size", *header->field_ids_size);
+	    fprintf(fp, "%-35s%6x hex\n","Field_offset", *header->field_ids_off);
+	    fprintf(fp, "%-25s%6d\n","Method_size", *header->method_ids_size);
+	    fprintf(fp, "%-35s%6x hex\n","Method_offset", *header->method_ids_off);
+	    fprintf(fp, "%-25s%6d\n","Class_size", *header->class_defs_size);
+	    fprintf(fp, "%-35s%6x hex\n","Class_offset", *header->class_defs_off);
+	    fprintf(fp, "%-25s%6d\n","Data_size", *header->data_size);
+	    fprintf(fp, "%-35s%6x hex\n","Data_offset", *header->data_off);
+	    fprintf(fp, "\n\n");
+}
+
+int dc_zip_entry_data (dc_context_t *ctx, const u1 *zip, size_t size, const zip_entry_t *entry, const u1 **data)
+{
+	int err;
+
+	*data = NULL;
+	if (!ctx->inflater_ready) {
+		memset(&ctx->inflater, 0, sizeof(ctx->inflater));
+		err = inflateInit2(&ctx->inflater, -MAX_WBITS);
+		if (err != Z_OK) return err == Z_MEM_ERROR ? DC_ERR_NOMEM : DC_ERR_ZIP;
+		ctx->inflater_ready = 1;
+	}
+	return zip_entry_data(zip, size, entry, &ctx->inflater, &ctx->inflated, &ctx->inflated_size, data);
+}